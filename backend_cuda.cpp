@@ -36,6 +36,7 @@ static inline int cuda_poll(std::vector<trusimd_hardware> *v) {
       return -1;
     }
     trusimd_hardware h;
+    memset((void *)&h, 0, sizeof(h));
     memcpy((void *)h.id, (void *)&i, sizeof(int));
     h.accelerator = TRUSIMD_CUDA;
     std::string buf("CUDA ");
@@ -275,6 +276,41 @@ static inline int cuda_retrieve_defaults(cudaStream_t *s,
   return 0;
 }
 
+// ----------------------------------------------------------------------------
+// Additional streams have their own cudaStream_t in param1, CUDA streams are
+// always in-order so flags are ignored
+
+static inline int cuda_create_stream(trusimd_hardware *h,
+                                     trusimd_hardware *stream, int) {
+  cuda_error_type = CUDART_ERROR;
+  cudaStream_t s;
+  cuda_errno = cudaStreamCreateWithFlags(&s, cudaStreamNonBlocking);
+  if (cuda_errno != cudaSuccess) {
+    trusimd_errno = TRUSIMD_ECUDA;
+    return -1;
+  }
+  *stream = *h;
+  memcpy((void *)stream->param1, (void *)&s, sizeof(cudaStream_t));
+  return 0;
+}
+
+static inline int cuda_destroy_stream(trusimd_hardware *stream) {
+  cuda_error_type = CUDART_ERROR;
+  cudaStream_t s;
+  memcpy((void *)&s, (void *)stream->param1, sizeof(cudaStream_t));
+  if (s == NULL) {
+    return 0;
+  }
+  cudaStreamSynchronize(s);
+  cuda_errno = cudaStreamDestroy(s);
+  memset((void *)stream->param1, 0, sizeof(stream->param1));
+  if (cuda_errno != cudaSuccess) {
+    trusimd_errno = TRUSIMD_ECUDA;
+    return -1;
+  }
+  return 0;
+}
+
 // ----------------------------------------------------------------------------
 
 static inline void *cuda_device_malloc(trusimd_hardware *h_, size_t n) {
@@ -355,6 +391,19 @@ static inline int cuda_copy_to_host(trusimd_hardware *h_, void *dst, void *src,
 }
 
 // ----------------------------------------------------------------------------
+// Kernels with reductions write one partial result per block into temporary
+// buffers, a second kernel named after the first one with a "_reduce" suffix
+// and run as one block combines them. Both use 8 bytes of shared memory per
+// thread and reduction.
+
+static inline void cuda_free_partials(trusimd_hardware *h,
+                                      std::vector<void *> const &partials) {
+  int error_type = cuda_error_type;
+  for (size_t i = 0; i < partials.size(); i++) {
+    cuda_device_free(h, partials[i]);
+  }
+  cuda_error_type = error_type;
+}
 
 static inline int cuda_compile_run(trusimd_hardware *h_, trusimd_kernel *k,
                                    int n, va_list ap) {
@@ -375,8 +424,20 @@ static inline int cuda_compile_run(trusimd_hardware *h_, trusimd_kernel *k,
     return -1;
   }
 
-  // Compile program
-  cuda_rtc_errno = nvrtcCompileProgram(prog, 0, NULL);
+  // Compile program with the precision policy of the kernel
+  const char *option;
+  switch (k->precision) {
+  case TRUSIMD_CONTRACT:
+    option = "--fmad=true";
+    break;
+  case TRUSIMD_FAST:
+    option = "--use_fast_math";
+    break;
+  default:
+    option = "--fmad=false";
+    break;
+  }
+  cuda_rtc_errno = nvrtcCompileProgram(prog, 1, &option);
   if (cuda_rtc_errno != NVRTC_SUCCESS) {
     // Get compilation logs
     cuda_error_type = CUDART_ERROR;
@@ -442,14 +503,14 @@ static inline int cuda_compile_run(trusimd_hardware *h_, trusimd_kernel *k,
     return -1;
   }
 
-  size_t nb_args = k->args.size() + 1;
+  size_t nb_args = k->args.size() + 1 + k->reductions.size();
   std::vector<char> args_value(sizeof(void *) * nb_args, 0);
   std::vector<void *> args_ptr(nb_args, NULL);
   for (size_t i = 0; i < nb_args; i++) {
     args_ptr[i] = (void *)&args_value[i * sizeof(void *)];
   }
   memcpy(args_ptr[0], (void *)&n, sizeof(int));
-  for (size_t i = 0; i < nb_args - 1; i++) {
+  for (size_t i = 0; i < k->args.size(); i++) {
     if (is_pointer(k->args[i])) {
       void *ptr = va_arg(ap, void *);
       memcpy(args_ptr[i + 1], (void *)&ptr, sizeof(void *));
@@ -478,16 +539,51 @@ static inline int cuda_compile_run(trusimd_hardware *h_, trusimd_kernel *k,
       }
     }
   }
-  if ((cuda_cu_errno = cuLaunchKernel(kernel, (n + 127) / 128, 0, 0, 128, 0, 0,
-                                      0, s, &args_ptr[0], NULL)) !=
+  int nb_blocks = (n + 127) / 128;
+  std::vector<void *> partials;
+  for (size_t i = 0; i < k->reductions.size(); i++) {
+    size_t elem_size = size_t(k->reductions[i].t.width / 8);
+    void *ptr =
+        cuda_device_malloc(h_, size_t(std::max(nb_blocks, 1)) * elem_size);
+    if (ptr == NULL) {
+      cuda_free_partials(h_, partials);
+      cuModuleUnload(module);
+      return -1;
+    }
+    partials.push_back(ptr);
+    memcpy(args_ptr[k->args.size() + 1 + i], (void *)&ptr, sizeof(void *));
+  }
+  cuda_error_type = CU_ERROR;
+  unsigned int shared = unsigned(8 * 128 * k->reductions.size());
+  if ((cuda_cu_errno = cuLaunchKernel(kernel, nb_blocks, 1, 1, 128, 1, 1,
+                                      shared, s, &args_ptr[0], NULL)) !=
       CUDA_SUCCESS) {
+    cuda_free_partials(h_, partials);
     cuModuleUnload(module);
     return -1;
   }
-  if ((cuda_cu_errno = cuCtxSynchronize()) != CUDA_SUCCESS) {
+  if (!k->reductions.empty()) {
+    CUfunction reduce;
+    memcpy(args_ptr[0], (void *)&nb_blocks, sizeof(int));
+    if ((cuda_cu_errno = cuModuleGetFunction(
+             &reduce, module, (k->name + "_reduce").c_str())) !=
+            CUDA_SUCCESS ||
+        (cuda_cu_errno = cuLaunchKernel(reduce, 1, 1, 1, 128, 1, 1, shared, s,
+                                        &args_ptr[0], NULL)) !=
+            CUDA_SUCCESS) {
+      cuda_free_partials(h_, partials);
+      cuModuleUnload(module);
+      return -1;
+    }
+  }
+  // Wait for the launches on this stream only, other streams of the device
+  // keep running, the partials and the module are released afterwards
+  if ((cuda_cu_errno = cuStreamSynchronize(s)) != CUDA_SUCCESS) {
+    cuda_free_partials(h_, partials);
     cuModuleUnload(module);
     return -1;
   }
+  cuda_free_partials(h_, partials);
   cuModuleUnload(module);
   return 0;
 }
@@ -502,6 +598,12 @@ static inline void *cuda_device_malloc(trusimd_hardware *, size_t) {
   return NULL;
 }
 static inline void cuda_device_free(trusimd_hardware *, void *) {}
+static inline int cuda_create_stream(trusimd_hardware *, trusimd_hardware *,
+                                     int) {
+  trusimd_errno = TRUSIMD_EAVAIL;
+  return -1;
+}
+static inline int cuda_destroy_stream(trusimd_hardware *) { return 0; }
 static inline int cuda_copy_to_host(trusimd_hardware *, void *, void *,
                                        size_t) {
   trusimd_errno = TRUSIMD_EAVAIL;
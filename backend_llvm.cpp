@@ -1,6 +1,8 @@
 #ifdef WITH_LLVM
+#include <llvm/Config/llvm-config.h>
 #include <llvm/ADT/StringRef.h>
 #include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/Triple.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IRReader/IRReader.h>
@@ -10,14 +12,38 @@
 #include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/Error.h>
 #include <llvm/ExecutionEngine/GenericValue.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
 #include <llvm/ExecutionEngine/Orc/LLJIT.h>
 #include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
 #include <llvm/Passes/PassBuilder.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <future>
+#include <condition_variable>
 
 // ----------------------------------------------------------------------------
 
 TRUSIMD_TLS char llvm_error[256];
 
+// ----------------------------------------------------------------------------
+// Known SIMD extensions, x86 ones are sorted so that each one comes after
+// the ones it implies
+
+static const char *llvm_known_features[] = {
+    "sse",      "sse2",       "sse3",       "ssse3", "sse4.1",
+    "sse4.2",   "avx",        "avx2",       "avx512f", "avx512bw",
+    "avx512vl", "avx512bf16", "avx512fp16", "neon",  "asimd"};
+
+static const int llvm_simd_widths[] = {128, 128, 128, 128, 128, 128, 256, 256,
+                                       512, 512, 512, 512, 512, 128, 128};
+
+static const int llvm_nb_x86_features = 13;
+
 // ----------------------------------------------------------------------------
 
 static inline int llvm_poll(std::vector<trusimd_hardware> *v) {
@@ -26,19 +52,20 @@ static inline int llvm_poll(std::vector<trusimd_hardware> *v) {
   if (!llvm::sys::getHostCPUFeatures(features)) {
     return -1;
   }
-  const char *known_features[] = {"sse",    "sse2", "sse3", "ssse3", "sse4.1",
-                                  "sse4.2", "avx",  "avx2", "neon",  "asimd"};
-  const int simd_width[] = {128, 128, 128, 128, 128, 128, 256, 256, 128, 128};
-  for (int i = 0; i < int(sizeof(known_features) / sizeof(const char *));
+  for (int i = 0; i < int(sizeof(llvm_known_features) / sizeof(const char *));
        i++) {
-    if (features.find(known_features[i]) != features.end()) {
+    // LLVM also reports features that are known but not available
+    llvm::StringMap<bool>::const_iterator it =
+        features.find(llvm_known_features[i]);
+    if (it != features.end() && it->second) {
       std::string buf("LLVM ");
       buf += cpu.str();
       buf += ' ';
-      buf += known_features[i];
+      buf += llvm_known_features[i];
       trusimd_hardware h;
-      strcpy(h.id, known_features[i]);
-      memcpy((void *)h.param1, (void *)&simd_width[i], sizeof(int));
+      memset((void *)&h, 0, sizeof(h));
+      strcpy(h.id, llvm_known_features[i]);
+      memcpy((void *)h.param1, (void *)&llvm_simd_widths[i], sizeof(int));
       h.accelerator = TRUSIMD_LLVM;
       my_strlcpy(h.description, buf.c_str(), sizeof(h.description));
       v->push_back(h);
@@ -53,8 +80,20 @@ static inline const char *llvm_strerror(void) { return llvm_error; }
 
 // ----------------------------------------------------------------------------
 
-static inline void *llvm_device_malloc(trusimd_hardware *, size_t n) {
-  void *res = malloc(n);
+// Alignment of device buffers, rounded up to a power of two that the system
+// allocator accepts
+
+static inline long llvm_alignment(trusimd_hardware *h) {
+  long alignment = get_option(h, TRUSIMD_ALIGNMENT);
+  long res = long(sizeof(void *));
+  while (res < alignment) {
+    res *= 2;
+  }
+  return res;
+}
+
+static inline void *llvm_device_malloc(trusimd_hardware *h, size_t n) {
+  void *res = aligned_malloc(size_t(llvm_alignment(h)), n);
   if (res == NULL) {
     trusimd_errno = TRUSIMD_ENOMEM;
   }
@@ -63,61 +102,359 @@ static inline void *llvm_device_malloc(trusimd_hardware *, size_t n) {
 
 // ----------------------------------------------------------------------------
 
+static inline void *llvm_device_malloc_shared(trusimd_hardware *h, size_t n,
+                                              void **host_ptr) {
+  void *res = llvm_device_malloc(h, n);
+  *host_ptr = res;
+  return res;
+}
+
+// ----------------------------------------------------------------------------
+
 static inline void llvm_device_free(trusimd_hardware *, void *ptr) {
-  free(ptr);
+  aligned_free(ptr);
 }
 
 // ----------------------------------------------------------------------------
 
 int llvm_copy_to_device(trusimd_hardware *, void *dst, void *src, size_t n) {
-  memcpy(dst, src, n);
+  if (dst != src) {
+    memcpy(dst, src, n);
+  }
   return 0;
 }
 
 // ----------------------------------------------------------------------------
 
 int llvm_copy_to_host(trusimd_hardware *, void *dst, void *src, size_t n) {
-  memcpy(dst, src, n);
+  if (dst != src) {
+    memcpy(dst, src, n);
+  }
   return 0;
 }
 
 // ----------------------------------------------------------------------------
 
-static inline void llvm_ir_replace(std::string *s_, size_t pos,
-                                   std::string const &r) {
-  std::string &s = *s_;
-  for (size_t i = 0; i < r.size(); i++) {
-    s[pos + i] = r[i];
+static inline int llvm_simd_width(trusimd_hardware *h) {
+  int simd_width;
+  memcpy((void *)&simd_width, (void *)h->param1, sizeof(int));
+  return simd_width;
+}
+
+static inline int llvm_vector_length(trusimd_hardware *h, kernel *k) {
+  // The number of lanes is given by the narrowest element type so that it
+  // fills a whole register, wider types are split by LLVM into several ones
+  return llvm_simd_width(h) /
+         (k->min_vector_width == 0 ? 32 : k->min_vector_width);
+}
+
+// Replace vector lengths left as "??????????", alignments left as
+// "?align=N?" and fast-math flags left as "?fmf?" in the LLVM IR, the tail
+// of the loop is either the scalar loop or one masked vector iteration
+static inline const char *llvm_fast_math_flags(int precision) {
+  switch (precision) {
+  case TRUSIMD_CONTRACT:
+    return " contract";
+  case TRUSIMD_FAST:
+    return " fast";
+  default:
+    return "";
   }
 }
 
-static inline int llvm_compile_run(trusimd_hardware *h_, kernel *k, int n,
-                                   va_list ap) {
-  using namespace llvm;
-  trusimd_hardware &h = *h_;
+static inline std::string llvm_ir_finalize(kernel *k, int vector_length,
+                                           bool masked_tail, long alignment) {
+  std::string ir, buf;
+  if (masked_tail) {
+    ir = k->llvm_ir_vec.substr(0, k->llvm_ir_tail_pos) + k->llvm_ir_msk +
+         "}\n";
+    for (std::set<std::string>::const_iterator it = k->llvm_ir_decls.begin();
+         it != k->llvm_ir_decls.end(); ++it) {
+      ir += "\n" + *it;
+    }
+  } else {
+    ir = k->llvm_ir_vec;
+  }
+  print_T(&buf, vector_length);
+  std::string res;
+  res.reserve(ir.size());
+  size_t i = 0;
+  for (;;) {
+    size_t j = ir.find('?', i);
+    if (j == std::string::npos) {
+      res.append(ir, i, std::string::npos);
+      return res;
+    }
+    res.append(ir, i, j - i);
+    if (!ir.compare(j, 7, "?align=")) {
+      size_t l = ir.find('?', j + 7);
+      long elem_size = atol(ir.substr(j + 7, l - j - 7).c_str());
+      long a = alignment;
+      if (elem_size > 0) {
+        a = std::min(a, elem_size * vector_length);
+      }
+      print_T(&res, a);
+      i = l + 1;
+    } else if (!ir.compare(j, 5, "?fmf?")) {
+      res += llvm_fast_math_flags(k->precision);
+      i = j + 5;
+    } else {
+      res += buf;
+      i = j + 10 /* 10 = sizeof("??????????") */;
+    }
+  }
+}
 
-  // TODO: First we set the vector width
-  // In the meantime we assume floats/int... so we take simd_width / 4
-  std::string buf;
-  int simd_length;
-  memcpy((void *)&simd_length, (void *)h.param1, sizeof(int));
-  simd_length /= 32;
-  print_T(&buf, simd_length);
-  buf += std::string(10 /* 10 = sizeof("??????????") */ - buf.size(), ' ');
-  for (size_t i = 0; i < k->type_pos.size(); i++) {
-    llvm_ir_replace(&k->llvm_ir_vec, k->type_pos[i], buf);
+// ----------------------------------------------------------------------------
+// Persistent pool of threads that execute a kernel over [0, n) by chunks.
+// Each participant owns a range of chunk indices, takes chunks from its front
+// and, once it runs dry, steals the back half of another participant's range.
+// The launching thread is participant 0.
+
+typedef void (*llvm_kernel_fn)(long, long, char *);
+
+struct llvm_chunk_range {
+  std::mutex mutex;
+  long lo, hi;
+};
+
+class llvm_thread_pool {
+private:
+  std::mutex launch_mutex, mutex;
+  std::condition_variable cv_work, cv_done;
+  std::vector<std::thread> threads;
+  std::vector<std::unique_ptr<llvm_chunk_range> > ranges;
+  unsigned long generation;
+  int nb_participants, nb_running;
+  bool stop;
+
+  // Current launch
+  llvm_kernel_fn f;
+  char *args;
+  long n, chunk;
+
+  bool pop(int i, long *c) {
+    llvm_chunk_range &r = *ranges[size_t(i)];
+    std::lock_guard<std::mutex> lock(r.mutex);
+    if (r.lo >= r.hi) {
+      return false;
+    }
+    *c = r.lo++;
+    return true;
+  }
+
+  bool steal(int i) {
+    for (int d = 1; d < nb_participants; d++) {
+      llvm_chunk_range &victim = *ranges[size_t((i + d) % nb_participants)];
+      long lo, hi;
+      {
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        long remaining = victim.hi - victim.lo;
+        if (remaining <= 0) {
+          continue;
+        }
+        hi = victim.hi;
+        lo = hi - (remaining + 1) / 2;
+        victim.hi = lo;
+      }
+      llvm_chunk_range &r = *ranges[size_t(i)];
+      std::lock_guard<std::mutex> lock(r.mutex);
+      r.lo = lo;
+      r.hi = hi;
+      return true;
+    }
+    return false;
   }
-  std::cout << k->llvm_ir_vec << std::endl;
+
+  void work(int i) {
+    for (;;) {
+      long c;
+      while (pop(i, &c)) {
+        long begin = c * chunk;
+        f(begin, std::min(n, begin + chunk), args);
+      }
+      if (!steal(i)) {
+        return;
+      }
+    }
+  }
+
+  void worker(int i) {
+    unsigned long seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_work.wait(lock, [&] { return stop || generation != seen; });
+        if (stop) {
+          return;
+        }
+        seen = generation;
+        if (i >= nb_participants) {
+          continue;
+        }
+      }
+      work(i);
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--nb_running == 0) {
+        cv_done.notify_one();
+      }
+    }
+  }
+
+public:
+  llvm_thread_pool()
+      : generation(0), nb_participants(0), nb_running(0), stop(false) {
+    ranges.push_back(std::unique_ptr<llvm_chunk_range>(new llvm_chunk_range));
+  }
+
+  ~llvm_thread_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    cv_work.notify_all();
+    for (size_t i = 0; i < threads.size(); i++) {
+      threads[i].join();
+    }
+  }
+
+  void launch(llvm_kernel_fn f_, char *args_, long n_, long chunk_,
+              int nb_threads) {
+    std::lock_guard<std::mutex> launch_lock(launch_mutex);
+
+    // Workers are idle here so the pool can safely grow
+    while (int(ranges.size()) < nb_threads) {
+      ranges.push_back(
+          std::unique_ptr<llvm_chunk_range>(new llvm_chunk_range));
+    }
+    while (int(threads.size()) < nb_threads - 1) {
+      threads.push_back(std::thread(&llvm_thread_pool::worker, this,
+                                    int(threads.size()) + 1));
+    }
+
+    // Spread chunks evenly among participants
+    long nb_chunks = (n_ + chunk_ - 1) / chunk_;
+    for (int i = 0; i < nb_threads; i++) {
+      ranges[size_t(i)]->lo = nb_chunks * i / nb_threads;
+      ranges[size_t(i)]->hi = nb_chunks * (i + 1) / nb_threads;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      f = f_;
+      args = args_;
+      n = n_;
+      chunk = chunk_;
+      nb_participants = nb_threads;
+      nb_running = nb_threads - 1;
+      generation++;
+    }
+    cv_work.notify_all();
+    work(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    cv_done.wait(lock, [&] { return nb_running == 0; });
+  }
+};
+
+static llvm_thread_pool llvm_pool;
+
+// ----------------------------------------------------------------------------
+// Compiled kernels are kept alive (JIT session and function pointer) in a
+// process-wide cache. The key is made of the hardware id, its SIMD width and
+// a hash of the finalized LLVM IR so that launching the same kernel again
+// only costs a lookup. Entries are inserted before being compiled, either
+// in the background by trusimd_prepare_kernel or by the first launch, so
+// that the compilation happens only once and outside of the cache lock.
+// Destroying an entry waits for its compilation, this must not be done while
+// holding the cache lock.
+
+struct llvm_cache_entry {
+  std::unique_ptr<llvm::orc::LLJIT> jit;
+  llvm_kernel_fn f;
+  std::shared_future<int> built; // 0 or -1 when compilation failed
+  char error[sizeof(llvm_error)];
+};
+
+typedef std::shared_ptr<llvm_cache_entry> llvm_cache_entry_ptr;
+
+static std::mutex llvm_cache_mutex;
+static std::map<std::string, llvm_cache_entry_ptr> llvm_cache;
+static trusimd_cache_stats llvm_cache_stats = {0, 0, 0, 0.0};
+
+static inline std::string llvm_cache_key(trusimd_hardware *h, kernel *k,
+                                         int vector_length, bool masked_tail,
+                                         long alignment) {
+  std::string key(h->id, strnlen(h->id, sizeof(h->id)));
+  key += '/';
+  print_T(&key, vector_length);
+  key += (masked_tail ? "/m/" : "/s/");
+  print_T(&key, alignment);
+  key += '/';
+  print_T(&key, k->precision);
+  key += '/';
+  print_T(&key, k->llvm_ir_hash);
+  return key;
+}
+
+// Target machine for the host CPU restricted to the SIMD extension of the
+// selected hardware: all host features are given explicitly and x86 ones
+// above the selected one are disabled (which disables what depends on them)
+static inline llvm::orc::JITTargetMachineBuilder
+llvm_target_machine_builder(trusimd_hardware *h) {
+  using namespace llvm;
+  orc::JITTargetMachineBuilder JTMB((Triple(sys::getProcessTriple())));
+  JTMB.setCPU(sys::getHostCPUName().str());
+  JTMB.setCodeGenOptLevel(CodeGenOpt::Aggressive);
+  StringMap<bool> features;
+  std::vector<std::string> v;
+  if (sys::getHostCPUFeatures(features)) {
+    for (StringMap<bool>::const_iterator it = features.begin();
+         it != features.end(); ++it) {
+      v.push_back((it->second ? "+" : "-") + it->getKey().str());
+    }
+  }
+  int i = 0;
+  for (; i < llvm_nb_x86_features; i++) {
+    if (!strncmp(h->id, llvm_known_features[i], sizeof(h->id))) {
+      break;
+    }
+  }
+  for (i++; i < llvm_nb_x86_features; i++) {
+    v.push_back(std::string("-") + llvm_known_features[i]);
+  }
+  JTMB.addFeatures(v);
+  return JTMB;
+}
+
+static std::once_flag llvm_init_flag;
+
+static inline int llvm_compile(llvm_cache_entry *entry, trusimd_hardware *h,
+                               std::string const &name,
+                               std::string const &llvm_ir) {
+  using namespace llvm;
 
   // This is mandatory (once is enough though)
-  InitializeNativeTarget();
+  std::call_once(llvm_init_flag, []() {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+  });
+
+  // Target machine used by the optimizer and the JIT
+  orc::JITTargetMachineBuilder JTMB(llvm_target_machine_builder(h));
+  auto TM = JTMB.createTargetMachine();
+  if (!TM) {
+    Error err = TM.takeError();
+    std::stringstream ss;
+    ss << "LLVM JIT: " << toString(std::move(err));
+    my_strlcpy(llvm_error, ss.str().c_str(), sizeof(llvm_error));
+    trusimd_errno = TRUSIMD_ELLVM;
+    return -1;
+  }
 
   // Some needed stuff (I fail to see why these defaults are necessary)
   orc::ThreadSafeContext tls_context(std::make_unique<LLVMContext>());
 
   // LLVM object that represents the LLVM IR
-  std::unique_ptr<MemoryBuffer> ir =
-      MemoryBuffer::getMemBuffer(k->llvm_ir_vec.c_str());
+  std::unique_ptr<MemoryBuffer> ir = MemoryBuffer::getMemBuffer(llvm_ir);
 
   // Parse the LLVM IR
   SMDiagnostic diag;
@@ -135,14 +472,29 @@ static inline int llvm_compile_run(trusimd_hardware *h_, kernel *k, int n,
     return -1;
   }
 
+  M->setDataLayout(TM.get()->createDataLayout());
+  M->setTargetTriple(TM.get()->getTargetTriple().str());
+
+  // Make the code generator use registers of the selected width, otherwise
+  // it may split 512-bits vectors in two on some AVX-512 CPUs
+  std::string width;
+  print_T(&width, llvm_simd_width(h));
+  for (Module::iterator it = M->begin(); it != M->end(); ++it) {
+    it->addFnAttr("target-cpu", TM.get()->getTargetCPU());
+    it->addFnAttr("target-features", TM.get()->getTargetFeatureString());
+    it->addFnAttr("min-legal-vector-width", width);
+    it->addFnAttr("prefer-vector-width", width);
+  }
+
   // Create the analysis managers.
   LoopAnalysisManager LAM;
   FunctionAnalysisManager FAM;
   CGSCCAnalysisManager CGAM;
   ModuleAnalysisManager MAM;
 
-  // Create the new pass manager builder.
-  PassBuilder PB;
+  // Create the new pass manager builder, it queries the target machine for
+  // the cost model of the vectorizers
+  PassBuilder PB(TM.get().get());
 
   // Register all the basic analyses with the managers.
   PB.registerModuleAnalyses(MAM);
@@ -153,14 +505,20 @@ static inline int llvm_compile_run(trusimd_hardware *h_, kernel *k, int n,
 
   // Create the pass manager.
   // This one corresponds to a typical -O3 optimization pipeline.
+#if LLVM_VERSION_MAJOR >= 14
+  ModulePassManager MPM =
+      PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3);
+#else
   ModulePassManager MPM =
       PB.buildPerModuleDefaultPipeline(PassBuilder::OptimizationLevel::O3);
+#endif
 
   // Optimize the IR!
   MPM.run(*M.get(), MAM);
 
   // Create the JIT engine
-  auto JIT = orc::LLJITBuilder().create();
+  auto JIT =
+      orc::LLJITBuilder().setJITTargetMachineBuilder(std::move(JTMB)).create();
   if (!JIT) {
     Error err = JIT.takeError();
     std::stringstream ss;
@@ -169,6 +527,21 @@ static inline int llvm_compile_run(trusimd_hardware *h_, kernel *k, int n,
     trusimd_errno = TRUSIMD_ELLVM;
     return -1;
   }
+
+  // Intrinsics without an instruction on the target (fma without FMA3...)
+  // become calls to the math library of the process
+  auto generator = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+      JIT.get()->getDataLayout().getGlobalPrefix());
+  if (!generator) {
+    Error err = generator.takeError();
+    std::stringstream ss;
+    ss << "LLVM JIT: " << toString(std::move(err));
+    my_strlcpy(llvm_error, ss.str().c_str(), sizeof(llvm_error));
+    trusimd_errno = TRUSIMD_ELLVM;
+    return -1;
+  }
+  JIT.get()->getMainJITDylib().addGenerator(std::move(generator.get()));
+
   Error err = JIT.get()->addIRModule(
       orc::ThreadSafeModule(std::move(M), std::move(tls_context)));
   if (err) {
@@ -179,12 +552,91 @@ static inline int llvm_compile_run(trusimd_hardware *h_, kernel *k, int n,
     return -1;
   }
 
-  // Copy arguments
+  // Retrieve function
+  auto func = JIT.get()->lookup(name.c_str());
+  if (!func) {
+    err = func.takeError();
+    std::stringstream ss;
+    ss << "LLVM JIT: " << toString(std::move(err));
+    my_strlcpy(llvm_error, ss.str().c_str(), sizeof(llvm_error));
+    trusimd_errno = TRUSIMD_ELLVM;
+    return -1;
+  }
+  entry->f = (llvm_kernel_fn)func.get().getAddress();
+  entry->jit = std::move(JIT.get());
+
+  return 0;
+}
+
+static inline int llvm_build(llvm_cache_entry *entry, trusimd_hardware *h,
+                             std::string const &name,
+                             std::string const &llvm_ir) {
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  int code = llvm_compile(entry, h, name, llvm_ir);
+  if (code == -1) {
+    memcpy((void *)entry->error, (void *)llvm_error, sizeof(llvm_error));
+  }
+  std::lock_guard<std::mutex> lock(llvm_cache_mutex);
+  llvm_cache_stats.build_time +=
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - t0)
+          .count();
+  return code;
+}
+
+// Find the kernel in cache, on a miss insert it and start compiling it in
+// the background or when the caller waits for it
+static inline llvm_cache_entry_ptr
+llvm_get_entry(trusimd_hardware *h, kernel *k, bool background,
+               long alignment) {
+  int vector_length = llvm_vector_length(h, k);
+  bool masked_tail = (get_option(h, TRUSIMD_MASKED_TAIL) != 0);
+  std::string key(llvm_cache_key(h, k, vector_length, masked_tail, alignment));
+  std::lock_guard<std::mutex> lock(llvm_cache_mutex);
+  std::map<std::string, llvm_cache_entry_ptr>::iterator it =
+      llvm_cache.find(key);
+  if (it != llvm_cache.end()) {
+    if (!background) {
+      llvm_cache_stats.hits++;
+    }
+    return it->second;
+  }
+  llvm_cache_stats.misses++;
+  llvm_cache_entry_ptr entry(new llvm_cache_entry);
+  llvm_cache_entry *e = entry.get();
+  trusimd_hardware hw = *h;
+  std::string name(k->name);
+  std::string llvm_ir(
+      llvm_ir_finalize(k, vector_length, masked_tail, alignment));
+  entry->built = std::async(background ? std::launch::async
+                                       : std::launch::deferred,
+                            [e, hw, name, llvm_ir]() mutable {
+                              return llvm_build(e, &hw, name, llvm_ir);
+                            })
+                     .share();
+  llvm_cache[key] = entry;
+  llvm_cache_stats.nb_entries = llvm_cache.size();
+  return entry;
+}
+
+static inline int llvm_prepare_kernel(trusimd_hardware *h, kernel *k) {
+  llvm_get_entry(h, k, true, llvm_alignment(h));
+  return 0;
+}
+
+static inline int llvm_compile_run(trusimd_hardware *h, kernel *k, int n,
+                                   va_list ap) {
+  // Copy arguments, the alignment of device buffers is the one of the
+  // pointers actually given as the option may have been raised since they
+  // were allocated or pointers may point inside buffers
+  long alignment = llvm_alignment(h);
   size_t nb_args = k->args.size();
   std::vector<char> args(8 * nb_args);
   for (size_t i = 0; i < nb_args; i++) {
     if (is_pointer(k->args[i])) {
       void *ptr = va_arg(ap, void *);
+      while (alignment > 1 && size_t(ptr) % size_t(alignment) != 0) {
+        alignment /= 2;
+      }
       memcpy((void *)&args[8 * i], (void *)&ptr, sizeof(void *));
     } else {
       switch(k->args[i].width) {
@@ -212,19 +664,76 @@ static inline int llvm_compile_run(trusimd_hardware *h_, kernel *k, int n,
     }
   }
 
-  // Execute function
-  auto func = JIT.get()->lookup(k->name.c_str());
-  if (!func) {
-    err = JIT.takeError();
-    std::stringstream ss;
-    ss << "LLVM JIT: " << toString(std::move(err));
-    my_strlcpy(llvm_error, ss.str().c_str(), sizeof(llvm_error));
+  // Find the compiled kernel in cache, compile it on a miss or wait for its
+  // compilation if it is underway
+  int vector_length = llvm_vector_length(h, k);
+  llvm_cache_entry_ptr entry(llvm_get_entry(h, k, false, alignment));
+  if (entry->built.get() == -1) {
+    memcpy((void *)llvm_error, (void *)entry->error, sizeof(llvm_error));
     trusimd_errno = TRUSIMD_ELLVM;
     return -1;
   }
-  auto f = (void (*)(long, char *))func.get().getAddress();
-  f(long(n), &args[0]);
+  llvm_kernel_fn f = entry->f;
+
+  // Execute function, chunks are multiple of the vector length so that only
+  // the last one goes through the tail
+  long nb_threads = get_option(h, TRUSIMD_NB_THREADS);
+  if (nb_threads <= 0) {
+    nb_threads = long(std::thread::hardware_concurrency());
+    nb_threads = (nb_threads <= 0 ? 1 : nb_threads);
+  }
+  long chunk = get_option(h, TRUSIMD_CHUNK_SIZE);
+  if (chunk <= 0) {
+    chunk = std::max(long(n) / (4 * nb_threads), 1024L);
+  }
+  chunk = (chunk + vector_length - 1) / vector_length * vector_length;
+  if (nb_threads == 1 || chunk >= long(n)) {
+    f(0, long(n), args.empty() ? NULL : &args[0]);
+  } else {
+    llvm_pool.launch(f, args.empty() ? NULL : &args[0], long(n), chunk,
+                     int(std::min(nb_threads, (long(n) + chunk - 1) / chunk)));
+  }
+
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
 
+static inline int llvm_get_cache_stats(trusimd_cache_stats *stats) {
+  std::lock_guard<std::mutex> lock(llvm_cache_mutex);
+  *stats = llvm_cache_stats;
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+static inline int llvm_evict_kernel(trusimd_hardware *h, kernel *k) {
+  // Evicted entries are destroyed after the lock is released
+  std::map<std::string, llvm_cache_entry_ptr> evicted;
+  std::lock_guard<std::mutex> lock(llvm_cache_mutex);
+  if (k == NULL) {
+    evicted.swap(llvm_cache);
+  } else {
+    // Remove all variants (tail mode, alignment, precision) of the kernel
+    std::string prefix(h->id, strnlen(h->id, sizeof(h->id)));
+    prefix += '/';
+    std::string suffix("/");
+    print_T(&suffix, k->llvm_ir_hash);
+    std::map<std::string, llvm_cache_entry_ptr>::iterator it =
+        llvm_cache.begin();
+    while (it != llvm_cache.end()) {
+      std::string const &key = it->first;
+      if (!key.compare(0, prefix.size(), prefix) &&
+          key.size() >= suffix.size() &&
+          !key.compare(key.size() - suffix.size(), suffix.size(), suffix)) {
+        evicted.insert(*it);
+        it = llvm_cache.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  llvm_cache_stats.nb_entries = llvm_cache.size();
   return 0;
 }
 
@@ -237,6 +746,11 @@ static inline void *llvm_device_malloc(trusimd_hardware *, size_t) {
   trusimd_errno = TRUSIMD_EAVAIL;
   return NULL;
 }
+static inline void *llvm_device_malloc_shared(trusimd_hardware *, size_t,
+                                              void **) {
+  trusimd_errno = TRUSIMD_EAVAIL;
+  return NULL;
+}
 static inline void llvm_device_free(trusimd_hardware *, void *) {}
 static inline int llvm_copy_to_device(trusimd_hardware *, void *, void *, size_t) {
   trusimd_errno = TRUSIMD_EAVAIL;
@@ -246,10 +760,21 @@ static inline int llvm_copy_to_host(trusimd_hardware *, void *, void *, size_t)
   trusimd_errno = TRUSIMD_EAVAIL;
   return -1;
 }
+static inline int llvm_prepare_kernel(trusimd_hardware *, kernel *) {
+  trusimd_errno = TRUSIMD_EAVAIL;
+  return -1;
+}
 static inline int llvm_compile_run(trusimd_hardware *, kernel *, int,
                                    va_list) {
   trusimd_errno = TRUSIMD_EAVAIL;
   return -1;
 }
+static inline int llvm_get_cache_stats(trusimd_cache_stats *stats) {
+  memset((void *)stats, 0, sizeof(trusimd_cache_stats));
+  return 0;
+}
+static inline int llvm_evict_kernel(trusimd_hardware *, kernel *) {
+  return 0;
+}
 #endif
 
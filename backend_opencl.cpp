@@ -1,5 +1,8 @@
 #ifdef WITH_OPENCL
-#define CL_TARGET_OPENCL_VERSION 120
+// OpenCL 2.0 for shared virtual memory and 2.1 for SPIR-V modules, older
+// devices still use the 1.2 entry points deprecated since
+#define CL_TARGET_OPENCL_VERSION 210
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #if defined (__APPLE__) || defined(MACOSX)
 #include <OpenCL/opencl.h>
 #else
@@ -7,6 +10,14 @@
 #endif
 
 #include <iostream>
+#include <fstream>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <cstdio>
 
 // ----------------------------------------------------------------------------
 
@@ -181,6 +192,45 @@ static inline const char *opencl_strerror(void) {
 
 // ----------------------------------------------------------------------------
 
+static inline std::string opencl_device_info(cl_device_id d,
+                                             cl_device_info param) {
+  size_t size;
+  if (clGetDeviceInfo(d, param, 0, NULL, &size) != CL_SUCCESS) {
+    return std::string();
+  }
+  std::vector<char> buf(size + 1, 0);
+  if (clGetDeviceInfo(d, param, size, &buf[0], NULL) != CL_SUCCESS) {
+    return std::string();
+  }
+  return std::string(&buf[0]);
+}
+
+// Version of the device as 100 * major + 10 * minor, 0 when unknown
+static inline int opencl_device_version(cl_device_id d) {
+  int major, minor;
+  if (sscanf(opencl_device_info(d, CL_DEVICE_VERSION).c_str(), "OpenCL %d.%d",
+             &major, &minor) != 2) {
+    return 0;
+  }
+  return 100 * major + 10 * minor;
+}
+
+// clCreateCommandQueue is deprecated on OpenCL 2.0 devices
+static inline cl_command_queue
+opencl_create_queue(cl_context c, cl_device_id d,
+                    cl_command_queue_properties props) {
+#ifdef CL_VERSION_2_0
+  if (opencl_device_version(d) >= 200) {
+    cl_queue_properties qprops[] = {CL_QUEUE_PROPERTIES,
+                                    (cl_queue_properties)props, 0};
+    return clCreateCommandQueueWithProperties(c, d, qprops, &opencl_errno);
+  }
+#endif
+  return clCreateCommandQueue(c, d, props, &opencl_errno);
+}
+
+// ----------------------------------------------------------------------------
+
 static inline int opencl_retrieve_defaults(cl_context *c_,
                                            cl_command_queue *q_,
                                            trusimd_hardware *h_) {
@@ -188,100 +238,1504 @@ static inline int opencl_retrieve_defaults(cl_context *c_,
   cl_context c;
   cl_command_queue q;
 
-  void *tmp1, *tmp2;
-  memcpy((void *)&tmp1, (void *)h.param1, sizeof(void *));
-  memcpy((void *)&tmp2, (void *)h.param2, sizeof(void *));
-  if (tmp1 == NULL && tmp2 == NULL) {
-    // Create context attached to selected platform and device
-    cl_platform_id p;
-    memcpy((void *)&p, (void *)h.id, sizeof(cl_platform_id));
-    cl_context_properties cprops[] = {CL_CONTEXT_PLATFORM,
-                                      (cl_context_properties)p,
-                                      (cl_context_properties)0};
-    cl_device_id d;
-    memcpy((void *)&d, (void *)(h.id + sizeof(void *)), sizeof(cl_device_id));
-    c = clCreateContext(cprops, 1, &d, NULL, NULL, &opencl_errno);
-    if (opencl_errno != CL_SUCCESS) {
-      trusimd_errno = TRUSIMD_OPENCL;
-      return -1;
+  void *tmp1, *tmp2;
+  memcpy((void *)&tmp1, (void *)h.param1, sizeof(void *));
+  memcpy((void *)&tmp2, (void *)h.param2, sizeof(void *));
+  if (tmp1 == NULL && tmp2 == NULL) {
+    // Create context attached to selected platform and device
+    cl_platform_id p;
+    memcpy((void *)&p, (void *)h.id, sizeof(cl_platform_id));
+    cl_context_properties cprops[] = {CL_CONTEXT_PLATFORM,
+                                      (cl_context_properties)p,
+                                      (cl_context_properties)0};
+    cl_device_id d;
+    memcpy((void *)&d, (void *)(h.id + sizeof(void *)), sizeof(cl_device_id));
+    c = clCreateContext(cprops, 1, &d, NULL, NULL, &opencl_errno);
+    if (opencl_errno != CL_SUCCESS) {
+      trusimd_errno = TRUSIMD_OPENCL;
+      return -1;
+    }
+
+    // Create queue attached to context
+    q = opencl_create_queue(c, d,
+                            get_option(h_, TRUSIMD_PROFILING) != 0
+                                ? CL_QUEUE_PROFILING_ENABLE
+                                : 0);
+    if (opencl_errno != CL_SUCCESS) {
+      clReleaseContext(c);
+      trusimd_errno = TRUSIMD_OPENCL;
+      return -1;
+    }
+    memcpy((void *)h.param1, (void *)&c, sizeof(cl_context_properties));
+    memcpy((void *)h.param2, (void *)&q, sizeof(cl_command_queue));
+  }
+
+  // Fill arguments that are not NULL
+  if (c_) {
+    memcpy((void *)c_, (void *)h.param1, sizeof(cl_context_properties));
+  }
+  if (q_) {
+    memcpy((void *)q_, (void *)h.param2, sizeof(cl_command_queue));
+  }
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Additional streams share the context of their hardware and have their own
+// queue in param2, everything else works unchanged on them
+
+static inline int opencl_create_stream(trusimd_hardware *h,
+                                       trusimd_hardware *stream, int flags) {
+  cl_context c;
+  if (opencl_retrieve_defaults(&c, NULL, h) == -1) {
+    return -1;
+  }
+  cl_device_id d;
+  memcpy((void *)&d, (void *)(h->id + sizeof(void *)), sizeof(cl_device_id));
+
+  // Out-of-order execution is only a hint, fall back to an in-order queue
+  cl_command_queue_properties props = 0;
+  if (flags & TRUSIMD_OUT_OF_ORDER) {
+    cl_command_queue_properties supported;
+    if (clGetDeviceInfo(d, CL_DEVICE_QUEUE_PROPERTIES, sizeof(supported),
+                        &supported, NULL) == CL_SUCCESS &&
+        (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)) {
+      props = CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+    }
+  }
+  if (get_option(h, TRUSIMD_PROFILING) != 0) {
+    props |= CL_QUEUE_PROFILING_ENABLE;
+  }
+  cl_command_queue q = opencl_create_queue(c, d, props);
+  if (opencl_errno != CL_SUCCESS) {
+    trusimd_errno = TRUSIMD_EOPENCL;
+    return -1;
+  }
+  *stream = *h;
+  memcpy((void *)stream->param2, (void *)&q, sizeof(cl_command_queue));
+  return 0;
+}
+
+static inline int opencl_destroy_stream(trusimd_hardware *stream) {
+  cl_command_queue q;
+  memcpy((void *)&q, (void *)stream->param2, sizeof(cl_command_queue));
+  if (q == NULL) {
+    return 0;
+  }
+  clFinish(q);
+  opencl_errno = clReleaseCommandQueue(q);
+  memset((void *)stream->param2, 0, sizeof(stream->param2));
+  if (opencl_errno != CL_SUCCESS) {
+    trusimd_errno = TRUSIMD_EOPENCL;
+    return -1;
+  }
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Pool of device memory: when TRUSIMD_POOL_SLAB_SIZE is set, allocations that
+// fit are sub-buffers of large slabs. Sizes are rounded up to a power of two
+// (at least the device base address alignment) and freed sub-buffers are
+// kept per size and handed out again. Space within a slab is never reused
+// for another size, trusimd_trim_pool releases kept sub-buffers and the
+// slabs that become empty.
+
+struct opencl_pool_slab {
+  cl_mem mem;
+  size_t size, used;
+  size_t nb_regions; // sub-buffers alive, in use or kept for reuse
+};
+
+struct opencl_pool_region {
+  cl_context c;
+  cl_mem slab;
+  size_t size;
+};
+
+struct opencl_pool {
+  std::vector<opencl_pool_slab> slabs;
+  std::map<size_t, std::vector<cl_mem> > free_regions; // per size
+  trusimd_pool_stats stats;
+  opencl_pool() { memset((void *)&stats, 0, sizeof(stats)); }
+};
+
+static std::mutex opencl_pool_mutex;
+static std::map<cl_context, opencl_pool> opencl_pools;
+static std::map<void *, opencl_pool_region> opencl_pool_regions;
+
+static inline size_t opencl_pool_size(cl_device_id d, size_t n) {
+  cl_uint align_bits;
+  size_t res = 128;
+  if (clGetDeviceInfo(d, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint),
+                      &align_bits, NULL) == CL_SUCCESS &&
+      align_bits >= 8) {
+    res = align_bits / 8;
+  }
+  while (res < n) {
+    res *= 2;
+  }
+  return res;
+}
+
+// Returns 1 when the allocation was served by the pool
+static inline int opencl_pool_malloc(trusimd_hardware *h, cl_context c,
+                                     size_t n, void **res) {
+  long slab_size = get_option(h, TRUSIMD_POOL_SLAB_SIZE);
+  if (slab_size <= 0) {
+    return 0;
+  }
+  cl_device_id d;
+  memcpy((void *)&d, (void *)(h->id + sizeof(void *)), sizeof(cl_device_id));
+  size_t size = opencl_pool_size(d, n);
+  if (size > size_t(slab_size)) {
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> lock(opencl_pool_mutex);
+  opencl_pool &pool = opencl_pools[c];
+  cl_mem mem;
+  std::vector<cl_mem> &free_regions = pool.free_regions[size];
+  if (!free_regions.empty()) {
+    mem = free_regions.back();
+    free_regions.pop_back();
+  } else {
+    // Find room in a slab, regions are aligned on their size
+    size_t i = 0;
+    for (; i < pool.slabs.size(); i++) {
+      size_t origin = (pool.slabs[i].used + size - 1) / size * size;
+      if (origin + size <= pool.slabs[i].size) {
+        break;
+      }
+    }
+    if (i == pool.slabs.size()) {
+      opencl_pool_slab slab;
+      slab.mem = clCreateBuffer(c, CL_MEM_READ_WRITE, size_t(slab_size), NULL,
+                                &opencl_errno);
+      if (opencl_errno != CL_SUCCESS) {
+        trusimd_errno = TRUSIMD_EOPENCL;
+        return -1;
+      }
+      slab.size = size_t(slab_size);
+      slab.used = 0;
+      slab.nb_regions = 0;
+      pool.slabs.push_back(slab);
+      pool.stats.nb_slabs++;
+      pool.stats.reserved += slab.size;
+    }
+    opencl_pool_slab &slab = pool.slabs[i];
+    cl_buffer_region region;
+    region.origin = (slab.used + size - 1) / size * size;
+    region.size = size;
+    mem = clCreateSubBuffer(slab.mem, CL_MEM_READ_WRITE,
+                            CL_BUFFER_CREATE_TYPE_REGION, &region,
+                            &opencl_errno);
+    if (opencl_errno != CL_SUCCESS) {
+      trusimd_errno = TRUSIMD_EOPENCL;
+      return -1;
+    }
+    slab.used = region.origin + size;
+    slab.nb_regions++;
+    void *ptr;
+    memcpy((void *)&ptr, (void *)&mem, sizeof(cl_mem));
+    opencl_pool_region r;
+    r.c = c;
+    r.slab = slab.mem;
+    r.size = size;
+    opencl_pool_regions[ptr] = r;
+  }
+  memcpy((void *)res, (void *)&mem, sizeof(cl_mem));
+  pool.stats.nb_allocs++;
+  pool.stats.in_use += size;
+  pool.stats.high_water = std::max(pool.stats.high_water, pool.stats.in_use);
+  return 1;
+}
+
+// Returns true when ptr belongs to the pool
+static inline bool opencl_pool_free(void *ptr) {
+  std::lock_guard<std::mutex> lock(opencl_pool_mutex);
+  std::map<void *, opencl_pool_region>::iterator it =
+      opencl_pool_regions.find(ptr);
+  if (it == opencl_pool_regions.end()) {
+    return false;
+  }
+  opencl_pool &pool = opencl_pools[it->second.c];
+  cl_mem mem;
+  memcpy((void *)&mem, (void *)&ptr, sizeof(cl_mem));
+  pool.free_regions[it->second.size].push_back(mem);
+  pool.stats.nb_frees++;
+  pool.stats.in_use -= it->second.size;
+  return true;
+}
+
+static inline int opencl_trim_pool(trusimd_hardware *h) {
+  cl_context c;
+  if (opencl_retrieve_defaults(&c, NULL, h) == -1) {
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(opencl_pool_mutex);
+  std::map<cl_context, opencl_pool>::iterator it = opencl_pools.find(c);
+  if (it == opencl_pools.end()) {
+    return 0;
+  }
+  opencl_pool &pool = it->second;
+  for (std::map<size_t, std::vector<cl_mem> >::iterator fr =
+           pool.free_regions.begin();
+       fr != pool.free_regions.end(); ++fr) {
+    for (size_t i = 0; i < fr->second.size(); i++) {
+      void *ptr;
+      memcpy((void *)&ptr, (void *)&fr->second[i], sizeof(cl_mem));
+      std::map<void *, opencl_pool_region>::iterator r =
+          opencl_pool_regions.find(ptr);
+      for (size_t j = 0; j < pool.slabs.size(); j++) {
+        if (pool.slabs[j].mem == r->second.slab) {
+          pool.slabs[j].nb_regions--;
+        }
+      }
+      opencl_pool_regions.erase(r);
+      clReleaseMemObject(fr->second[i]);
+    }
+  }
+  pool.free_regions.clear();
+  std::vector<opencl_pool_slab> slabs;
+  for (size_t i = 0; i < pool.slabs.size(); i++) {
+    if (pool.slabs[i].nb_regions == 0) {
+      clReleaseMemObject(pool.slabs[i].mem);
+      pool.stats.nb_slabs--;
+      pool.stats.reserved -= pool.slabs[i].size;
+    } else {
+      slabs.push_back(pool.slabs[i]);
+    }
+  }
+  pool.slabs.swap(slabs);
+  return 0;
+}
+
+static inline int opencl_get_pool_stats(trusimd_hardware *h,
+                                        trusimd_pool_stats *stats) {
+  cl_context c;
+  if (opencl_retrieve_defaults(&c, NULL, h) == -1) {
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(opencl_pool_mutex);
+  std::map<cl_context, opencl_pool>::const_iterator it = opencl_pools.find(c);
+  if (it == opencl_pools.end()) {
+    memset((void *)stats, 0, sizeof(trusimd_pool_stats));
+  } else {
+    *stats = it->second.stats;
+  }
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Shared virtual memory: when TRUSIMD_SVM is set device buffers are SVM
+// pointers that kernels take directly, allocations fail with TRUSIMD_EAVAIL
+// on devices without coarse-grained SVM buffers (before OpenCL 2.0).
+// Shared buffers then need no host copy at all, other copies from or to SVM
+// go through clEnqueueSVMMemcpy. Coarse-grained buffers accessed by the host
+// are mapped while the host owns them.
+
+struct opencl_svm_buffer {
+  cl_context c;
+  size_t n;
+  bool fine_grain, mapped;
+};
+
+static std::mutex opencl_svm_mutex;
+static std::map<void *, opencl_svm_buffer> opencl_svm_buffers;
+
+static inline bool opencl_is_svm(void *ptr) {
+  std::lock_guard<std::mutex> lock(opencl_svm_mutex);
+  return opencl_svm_buffers.find(ptr) != opencl_svm_buffers.end();
+}
+
+#ifdef CL_VERSION_2_0
+
+// Returns 0 when SVM is not to be used, 1 when *res is an SVM buffer
+static inline int opencl_svm_malloc(trusimd_hardware *h, size_t n,
+                                    bool shared, void **res) {
+  if (get_option(h, TRUSIMD_SVM) == 0) {
+    return 0;
+  }
+  cl_device_id d;
+  memcpy((void *)&d, (void *)(h->id + sizeof(void *)), sizeof(cl_device_id));
+  cl_device_svm_capabilities caps;
+  if (opencl_device_version(d) < 200 ||
+      clGetDeviceInfo(d, CL_DEVICE_SVM_CAPABILITIES, sizeof(caps), &caps,
+                      NULL) != CL_SUCCESS ||
+      !(caps & CL_DEVICE_SVM_COARSE_GRAIN_BUFFER)) {
+    trusimd_errno = TRUSIMD_EAVAIL;
+    return -1;
+  }
+  cl_context c;
+  cl_command_queue q;
+  if (opencl_retrieve_defaults(&c, &q, h) == -1) {
+    return -1;
+  }
+  opencl_svm_buffer sb;
+  sb.c = c;
+  sb.n = n;
+  sb.fine_grain = (caps & CL_DEVICE_SVM_FINE_GRAIN_BUFFER) != 0;
+  sb.mapped = false;
+  void *ptr = clSVMAlloc(c,
+                         CL_MEM_READ_WRITE |
+                             (sb.fine_grain ? CL_MEM_SVM_FINE_GRAIN_BUFFER : 0),
+                         n, 0);
+  if (ptr == NULL) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+
+  // The host owns shared buffers first
+  if (shared && !sb.fine_grain) {
+    opencl_errno = clEnqueueSVMMap(q, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+                                   ptr, n, 0, NULL, NULL);
+    if (opencl_errno != CL_SUCCESS) {
+      clSVMFree(c, ptr);
+      trusimd_errno = TRUSIMD_EOPENCL;
+      return -1;
+    }
+    sb.mapped = true;
+  }
+  std::lock_guard<std::mutex> lock(opencl_svm_mutex);
+  opencl_svm_buffers[ptr] = sb;
+  *res = ptr;
+  return 1;
+}
+
+// Returns false when ptr is not an SVM buffer
+static inline bool opencl_svm_free(trusimd_hardware *h, void *ptr) {
+  opencl_svm_buffer sb;
+  {
+    std::lock_guard<std::mutex> lock(opencl_svm_mutex);
+    std::map<void *, opencl_svm_buffer>::iterator it =
+        opencl_svm_buffers.find(ptr);
+    if (it == opencl_svm_buffers.end()) {
+      return false;
+    }
+    sb = it->second;
+    opencl_svm_buffers.erase(it);
+  }
+  cl_command_queue q;
+  if (opencl_retrieve_defaults(NULL, &q, h) == 0) {
+    if (sb.mapped) {
+      clEnqueueSVMUnmap(q, ptr, 0, NULL, NULL);
+    }
+    clFinish(q);
+  }
+  clSVMFree(sb.c, ptr);
+  return true;
+}
+
+#else
+
+static inline int opencl_svm_malloc(trusimd_hardware *h, size_t, bool,
+                                    void **) {
+  if (get_option(h, TRUSIMD_SVM) == 0) {
+    return 0;
+  }
+  trusimd_errno = TRUSIMD_EAVAIL;
+  return -1;
+}
+
+static inline bool opencl_svm_free(trusimd_hardware *, void *) {
+  return false;
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+
+static inline void *opencl_device_malloc(trusimd_hardware *h, size_t n) {
+  void *res;
+  switch (opencl_svm_malloc(h, n, false, &res)) {
+  case -1: return NULL;
+  case 1: return res;
+  }
+  cl_context c;
+  if (opencl_retrieve_defaults(&c, NULL, h) == -1) {
+    return NULL;
+  }
+  switch (opencl_pool_malloc(h, c, n, &res)) {
+  case -1: return NULL;
+  case 1: return res;
+  }
+  cl_mem mem = clCreateBuffer(c, CL_MEM_READ_WRITE, n, NULL, &opencl_errno);
+  if (opencl_errno != CL_SUCCESS) {
+    return NULL;
+  }
+  memcpy((void *)&res, (void *)&mem, sizeof(mem));
+  return res;
+}
+
+// ----------------------------------------------------------------------------
+// Buffers shared with the host on CPU devices: they are created with
+// CL_MEM_USE_HOST_PTR and are mapped while the host owns them, copying to the
+// device or launching a kernel on them unmaps them and copying to the host
+// maps them again.
+
+struct opencl_shared_buffer {
+  void *alloc_ptr, *host_ptr;
+  size_t n;
+  bool mapped;
+};
+
+static std::mutex opencl_shared_mutex;
+static std::map<void *, opencl_shared_buffer> opencl_shared_buffers;
+
+static inline void *opencl_device_malloc_shared(trusimd_hardware *h, size_t n,
+                                                void **host_ptr) {
+  void *res;
+  switch (opencl_svm_malloc(h, n, true, &res)) {
+  case -1: return NULL;
+  case 1:
+    *host_ptr = res;
+    return res;
+  }
+  cl_device_id d;
+  memcpy((void *)&d, (void *)(h->id + sizeof(void *)), sizeof(cl_device_id));
+  cl_device_type type;
+  opencl_errno =
+      clGetDeviceInfo(d, CL_DEVICE_TYPE, sizeof(type), (void *)&type, NULL);
+  if (opencl_errno != CL_SUCCESS) {
+    trusimd_errno = TRUSIMD_EOPENCL;
+    return NULL;
+  }
+  if (!(type & CL_DEVICE_TYPE_CPU)) {
+    trusimd_errno = TRUSIMD_EAVAIL;
+    return NULL;
+  }
+  cl_context c;
+  cl_command_queue q;
+  if (opencl_retrieve_defaults(&c, &q, h) == -1) {
+    return NULL;
+  }
+
+  // Page aligned memory lets the runtime use it without copying
+  void *ptr = aligned_malloc(4096, n);
+  if (ptr == NULL) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return NULL;
+  }
+  cl_mem mem = clCreateBuffer(c, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, n,
+                              ptr, &opencl_errno);
+  if (opencl_errno != CL_SUCCESS) {
+    aligned_free(ptr);
+    trusimd_errno = TRUSIMD_EOPENCL;
+    return NULL;
+  }
+  void *mapped = clEnqueueMapBuffer(q, mem, CL_TRUE,
+                                    CL_MAP_READ | CL_MAP_WRITE, 0, n, 0, NULL,
+                                    NULL, &opencl_errno);
+  if (opencl_errno != CL_SUCCESS) {
+    clReleaseMemObject(mem);
+    aligned_free(ptr);
+    trusimd_errno = TRUSIMD_EOPENCL;
+    return NULL;
+  }
+  memcpy((void *)&res, (void *)&mem, sizeof(mem));
+  opencl_shared_buffer sb;
+  sb.alloc_ptr = ptr;
+  sb.host_ptr = mapped;
+  sb.n = n;
+  sb.mapped = true;
+  {
+    std::lock_guard<std::mutex> lock(opencl_shared_mutex);
+    opencl_shared_buffers[res] = sb;
+  }
+  *host_ptr = mapped;
+  return res;
+}
+
+// ----------------------------------------------------------------------------
+
+static inline void opencl_device_free(trusimd_hardware *h, void *ptr) {
+  if (opencl_svm_free(h, ptr)) {
+    return;
+  }
+  cl_mem mem;
+  memcpy((void *)&mem, (void *)&ptr, sizeof(cl_mem));
+  opencl_shared_buffer sb;
+  bool shared = false;
+  {
+    std::lock_guard<std::mutex> lock(opencl_shared_mutex);
+    std::map<void *, opencl_shared_buffer>::iterator it =
+        opencl_shared_buffers.find(ptr);
+    if (it != opencl_shared_buffers.end()) {
+      sb = it->second;
+      shared = true;
+      opencl_shared_buffers.erase(it);
+    }
+  }
+  if (!shared) {
+    if (!opencl_pool_free(ptr)) {
+      clReleaseMemObject(mem);
+    }
+    return;
+  }
+
+  // The host memory backs the buffer, it can only be freed once the device
+  // is done with it
+  cl_command_queue q;
+  if (opencl_retrieve_defaults(NULL, &q, h) == 0) {
+    if (sb.mapped) {
+      clEnqueueUnmapMemObject(q, mem, sb.host_ptr, 0, NULL, NULL);
+    }
+    clFinish(q);
+  }
+  clReleaseMemObject(mem);
+  aligned_free(sb.alloc_ptr);
+}
+
+// ----------------------------------------------------------------------------
+
+// Wait list of an asynchronous operation, events of other accelerators are
+// already complete
+static inline std::vector<cl_event> opencl_wait_list(int nb_events,
+                                                     trusimd_event **events) {
+  std::vector<cl_event> res;
+  for (int i = 0; i < nb_events; i++) {
+    if (events[i] != NULL && events[i]->accelerator == TRUSIMD_OPENCL &&
+        events[i]->native != NULL) {
+      cl_event ev;
+      memcpy((void *)&ev, (void *)&events[i]->native, sizeof(cl_event));
+      res.push_back(ev);
+    }
+  }
+  return res;
+}
+
+static inline void opencl_set_event(trusimd_event *e, cl_event ev) {
+  memcpy((void *)&e->native, (void *)&ev, sizeof(cl_event));
+}
+
+// ----------------------------------------------------------------------------
+// Profiling: when TRUSIMD_PROFILING is set queues are created with
+// CL_QUEUE_PROFILING_ENABLE and the timestamps of every copy and launch are
+// aggregated per hardware and per kernel name (copies are named after the
+// function). Synchronous operations are recorded when they return,
+// asynchronous ones when they complete.
+
+static std::mutex opencl_profiles_mutex;
+static std::map<std::string, std::map<std::string, trusimd_profile> >
+    opencl_profiles;
+
+static inline bool opencl_profiling(trusimd_hardware *h) {
+  return get_option(h, TRUSIMD_PROFILING) != 0;
+}
+
+static inline void opencl_record_profile(std::string const &key,
+                                         std::string const &name,
+                                         cl_event ev) {
+  const cl_profiling_info params[4] = {
+      CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+      CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END};
+  cl_ulong t[4];
+  for (int i = 0; i < 4; i++) {
+    if (clGetEventProfilingInfo(ev, params[i], sizeof(cl_ulong), &t[i],
+                                NULL) != CL_SUCCESS) {
+      return; // the queue was created without profiling
+    }
+  }
+  std::lock_guard<std::mutex> lock(opencl_profiles_mutex);
+  trusimd_profile &p = opencl_profiles[key][name];
+  if (p.count == 0) {
+    my_strlcpy(p.name, name.c_str(), sizeof(p.name));
+  }
+  double run_time = double(t[3] - t[2]) * 1e-9;
+  p.count++;
+  p.queued_time += double(t[1] - t[0]) * 1e-9;
+  p.submit_time += double(t[2] - t[1]) * 1e-9;
+  p.run_time += run_time;
+  p.max_run_time = std::max(p.max_run_time, run_time);
+}
+
+struct opencl_profile_request {
+  std::string key, name;
+};
+
+extern "C" {
+static void CL_CALLBACK opencl_profile_callback(cl_event ev, cl_int status,
+                                                void *data) {
+  opencl_profile_request *r = (opencl_profile_request *)data;
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    if (status == CL_COMPLETE) {
+      opencl_record_profile(r->key, r->name, ev);
+    }
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &) {
+    // profiles are best effort
+  }
+#endif
+  delete r;
+}
+}
+
+// Records the profile of an operation enqueued with event ev, now if it has
+// completed or else when it completes
+static inline void opencl_profile_op(trusimd_hardware *h, const char *name,
+                                     cl_event ev, bool completed) {
+  if (!opencl_profiling(h)) {
+    return;
+  }
+  if (completed) {
+    opencl_record_profile(hardware_key(h), name, ev);
+  } else {
+    opencl_profile_request *r = new opencl_profile_request;
+    r->key = hardware_key(h);
+    r->name = name;
+    if (clSetEventCallback(ev, CL_COMPLETE, opencl_profile_callback, r) !=
+        CL_SUCCESS) {
+      delete r;
+    }
+  }
+}
+
+// Ends an operation enqueued with event ev (NULL if none), e is the event
+// returned to the user or NULL when the operation has completed
+static inline void opencl_end_op(trusimd_hardware *h, const char *name,
+                                 trusimd_event *e, cl_event ev) {
+  if (ev == NULL) {
+    return;
+  }
+  opencl_profile_op(h, name, ev, e == NULL);
+  if (e != NULL) {
+    opencl_set_event(e, ev);
+  } else {
+    clReleaseEvent(ev);
+  }
+}
+
+static inline int opencl_get_profiles(trusimd_hardware *h,
+                                      trusimd_profile *profiles, int n) {
+  std::lock_guard<std::mutex> lock(opencl_profiles_mutex);
+  std::map<std::string, trusimd_profile> &m = opencl_profiles[hardware_key(h)];
+  int i = 0;
+  for (std::map<std::string, trusimd_profile>::const_iterator it = m.begin();
+       it != m.end(); ++it, ++i) {
+    if (i < n) {
+      profiles[i] = it->second;
+    }
+  }
+  return i;
+}
+
+static inline void opencl_reset_profiles(trusimd_hardware *h) {
+  std::lock_guard<std::mutex> lock(opencl_profiles_mutex);
+  opencl_profiles.erase(hardware_key(h));
+}
+
+// ----------------------------------------------------------------------------
+
+// Returns 1 if the copy involved an SVM buffer, ev (if not NULL) is set to
+// the event of the operation or to NULL when there was nothing to do
+static inline int opencl_svm_copy(cl_command_queue q, void *dst, void *src,
+                                  size_t n, bool to_host,
+                                  std::vector<cl_event> const &waits,
+                                  bool blocking_, cl_event *ev) {
+#ifdef CL_VERSION_2_0
+  std::lock_guard<std::mutex> lock(opencl_svm_mutex);
+  std::map<void *, opencl_svm_buffer>::iterator it =
+      opencl_svm_buffers.find(to_host ? src : dst);
+  if (it == opencl_svm_buffers.end()) {
+    return 0;
+  }
+  opencl_svm_buffer &sb = it->second;
+  cl_uint nb_waits = cl_uint(waits.size());
+  const cl_event *wait_list = waits.empty() ? NULL : &waits[0];
+  cl_bool blocking = (blocking_ ? CL_TRUE : CL_FALSE);
+  if (dst != src) {
+    opencl_errno = clEnqueueSVMMemcpy(q, blocking, dst, src, n, nb_waits,
+                                      wait_list, ev);
+  } else if (sb.fine_grain || sb.mapped == to_host) {
+    // The host can already access the buffer
+    opencl_errno = (blocking_ || ev == NULL
+                        ? CL_SUCCESS
+                        : clEnqueueMarkerWithWaitList(q, nb_waits, wait_list,
+                                                      ev));
+  } else if (to_host) {
+    opencl_errno = clEnqueueSVMMap(q, blocking, CL_MAP_READ | CL_MAP_WRITE,
+                                   dst, sb.n, nb_waits, wait_list, ev);
+    sb.mapped = (opencl_errno == CL_SUCCESS);
+  } else {
+    opencl_errno = clEnqueueSVMUnmap(q, dst, nb_waits, wait_list, ev);
+    sb.mapped = (opencl_errno != CL_SUCCESS);
+  }
+  if (opencl_errno != CL_SUCCESS) {
+    trusimd_errno = TRUSIMD_EOPENCL;
+    return -1;
+  }
+  return 1;
+#else
+  (void)q;
+  (void)dst;
+  (void)src;
+  (void)n;
+  (void)to_host;
+  (void)waits;
+  (void)blocking_;
+  (void)ev;
+  return 0;
+#endif
+}
+
+// Returns 1 if the copy was handled by mapping/unmapping a shared buffer, ev
+// (if not NULL) is set as for opencl_svm_copy
+static inline int opencl_map_shared(cl_command_queue q, void *buf,
+                                    void *host_ptr, bool map,
+                                    std::vector<cl_event> const &waits,
+                                    bool blocking, cl_event *ev) {
+  std::lock_guard<std::mutex> lock(opencl_shared_mutex);
+  std::map<void *, opencl_shared_buffer>::iterator it =
+      opencl_shared_buffers.find(buf);
+  if (it == opencl_shared_buffers.end() || it->second.host_ptr != host_ptr) {
+    return 0;
+  }
+  opencl_shared_buffer &sb = it->second;
+  cl_uint nb_waits = cl_uint(waits.size());
+  const cl_event *wait_list = waits.empty() ? NULL : &waits[0];
+  if (sb.mapped == map) {
+    if (!blocking && ev != NULL) {
+      opencl_errno = clEnqueueMarkerWithWaitList(q, nb_waits, wait_list, ev);
+      if (opencl_errno != CL_SUCCESS) {
+        trusimd_errno = TRUSIMD_EOPENCL;
+        return -1;
+      }
+    }
+    return 1;
+  }
+  cl_mem mem;
+  memcpy((void *)&mem, (void *)&buf, sizeof(cl_mem));
+  if (map) {
+    void *mapped = clEnqueueMapBuffer(
+        q, mem, blocking ? CL_TRUE : CL_FALSE, CL_MAP_READ | CL_MAP_WRITE,
+        0, sb.n, nb_waits, wait_list, ev, &opencl_errno);
+    if (opencl_errno != CL_SUCCESS) {
+      trusimd_errno = TRUSIMD_EOPENCL;
+      return -1;
+    }
+    if (mapped != sb.host_ptr) {
+      // We promised the host a fixed address, this should never happen with
+      // CL_MEM_USE_HOST_PTR
+      if (ev != NULL) {
+        clWaitForEvents(1, ev);
+        clReleaseEvent(*ev);
+      }
+      clEnqueueUnmapMemObject(q, mem, mapped, 0, NULL, NULL);
+      opencl_errno = CL_MAP_FAILURE;
+      trusimd_errno = TRUSIMD_EOPENCL;
+      return -1;
+    }
+  } else {
+    opencl_errno =
+        clEnqueueUnmapMemObject(q, mem, sb.host_ptr, nb_waits, wait_list, ev);
+    if (opencl_errno != CL_SUCCESS) {
+      trusimd_errno = TRUSIMD_EOPENCL;
+      return -1;
+    }
+  }
+  sb.mapped = map;
+  return 1;
+}
+
+// Kernels may not access buffers mapped for the host, shared and
+// coarse-grained SVM buffers given to a launch that are still mapped are
+// unmapped first, their host memory is valid again once copied to the
+// host. The events of the unmaps are appended to waits and to unmaps, that
+// the caller releases.
+static inline int opencl_unmap_shared_args(cl_command_queue q,
+                                           std::vector<void *> const &ptrs,
+                                           std::vector<cl_event> *waits,
+                                           std::vector<cl_event> *unmaps) {
+  std::lock_guard<std::mutex> lock(opencl_shared_mutex);
+  for (size_t i = 0; i < ptrs.size(); i++) {
+    std::map<void *, opencl_shared_buffer>::iterator it =
+        opencl_shared_buffers.find(ptrs[i]);
+    if (it == opencl_shared_buffers.end() || !it->second.mapped) {
+      continue;
+    }
+    cl_mem mem;
+    memcpy((void *)&mem, (void *)&ptrs[i], sizeof(cl_mem));
+    cl_event ev;
+    opencl_errno =
+        clEnqueueUnmapMemObject(q, mem, it->second.host_ptr, 0, NULL, &ev);
+    if (opencl_errno != CL_SUCCESS) {
+      trusimd_errno = TRUSIMD_EOPENCL;
+      return -1;
+    }
+    it->second.mapped = false;
+    waits->push_back(ev);
+    unmaps->push_back(ev);
+  }
+#ifdef CL_VERSION_2_0
+  std::lock_guard<std::mutex> svm_lock(opencl_svm_mutex);
+  for (size_t i = 0; i < ptrs.size(); i++) {
+    std::map<void *, opencl_svm_buffer>::iterator it =
+        opencl_svm_buffers.find(ptrs[i]);
+    if (it == opencl_svm_buffers.end() || !it->second.mapped) {
+      continue;
+    }
+    cl_event ev;
+    opencl_errno = clEnqueueSVMUnmap(q, ptrs[i], 0, NULL, &ev);
+    if (opencl_errno != CL_SUCCESS) {
+      trusimd_errno = TRUSIMD_EOPENCL;
+      return -1;
+    }
+    it->second.mapped = false;
+    waits->push_back(ev);
+    unmaps->push_back(ev);
+  }
+#endif
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+// Copies and launches are asynchronous when e is not NULL: they start after
+// the events of the wait list and e is set to the event of their completion
+
+static inline int opencl_copy_to_device(trusimd_hardware *h, void *dst_,
+                                        void *src, size_t n, int nb_events,
+                                        trusimd_event **events,
+                                        trusimd_event *e) {
+  cl_mem dst;
+  memcpy((void *)&dst, (void *)&dst_, sizeof(cl_mem));
+  cl_command_queue q;
+  if (opencl_retrieve_defaults(NULL, &q, h) == -1) {
+    return -1;
+  }
+  std::vector<cl_event> waits(opencl_wait_list(nb_events, events));
+  bool blocking = (e == NULL);
+  cl_event ev = NULL;
+  cl_event *ev_ptr = (blocking && !opencl_profiling(h) ? NULL : &ev);
+  int code = opencl_svm_copy(q, dst_, src, n, false, waits, blocking, ev_ptr);
+  if (code == 0) {
+    code = opencl_map_shared(q, dst_, src, false, waits, blocking, ev_ptr);
+  }
+  if (code == 0) {
+    opencl_errno = clEnqueueWriteBuffer(
+        q, dst, blocking ? CL_TRUE : CL_FALSE, 0, n, src, cl_uint(waits.size()),
+        waits.empty() ? NULL : &waits[0], ev_ptr);
+    if (opencl_errno != CL_SUCCESS) {
+      trusimd_errno = TRUSIMD_EOPENCL;
+      return -1;
+    }
+  } else if (code == -1) {
+    return -1;
+  }
+  opencl_end_op(h, "copy_to_device", e, ev);
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+static inline int opencl_copy_to_host(trusimd_hardware *h, void *dst,
+                                      void *src_, size_t n, int nb_events,
+                                      trusimd_event **events,
+                                      trusimd_event *e) {
+  cl_mem src;
+  memcpy((void *)&src, (void *)&src_, sizeof(cl_mem));
+  cl_command_queue q;
+  if (opencl_retrieve_defaults(NULL, &q, h) == -1) {
+    return -1;
+  }
+  std::vector<cl_event> waits(opencl_wait_list(nb_events, events));
+  bool blocking = (e == NULL);
+  cl_event ev = NULL;
+  cl_event *ev_ptr = (blocking && !opencl_profiling(h) ? NULL : &ev);
+  int code = opencl_svm_copy(q, dst, src_, n, true, waits, blocking, ev_ptr);
+  if (code == 0) {
+    code = opencl_map_shared(q, src_, dst, true, waits, blocking, ev_ptr);
+  }
+  if (code == 0) {
+    opencl_errno = clEnqueueReadBuffer(
+        q, src, blocking ? CL_TRUE : CL_FALSE, 0, n, dst, cl_uint(waits.size()),
+        waits.empty() ? NULL : &waits[0], ev_ptr);
+    if (opencl_errno != CL_SUCCESS) {
+      trusimd_errno = TRUSIMD_EOPENCL;
+      return -1;
+    }
+  } else if (code == -1) {
+    return -1;
+  }
+  opencl_end_op(h, "copy_to_host", e, ev);
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+static inline int opencl_wait(int nb_events, trusimd_event **events) {
+  std::vector<cl_event> waits(opencl_wait_list(nb_events, events));
+  if (waits.empty()) {
+    return 0;
+  }
+  opencl_errno = clWaitForEvents(cl_uint(waits.size()), &waits[0]);
+  if (opencl_errno != CL_SUCCESS) {
+    trusimd_errno = TRUSIMD_EOPENCL;
+    return -1;
+  }
+  return 0;
+}
+
+// Sets e to an event that completes with the events of the wait list, for
+// asynchronous operations that have nothing to enqueue
+static inline int opencl_marker(trusimd_hardware *h, int nb_events,
+                                trusimd_event **events, trusimd_event *e) {
+  cl_command_queue q;
+  if (opencl_retrieve_defaults(NULL, &q, h) == -1) {
+    return -1;
+  }
+  std::vector<cl_event> waits(opencl_wait_list(nb_events, events));
+  cl_event ev;
+  opencl_errno = clEnqueueMarkerWithWaitList(
+      q, cl_uint(waits.size()), waits.empty() ? NULL : &waits[0], &ev);
+  if (opencl_errno != CL_SUCCESS) {
+    trusimd_errno = TRUSIMD_EOPENCL;
+    return -1;
+  }
+  opencl_set_event(e, ev);
+  return 0;
+}
+
+static inline void opencl_release_event(trusimd_event *e) {
+  if (e->native != NULL) {
+    cl_event ev;
+    memcpy((void *)&ev, (void *)&e->native, sizeof(cl_event));
+    clReleaseEvent(ev);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Built programs and their kernel object are kept in a process-wide cache
+// keyed by the context, the device, a hash of the source (OpenCL C or
+// SPIR-V) and the build options. Entries are inserted before being built,
+// either in the background by trusimd_prepare_kernel or by the first launch,
+// so that each program is built only once and outside of the cache lock.
+// When a cache directory is set, program binaries are also saved there and
+// reloaded by later processes instead of compiling the source again.
+//
+// Kernels with reductions come with a second kernel, named after the first
+// one with a "_reduce" suffix, that combines the partial results of the
+// work-groups of the first one. It takes the same arguments and runs as one
+// work-group. Partial results live in buffers created for each launch.
+//
+// The work-group size of each kernel is tuned per bucket of global sizes
+// (buckets are powers of two): successive launches try each candidate once
+// and the fastest is used from then on. Kernels are never run more often
+// than requested as they may not be idempotent. Tuned sizes are persisted
+// in the cache directory as well.
+
+struct opencl_tuning {
+  std::vector<double> times; // one per candidate
+  size_t nb_tried, nb_timed;
+  size_t best; // 0 while tuning
+  opencl_tuning() : nb_tried(0), nb_timed(0), best(0) {}
+};
+
+struct opencl_program_entry {
+  cl_program p;
+  cl_kernel k;
+  cl_kernel k_reduce; // NULL when the kernel has no reduction
+  size_t reduce_local_size;
+  std::mutex launch_mutex; // protects what follows and kernel arguments
+  std::vector<size_t> local_sizes; // candidates, all multiples of the first
+  std::map<int, opencl_tuning> tunings;
+  std::string tuning_path;
+  bool warm; // first launch, whose timing includes driver setup, is done
+  int nb_lanes; // elements processed by each work-item
+  bool has_reductions;
+  std::shared_future<int> built; // 0 or -1 when the build failed
+  cl_int error;
+  char build_log[sizeof(opencl_build_log)];
+
+  opencl_program_entry()
+      : p(NULL), k(NULL), k_reduce(NULL), reduce_local_size(1),
+        warm(false), nb_lanes(1), has_reductions(false), error(CL_SUCCESS) {}
+
+  ~opencl_program_entry() {
+    if (built.valid()) {
+      built.wait();
+    }
+    if (k != NULL) {
+      clReleaseKernel(k);
+    }
+    if (k_reduce != NULL) {
+      clReleaseKernel(k_reduce);
+    }
+    if (p != NULL) {
+      clReleaseProgram(p);
     }
+  }
+};
 
-    // Create queue attached to context
-    q = clCreateCommandQueue(c, d, 0, &opencl_errno);
-    if (opencl_errno != CL_SUCCESS) {
-      clReleaseContext(c);
-      trusimd_errno = TRUSIMD_OPENCL;
-      return -1;
+typedef std::shared_ptr<opencl_program_entry> opencl_program_entry_ptr;
+
+static std::mutex opencl_programs_mutex;
+static std::map<std::string, opencl_program_entry_ptr> opencl_programs;
+static trusimd_cache_stats opencl_cache_stats = {0, 0, 0, 0.0};
+
+// Binaries and tunings are only valid for the same device and driver, the
+// binary file also contains the source to rule out hash collisions:
+//   "trusimd-opencl-1\n" <source size> "\n" <source> <binary>
+// and the tuning file contains one "<bucket> <local size>" line per bucket.
+
+static inline std::string opencl_cache_path(cl_device_id d,
+                                            std::string const &source,
+                                            std::string const &options,
+                                            const char *ext) {
+  std::string dir(get_cache_dir());
+  if (dir.empty()) {
+    return dir;
+  }
+  std::string id(opencl_device_info(d, CL_DEVICE_NAME));
+  id += '\n' + opencl_device_info(d, CL_DEVICE_VERSION);
+  id += '\n' + opencl_device_info(d, CL_DRIVER_VERSION);
+  id += '\n' + options;
+  id += '\n' + source;
+  std::stringstream ss;
+  ss << dir << "/opencl-" << std::hex << std::hash<std::string>()(id)
+     << "." << ext;
+  return ss.str();
+}
+
+static inline bool opencl_load_binary(std::string const &path,
+                                      std::string const &source,
+                                      std::vector<unsigned char> *binary) {
+  std::ifstream f(path.c_str(), std::ios::binary);
+  std::string magic;
+  size_t size;
+  if (!std::getline(f, magic) || magic != "trusimd-opencl-1" ||
+      !(f >> size) || f.get() != '\n' || size != source.size()) {
+    return false;
+  }
+  std::string buf(size, '\0');
+  if (!f.read(&buf[0], std::streamsize(size)) || buf != source) {
+    return false;
+  }
+  binary->assign(std::istreambuf_iterator<char>(f),
+                 std::istreambuf_iterator<char>());
+  return !binary->empty();
+}
+
+// Write to a temporary file first so that concurrent processes never read
+// a partial file. Best effort: failing to save only costs a build or a
+// tuning next time.
+static inline void opencl_write_cache_file(std::string const &path,
+                                           std::string const &data) {
+  std::string tmp(path + ".tmp");
+  print_T(&tmp, std::hash<std::thread::id>()(std::this_thread::get_id()) ^
+                    size_t(std::chrono::steady_clock::now()
+                               .time_since_epoch()
+                               .count()));
+  {
+    std::ofstream f(tmp.c_str(), std::ios::binary);
+    f.write(data.data(), std::streamsize(data.size()));
+    if (!f) {
+      f.close();
+      std::remove(tmp.c_str());
+      return;
     }
-    memcpy((void *)h.param1, (void *)&c, sizeof(cl_context_properties));
-    memcpy((void *)h.param2, (void *)&q, sizeof(cl_command_queue));
   }
+  if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+    std::remove(tmp.c_str());
+  }
+}
 
-  // Fill arguments that are not NULL
-  if (c_) {
-    memcpy((void *)c_, (void *)h.param1, sizeof(cl_context_properties));
+static inline void opencl_save_binary(cl_program p, std::string const &path,
+                                      std::string const &source) {
+  size_t size;
+  if (clGetProgramInfo(p, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size,
+                       NULL) != CL_SUCCESS ||
+      size == 0) {
+    return;
   }
-  if (q_) {
-    memcpy((void *)q_, (void *)h.param2, sizeof(cl_command_queue));
+  std::vector<unsigned char> binary(size);
+  unsigned char *ptr = &binary[0];
+  if (clGetProgramInfo(p, CL_PROGRAM_BINARIES, sizeof(ptr), &ptr, NULL) !=
+      CL_SUCCESS) {
+    return;
   }
-  return 0;
+  std::stringstream ss;
+  ss << "trusimd-opencl-1\n" << source.size() << '\n' << source;
+  ss.write((const char *)&binary[0], std::streamsize(size));
+  opencl_write_cache_file(path, ss.str());
 }
 
 // ----------------------------------------------------------------------------
 
-static inline void *opencl_device_malloc(trusimd_hardware *h, size_t n) {
-  cl_context c;
-  if (opencl_retrieve_defaults(&c, NULL, h) == -1) {
-    return NULL;
+static inline void opencl_init_tuning(opencl_program_entry *entry,
+                                      cl_device_id d,
+                                      std::string const &source,
+                                      std::string const &options) {
+  // Candidates are the preferred multiple times powers of two up to the
+  // largest work-group size the kernel supports
+  size_t multiple, max_size;
+  if (clGetKernelWorkGroupInfo(entry->k, d,
+                               CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                               sizeof(size_t), &multiple,
+                               NULL) != CL_SUCCESS ||
+      clGetKernelWorkGroupInfo(entry->k, d, CL_KERNEL_WORK_GROUP_SIZE,
+                               sizeof(size_t), &max_size,
+                               NULL) != CL_SUCCESS ||
+      multiple == 0 || multiple > max_size) {
+    multiple = 1;
+    max_size = 64;
   }
-  cl_mem mem = clCreateBuffer(c, CL_MEM_READ_WRITE, n, NULL, &opencl_errno);
-  if (opencl_errno != CL_SUCCESS) {
-    return NULL;
+  for (size_t i = multiple; i <= max_size; i *= 2) {
+    entry->local_sizes.push_back(i);
+  }
+
+  // Reload tunings of a previous process
+  entry->tuning_path = opencl_cache_path(d, source, options, "tune");
+  if (entry->tuning_path.empty()) {
+    return;
+  }
+  std::ifstream f(entry->tuning_path.c_str());
+  int bucket;
+  size_t local_size;
+  while (f >> bucket >> local_size) {
+    if (std::find(entry->local_sizes.begin(), entry->local_sizes.end(),
+                  local_size) != entry->local_sizes.end()) {
+      entry->tunings[bucket].best = local_size;
+    }
   }
-  void *res = NULL;
-  memcpy((void *)&res, (void *)&mem, sizeof(mem));
-  return res;
 }
 
-// ----------------------------------------------------------------------------
+static inline void opencl_save_tunings(opencl_program_entry *entry) {
+  if (entry->tuning_path.empty()) {
+    return;
+  }
+  std::stringstream ss;
+  for (std::map<int, opencl_tuning>::const_iterator it =
+           entry->tunings.begin();
+       it != entry->tunings.end(); ++it) {
+    if (it->second.best != 0) {
+      ss << it->first << " " << it->second.best << "\n";
+    }
+  }
+  opencl_write_cache_file(entry->tuning_path, ss.str());
+}
 
-static inline void opencl_device_free(trusimd_hardware *, void *ptr) {
-  cl_mem mem;
-  memcpy((void *)&mem, (void *)&ptr, sizeof(cl_mem));
-  clReleaseMemObject(mem);
+// Global sizes in [2^(b - 1), 2^b) fall in bucket b
+static inline int opencl_size_bucket(int n) {
+  int res = 0;
+  for (; n > 0; n >>= 1) {
+    res++;
+  }
+  return res;
+}
+
+// Candidates for bucket b: there is no point in groups larger than 2^b
+// except the smallest candidate
+static inline size_t opencl_nb_candidates(opencl_program_entry *entry,
+                                          int bucket) {
+  size_t res = 1;
+  while (res < entry->local_sizes.size() &&
+         entry->local_sizes[res] <= (size_t(1) << bucket)) {
+    res++;
+  }
+  return res;
 }
 
 // ----------------------------------------------------------------------------
 
-static inline int opencl_copy_to_device(trusimd_hardware *h, void *dst_,
-                                        void *src, size_t n) {
-  cl_mem dst;
-  memcpy((void *)&dst, (void *)&dst_, sizeof(cl_mem));
-  cl_command_queue q;
-  if (opencl_retrieve_defaults(NULL, &q, h) == -1) {
+static inline int opencl_build_program(opencl_program_entry *entry,
+                                       cl_context c, cl_device_id d,
+                                       std::string const &source_,
+                                       std::string const &options, bool il) {
+  // Try the binary saved by a previous process
+  std::string path(opencl_cache_path(d, source_, options, "bin"));
+  std::vector<unsigned char> binary;
+  if (!path.empty() && opencl_load_binary(path, source_, &binary)) {
+    size_t size = binary.size();
+    const unsigned char *ptr = &binary[0];
+    cl_int status;
+    entry->p = clCreateProgramWithBinary(c, 1, &d, &size, &ptr, &status,
+                                         &entry->error);
+    if (entry->error == CL_SUCCESS && status == CL_SUCCESS &&
+        clBuildProgram(entry->p, 1, &d, options.c_str(), NULL, NULL) ==
+            CL_SUCCESS) {
+      return 0;
+    }
+    if (entry->error == CL_SUCCESS) {
+      clReleaseProgram(entry->p);
+    }
+    entry->p = NULL;
+  }
+
+  // Create program, SPIR-V modules skip the OpenCL C front-end
+  const char *source = source_.c_str();
+#ifdef CL_VERSION_2_1
+  if (il) {
+    entry->p = clCreateProgramWithIL(c, (const void *)source, source_.size(),
+                                     &entry->error);
+  } else {
+    entry->p =
+        clCreateProgramWithSource(c, 1, &source, NULL, &entry->error);
+  }
+#else
+  (void)il; // never set, see opencl_kernel_source
+  entry->p = clCreateProgramWithSource(c, 1, &source, NULL, &entry->error);
+#endif
+  if (entry->error != CL_SUCCESS) {
+    entry->p = NULL;
     return -1;
   }
-  opencl_errno =
-      clEnqueueWriteBuffer(q, dst, CL_TRUE, 0, n, src, 0, NULL, NULL);
-  if (opencl_errno != CL_SUCCESS) {
+
+  // Build program
+  entry->error = clBuildProgram(entry->p, 1, &d, options.c_str(), NULL, NULL);
+  if (entry->error != CL_SUCCESS) {
+    // Retrieve build error
+    size_t size;
+    std::vector<char> buf;
+    if (clGetProgramBuildInfo(entry->p, d, CL_PROGRAM_BUILD_LOG, 0, NULL,
+                              &size) == CL_SUCCESS) {
+      buf.resize(size + 1);
+      if (clGetProgramBuildInfo(entry->p, d, CL_PROGRAM_BUILD_LOG, size,
+                                &buf[0], NULL) != CL_SUCCESS) {
+        buf.clear();
+      }
+    }
+    strcpy(entry->build_log, "CL_BUILD_PROGRAM_FAILURE: ");
+    my_strlcpy(entry->build_log +
+                   (sizeof("CL_BUILD_PROGRAM_FAILURE: ") - 1),
+               buf.empty() ? "No log available" : &buf[0], 256);
+    clReleaseProgram(entry->p);
+    entry->p = NULL;
     return -1;
   }
+  if (!path.empty()) {
+    opencl_save_binary(entry->p, path, source_);
+  }
   return 0;
 }
 
 // ----------------------------------------------------------------------------
 
-static inline int opencl_copy_to_host(trusimd_hardware *h, void *dst,
-                                      void *src_, size_t n) {
-  cl_mem src;
-  memcpy((void *)&src, (void *)&src_, sizeof(cl_mem));
-  cl_command_queue q;
-  if (opencl_retrieve_defaults(NULL, &q, h) == -1) {
-    return -1;
+static inline int opencl_build(opencl_program_entry *entry, cl_context c,
+                               cl_device_id d, std::string const &name,
+                               std::string const &source,
+                               std::string const &options, bool il) {
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  int code = opencl_build_program(entry, c, d, source, options, il);
+  if (code == 0) {
+    entry->k = clCreateKernel(entry->p, name.c_str(), &entry->error);
+    if (entry->error != CL_SUCCESS) {
+      entry->k = NULL;
+      code = -1;
+    } else {
+      opencl_init_tuning(entry, d, source, options);
+    }
   }
-  opencl_errno =
-      clEnqueueReadBuffer(q, src, CL_TRUE, 0, n, dst, 0, NULL, NULL);
-  if (opencl_errno != CL_SUCCESS) {
+  if (code == 0 && entry->has_reductions) {
+    entry->k_reduce = clCreateKernel(entry->p, (name + "_reduce").c_str(),
+                                     &entry->error);
+    if (entry->error != CL_SUCCESS) {
+      entry->k_reduce = NULL;
+      code = -1;
+    } else if (clGetKernelWorkGroupInfo(entry->k_reduce, d,
+                                        CL_KERNEL_WORK_GROUP_SIZE,
+                                        sizeof(size_t),
+                                        &entry->reduce_local_size,
+                                        NULL) != CL_SUCCESS ||
+               entry->reduce_local_size == 0) {
+      entry->reduce_local_size = 1;
+    } else {
+      entry->reduce_local_size = std::min(entry->reduce_local_size,
+                                          size_t(256));
+    }
+  }
+  std::lock_guard<std::mutex> lock(opencl_programs_mutex);
+  opencl_cache_stats.build_time +=
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - t0)
+          .count();
+  return code;
+}
+
+static inline std::string opencl_cache_key_prefix(cl_context c,
+                                                  cl_device_id d) {
+  std::string key((const char *)&c, sizeof(c));
+  key.append((const char *)&d, sizeof(d));
+  return key;
+}
+
+// With TRUSIMD_OPENCL_VECTORIZE each work-item processes as many elements
+// as the preferred vector width of the narrowest element type of the kernel,
+// kernels that cannot be vectorized keep their scalar source
+static inline std::string opencl_select_source(trusimd_hardware *h,
+                                               cl_device_id d, kernel *k,
+                                               int *nb_lanes) {
+  *nb_lanes = 1;
+  if (get_option(h, TRUSIMD_OPENCL_VECTORIZE) == 0 || !k->opencl_vec_ok ||
+      k->min_vector_width == 0) {
+    return k->opencl_code;
+  }
+  cl_device_info param;
+  switch (k->min_vector_width) {
+  case 8:
+    param = CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR;
+    break;
+  case 16:
+    param = CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT;
+    break;
+  case 32:
+    param = CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT;
+    break;
+  default:
+    param = CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG;
+    break;
+  }
+  cl_uint width = 1;
+  if (clGetDeviceInfo(d, param, sizeof(width), (void *)&width, NULL) !=
+      CL_SUCCESS) {
+    return k->opencl_code;
+  }
+  // OpenCL vectors have 2, 4, 8 or 16 lanes (3 is not worth it)
+  while (*nb_lanes < 16 && cl_uint(2 * *nb_lanes) <= width) {
+    *nb_lanes *= 2;
+  }
+  if (*nb_lanes == 1) {
+    return k->opencl_code;
+  }
+  std::string buf, res;
+  print_T(&buf, *nb_lanes);
+  std::string const &src = k->opencl_code_vec;
+  size_t i = 0;
+  for (;;) {
+    size_t j = src.find("??????????", i);
+    if (j == std::string::npos) {
+      res.append(src, i, std::string::npos);
+      return res;
+    }
+    res.append(src, i, j - i);
+    res += buf;
+    i = j + 10 /* 10 = sizeof("??????????") */;
+  }
+}
+
+// With TRUSIMD_OPENCL_SPIRV the SPIR-V module of the kernel is used instead
+// of its source (vectorized or not) on 64-bit devices that accept it
+#ifdef CL_VERSION_2_1
+static inline bool opencl_accepts_spirv(cl_device_id d) {
+  cl_uint address_bits;
+  if (opencl_device_version(d) < 210 ||
+      clGetDeviceInfo(d, CL_DEVICE_ADDRESS_BITS, sizeof(address_bits),
+                      (void *)&address_bits, NULL) != CL_SUCCESS ||
+      address_bits != 64) {
+    return false;
+  }
+  return opencl_device_info(d, CL_DEVICE_IL_VERSION).find("SPIR-V") !=
+         std::string::npos;
+}
+#endif
+
+// Source or SPIR-V module given to the device, OpenCL C contracts by
+// default so strict kernels turn it off in the source, the SPIR-V module
+// does it with an execution mode
+static inline std::string opencl_kernel_source(trusimd_hardware *h,
+                                               cl_device_id d, kernel *k,
+                                               int *nb_lanes, bool *il) {
+#ifdef CL_VERSION_2_1
+  *il = (get_option(h, TRUSIMD_OPENCL_SPIRV) != 0 && k->spirv_ok &&
+         opencl_accepts_spirv(d));
+#else
+  *il = false; // no clCreateProgramWithIL before OpenCL 2.1
+#endif
+  if (*il) {
+    *nb_lanes = 1;
+    std::vector<unsigned> module(spirv_module(k));
+    return std::string((const char *)&module[0],
+                       module.size() * sizeof(unsigned));
+  }
+  std::string source(opencl_select_source(h, d, k, nb_lanes));
+  if (k->precision == TRUSIMD_STRICT) {
+    return "#pragma OPENCL FP_CONTRACT OFF\n\n" + source;
+  }
+  return source;
+}
+
+// Build options of the precision policy of the kernel
+static inline std::string opencl_build_options(kernel *k) {
+  switch (k->precision) {
+  case TRUSIMD_CONTRACT:
+    return "-cl-mad-enable";
+  case TRUSIMD_FAST:
+    return "-cl-fast-relaxed-math";
+  default:
+    return "";
+  }
+}
+
+// Find the program in cache, on a miss insert it and start building it in
+// the background or when the caller waits for it. The key hashes the source
+// given to the device, which only depends on the device, the options and
+// the precision of the kernel, so it is computed once per combination of
+// them and kept in the kernel.
+static inline opencl_program_entry_ptr
+opencl_get_program(trusimd_hardware *h, kernel *k, bool background) {
+  cl_context c;
+  if (opencl_retrieve_defaults(&c, NULL, h) == -1) {
+    return opencl_program_entry_ptr();
+  }
+  cl_device_id d;
+  memcpy((void *)&d, (void *)(h->id + sizeof(void *)), sizeof(cl_device_id));
+  std::string options(opencl_build_options(k));
+  std::string variant(opencl_cache_key_prefix(c, d));
+  print_T(&variant, get_option(h, TRUSIMD_OPENCL_VECTORIZE) != 0);
+  print_T(&variant, get_option(h, TRUSIMD_OPENCL_SPIRV) != 0);
+  print_T(&variant, k->precision);
+  {
+    std::lock_guard<std::mutex> lock(opencl_programs_mutex);
+    std::map<std::string, std::string>::const_iterator v =
+        k->opencl_keys.find(variant);
+    if (v != k->opencl_keys.end()) {
+      std::map<std::string, opencl_program_entry_ptr>::iterator it =
+          opencl_programs.find(v->second);
+      if (it != opencl_programs.end()) {
+        if (!background) {
+          opencl_cache_stats.hits++;
+        }
+        return it->second;
+      }
+    }
+  }
+  int nb_lanes;
+  bool il;
+  std::string source(opencl_kernel_source(h, d, k, &nb_lanes, &il));
+  std::string key(opencl_cache_key_prefix(c, d));
+  print_T(&key, std::hash<std::string>()(source));
+  key += options;
+  std::lock_guard<std::mutex> lock(opencl_programs_mutex);
+  k->opencl_keys[variant] = key;
+  std::map<std::string, opencl_program_entry_ptr>::iterator it =
+      opencl_programs.find(key);
+  if (it != opencl_programs.end()) {
+    if (!background) {
+      opencl_cache_stats.hits++;
+    }
+    return it->second;
+  }
+  opencl_cache_stats.misses++;
+  opencl_program_entry_ptr entry(new opencl_program_entry);
+  entry->nb_lanes = nb_lanes;
+  entry->has_reductions = !k->reductions.empty();
+  opencl_program_entry *e = entry.get();
+  std::string name(k->name);
+  entry->built = std::async(background ? std::launch::async
+                                       : std::launch::deferred,
+                            [e, c, d, name, source, options, il]() {
+                              return opencl_build(e, c, d, name, source,
+                                                  options, il);
+                            })
+                     .share();
+  opencl_programs[key] = entry;
+  opencl_cache_stats.nb_entries = opencl_programs.size();
+  return entry;
+}
+
+static inline int opencl_prepare_kernel(trusimd_hardware *h, kernel *k) {
+  if (!opencl_get_program(h, k, true)) {
     return -1;
   }
   return 0;
@@ -289,76 +1743,134 @@ static inline int opencl_copy_to_host(trusimd_hardware *h, void *dst,
 
 // ----------------------------------------------------------------------------
 
-static inline int opencl_compile_run(trusimd_hardware *h, kernel *k, int n,
-                                     va_list ap) {
+static inline int opencl_get_cache_stats(trusimd_cache_stats *stats) {
+  std::lock_guard<std::mutex> lock(opencl_programs_mutex);
+  *stats = opencl_cache_stats;
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+static inline int opencl_evict_kernel(trusimd_hardware *h, kernel *k) {
+  // Evicted entries are destroyed after the lock is released
+  std::map<std::string, opencl_program_entry_ptr> evicted;
+  if (k == NULL) {
+    std::lock_guard<std::mutex> lock(opencl_programs_mutex);
+    evicted.swap(opencl_programs);
+    opencl_cache_stats.nb_entries = 0;
+    return 0;
+  }
   cl_context c;
-  cl_command_queue q;
-  if (opencl_retrieve_defaults(&c, &q, h) == -1) {
+  if (opencl_retrieve_defaults(&c, NULL, h) == -1) {
     return -1;
   }
+  cl_device_id d;
+  memcpy((void *)&d, (void *)(h->id + sizeof(void *)), sizeof(cl_device_id));
+  int nb_lanes;
+  bool il;
+  std::string key(opencl_cache_key_prefix(c, d));
+  print_T(&key, std::hash<std::string>()(
+                    opencl_kernel_source(h, d, k, &nb_lanes, &il)));
+  key += opencl_build_options(k);
+  std::lock_guard<std::mutex> lock(opencl_programs_mutex);
+  std::map<std::string, opencl_program_entry_ptr>::iterator it =
+      opencl_programs.find(key);
+  if (it != opencl_programs.end()) {
+    evicted.insert(*it);
+    opencl_programs.erase(it);
+  }
+  opencl_cache_stats.nb_entries = opencl_programs.size();
+  return 0;
+}
 
-  // Create program
-  const char *source = k->opencl_code.c_str();
-  cl_program p = clCreateProgramWithSource(c, 1, &source, NULL, &opencl_errno);
-  if (opencl_errno != CL_SUCCESS) {
-    trusimd_errno = TRUSIMD_EOPENCL;
-    return -1;
+// ----------------------------------------------------------------------------
+
+// Sets argument i of both kernels of an entry, SVM pointers (ptr) as such
+static inline cl_int opencl_set_arg(opencl_program_entry *entry, cl_uint i,
+                                    size_t size, void *value, void *ptr) {
+  cl_kernel kernels[2] = {entry->k, entry->k_reduce};
+  for (int j = 0; j < 2 && kernels[j] != NULL; j++) {
+    cl_int code;
+#ifdef CL_VERSION_2_0
+    if (ptr != NULL && opencl_is_svm(ptr)) {
+      code = clSetKernelArgSVMPointer(kernels[j], i, ptr);
+    } else
+#endif
+      code = clSetKernelArg(kernels[j], i, size, value);
+    if (code != CL_SUCCESS) {
+      return code;
+    }
   }
+#ifndef CL_VERSION_2_0
+  (void)ptr;
+#endif
+  return CL_SUCCESS;
+}
 
-  // Build program
-  cl_device_id d;
-  memcpy((void *)&d, (void *)(h->id + sizeof(void *)), sizeof(cl_device_id));
-  opencl_errno = clBuildProgram(p, 1, &d, NULL, NULL, NULL);
-  if (opencl_errno != CL_SUCCESS) {
-    // Retrieve build error
-    size_t size;
-    if (clGetProgramBuildInfo(p, d, CL_PROGRAM_BUILD_LOG, 0, NULL, &size) !=
-        CL_SUCCESS) {
-      strcpy(opencl_build_log, "CL_BUILD_PROGRAM_FAILURE: No log available");
-      trusimd_errno = TRUSIMD_EOPENCL;
-      return -1;
+// Buffers of partial results of reductions, they can be released as soon as
+// the launch is enqueued as OpenCL keeps them until the kernels complete
+struct opencl_partials {
+  std::vector<cl_mem> buffers;
+  ~opencl_partials() {
+    for (size_t i = 0; i < buffers.size(); i++) {
+      clReleaseMemObject(buffers[i]);
     }
-    std::vector<char> buf(size + 1);
-    if (clGetProgramBuildInfo(p, d, CL_PROGRAM_BUILD_LOG, size, &buf[0],
-                              NULL) != CL_SUCCESS) {
-      strcpy(opencl_build_log, "CL_BUILD_PROGRAM_FAILURE: No log available");
-      trusimd_errno = TRUSIMD_EOPENCL;
-      return -1;
+  }
+};
+
+// Events the launch waits for, released as soon as it is enqueued
+struct opencl_events {
+  std::vector<cl_event> events;
+  ~opencl_events() {
+    for (size_t i = 0; i < events.size(); i++) {
+      clReleaseEvent(events[i]);
     }
-    strcpy(opencl_build_log, "CL_BUILD_PROGRAM_FAILURE: ");
-    my_strlcpy(opencl_build_log + (sizeof("CL_BUILD_PROGRAM_FAILURE: ") - 1),
-               &buf[0], 256);
-    clReleaseProgram(p);
-    trusimd_errno = TRUSIMD_EOPENCL;
+  }
+};
+
+static inline int opencl_compile_run(trusimd_hardware *h, kernel *k,
+                                     int nb_events, trusimd_event **events,
+                                     trusimd_event *e, int n, va_list ap) {
+  cl_context c;
+  cl_command_queue q;
+  if (opencl_retrieve_defaults(&c, &q, h) == -1) {
     return -1;
   }
 
-  // Create kernel object
-  cl_kernel k2 = clCreateKernel(p, k->name.c_str(), &opencl_errno);
-  if (opencl_errno != CL_SUCCESS) {
-    clReleaseProgram(p);
+  // Retrieve kernel object, build it or wait for its build if it is underway
+  opencl_program_entry_ptr entry(opencl_get_program(h, k, false));
+  if (!entry) {
+    return -1;
+  }
+  if (entry->built.get() == -1) {
+    opencl_errno = entry->error;
+    memcpy((void *)opencl_build_log, (void *)entry->build_log,
+           sizeof(opencl_build_log));
     trusimd_errno = TRUSIMD_EOPENCL;
     return -1;
   }
+  cl_kernel k2 = entry->k;
+  std::unique_lock<std::mutex> lock(entry->launch_mutex);
 
   // Set arguments to kernel: first argument is the global work size
   opencl_errno = clSetKernelArg(k2, 0, sizeof(int), (void *)&n);
   if (opencl_errno != CL_SUCCESS) {
-    clReleaseKernel(k2);
-    clReleaseProgram(p);
     trusimd_errno = TRUSIMD_EOPENCL;
     return -1;
   }
+  std::vector<void *> ptrs;
   for (size_t i = 0; i < k->args.size(); i++) {
     char value[sizeof(void *)];
     size_t size;
+    void *ptr = NULL;
     if (is_pointer(k->args[i])) {
       size = sizeof(cl_mem);
-      void *ptr = va_arg(ap, void *);
+      ptr = va_arg(ap, void *);
       memcpy((void *)value, (void *)&ptr, sizeof(cl_mem));
+      ptrs.push_back(ptr);
     } else {
       size = k->args[i].width / 8;
-      switch(size) {
+      switch(k->args[i].width) {
       case 8: {
         unsigned char uc = (unsigned char)va_arg(ap, unsigned int);
         memcpy((void *)value, (void *)&uc, 1);
@@ -381,35 +1893,150 @@ static inline int opencl_compile_run(trusimd_hardware *h, kernel *k, int n,
       }
       }
     }
-    opencl_errno = clSetKernelArg(k2, cl_uint(i + 1), size, (void *)value);
+    opencl_errno =
+        opencl_set_arg(entry.get(), cl_uint(i + 1), size, (void *)value, ptr);
+    if (opencl_errno != CL_SUCCESS) {
+      trusimd_errno = TRUSIMD_EOPENCL;
+      return -1;
+    }
+  }
+
+  // Choose work-group size, the global size is rounded up to a multiple of
+  // it as kernels return early past n. Asynchronous launches cannot be timed
+  // and use the first candidate until synchronous ones have tuned it.
+  int nb_items = (n + entry->nb_lanes - 1) / entry->nb_lanes;
+  opencl_tuning &tuning = entry->tunings[opencl_size_bucket(nb_items)];
+  bool timed = false;
+  size_t candidate = 0;
+  if (tuning.best == 0 && e == NULL && entry->warm) {
+    size_t nb =
+        opencl_nb_candidates(entry.get(), opencl_size_bucket(nb_items));
+    if (tuning.nb_tried < nb) {
+      tuning.times.resize(nb);
+      candidate = tuning.nb_tried++;
+      timed = true;
+    }
+  }
+  size_t local_work_size =
+      tuning.best != 0 ? tuning.best : entry->local_sizes[candidate];
+  size_t global_work_size = (size_t(nb_items) + local_work_size - 1) /
+                            local_work_size * local_work_size;
+
+  // Reductions: one partial result per work-group of the first kernel, that
+  // the second one receives as its size, and local memory for both
+  int nb_groups = int(global_work_size / local_work_size);
+  opencl_partials partials;
+  size_t arg_i = k->args.size() + 1;
+  for (size_t i = 0; i < k->reductions.size(); i++, arg_i += 2) {
+    size_t elem_size = size_t(k->reductions[i].t.width / 8);
+    cl_mem buf = clCreateBuffer(c, CL_MEM_READ_WRITE,
+                                size_t(std::max(nb_groups, 1)) * elem_size,
+                                NULL, &opencl_errno);
+    if (opencl_errno != CL_SUCCESS) {
+      trusimd_errno = TRUSIMD_EOPENCL;
+      return -1;
+    }
+    partials.buffers.push_back(buf);
+    opencl_errno = opencl_set_arg(entry.get(), cl_uint(arg_i), sizeof(cl_mem),
+                                  (void *)&buf, NULL);
+    if (opencl_errno == CL_SUCCESS) {
+      opencl_errno = clSetKernelArg(k2, cl_uint(arg_i + 1),
+                                    local_work_size * elem_size, NULL);
+    }
+    if (opencl_errno == CL_SUCCESS) {
+      opencl_errno = clSetKernelArg(entry->k_reduce, cl_uint(arg_i + 1),
+                                    entry->reduce_local_size * elem_size,
+                                    NULL);
+    }
+    if (opencl_errno != CL_SUCCESS) {
+      trusimd_errno = TRUSIMD_EOPENCL;
+      return -1;
+    }
+  }
+  if (entry->k_reduce != NULL) {
+    opencl_errno =
+        clSetKernelArg(entry->k_reduce, 0, sizeof(int), (void *)&nb_groups);
     if (opencl_errno != CL_SUCCESS) {
-      clReleaseKernel(k2);
-      clReleaseProgram(p);
       trusimd_errno = TRUSIMD_EOPENCL;
       return -1;
     }
   }
 
-  // Launch kernel
-  size_t global_work_size = size_t(n);
-  size_t local_work_size = 64;
-  opencl_errno = clEnqueueNDRangeKernel(q, k2, 1, NULL, &global_work_size,
-                                        &local_work_size, 0, NULL, NULL);
+  // Launch kernel, the second kernel of reductions waits for the first one
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  std::vector<cl_event> waits(opencl_wait_list(nb_events, events));
+  opencl_events unmaps;
+  if (opencl_unmap_shared_args(q, ptrs, &waits, &unmaps.events) == -1) {
+    return -1;
+  }
+  cl_event ev = NULL, ev_first = NULL;
+  bool want_event = (e != NULL || opencl_profiling(h));
+  opencl_errno = clEnqueueNDRangeKernel(
+      q, k2, 1, NULL, &global_work_size, &local_work_size,
+      cl_uint(waits.size()), waits.empty() ? NULL : &waits[0],
+      want_event || entry->k_reduce != NULL ? &ev_first : NULL);
   if (opencl_errno != CL_SUCCESS) {
-    clReleaseKernel(k2);
-    clReleaseProgram(p);
     trusimd_errno = TRUSIMD_EOPENCL;
     return -1;
   }
+  std::string name_first(k->name);
+  if (entry->k_reduce == NULL) {
+    ev = ev_first;
+    ev_first = NULL;
+  } else {
+    name_first += "_partials";
+    opencl_errno = clEnqueueNDRangeKernel(
+        q, entry->k_reduce, 1, NULL, &entry->reduce_local_size,
+        &entry->reduce_local_size, 1, &ev_first, want_event ? &ev : NULL);
+    if (opencl_errno != CL_SUCCESS) {
+      clReleaseEvent(ev_first);
+      trusimd_errno = TRUSIMD_EOPENCL;
+      return -1;
+    }
+  }
+  if (e != NULL) {
+    if (ev_first != NULL) {
+      opencl_profile_op(h, name_first.c_str(), ev_first, false);
+      clReleaseEvent(ev_first);
+    }
+    opencl_end_op(h, k->name.c_str(), e, ev);
+    return 0;
+  }
+
+  // Arguments were captured by the enqueue, launches of the same kernel on
+  // other queues need not wait for this one
+  lock.unlock();
   opencl_errno = clFinish(q);
+  if (ev_first != NULL) {
+    if (opencl_errno == CL_SUCCESS) {
+      opencl_profile_op(h, name_first.c_str(), ev_first, true);
+    }
+    clReleaseEvent(ev_first);
+  }
   if (opencl_errno != CL_SUCCESS) {
-    clReleaseKernel(k2);
-    clReleaseProgram(p);
+    if (ev != NULL) {
+      clReleaseEvent(ev);
+    }
     trusimd_errno = TRUSIMD_EOPENCL;
     return -1;
   }
-  clReleaseKernel(k2);
-  clReleaseProgram(p);
+  opencl_end_op(h, k->name.c_str(), NULL, ev);
+  double t = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                           t0).count();
+  lock.lock();
+  entry->warm = true;
+
+  // Record timing and pick the fastest candidate once all were tried
+  if (timed) {
+    tuning.times[candidate] = t;
+    if (++tuning.nb_timed == tuning.times.size()) {
+      tuning.best = entry->local_sizes[size_t(
+          std::min_element(tuning.times.begin(), tuning.times.end()) -
+          tuning.times.begin())];
+      tuning.times.clear();
+      opencl_save_tunings(entry.get());
+    }
+  }
   return 0;
 }
 
@@ -423,18 +2050,61 @@ static inline void *opencl_device_malloc(trusimd_hardware *, size_t) {
   trusimd_errno = TRUSIMD_EAVAIL;
   return NULL;
 }
+static inline void *opencl_device_malloc_shared(trusimd_hardware *, size_t,
+                                                void **) {
+  trusimd_errno = TRUSIMD_EAVAIL;
+  return NULL;
+}
 static inline void opencl_device_free(trusimd_hardware *, void *) {}
+static inline int opencl_trim_pool(trusimd_hardware *) { return 0; }
+static inline int opencl_get_profiles(trusimd_hardware *, trusimd_profile *,
+                                      int) {
+  return 0;
+}
+static inline void opencl_reset_profiles(trusimd_hardware *) {}
+static inline int opencl_get_pool_stats(trusimd_hardware *,
+                                        trusimd_pool_stats *stats) {
+  memset((void *)stats, 0, sizeof(trusimd_pool_stats));
+  return 0;
+}
+static inline int opencl_create_stream(trusimd_hardware *, trusimd_hardware *,
+                                       int) {
+  trusimd_errno = TRUSIMD_EAVAIL;
+  return -1;
+}
+static inline int opencl_destroy_stream(trusimd_hardware *) { return 0; }
 static inline int opencl_copy_to_device(trusimd_hardware *, void *, void *,
-                                        size_t) {
+                                        size_t, int, trusimd_event **,
+                                        trusimd_event *) {
   trusimd_errno = TRUSIMD_EAVAIL;
   return -1;
 }
 static inline int opencl_copy_to_host(trusimd_hardware *, void *, void *,
-                                      size_t) {
+                                      size_t, int, trusimd_event **,
+                                      trusimd_event *) {
+  trusimd_errno = TRUSIMD_EAVAIL;
+  return -1;
+}
+static inline int opencl_wait(int, trusimd_event **) { return 0; }
+static inline int opencl_marker(trusimd_hardware *, int, trusimd_event **,
+                                trusimd_event *) {
+  trusimd_errno = TRUSIMD_EAVAIL;
+  return -1;
+}
+static inline void opencl_release_event(trusimd_event *) {}
+static inline int opencl_prepare_kernel(trusimd_hardware *, kernel *) {
   trusimd_errno = TRUSIMD_EAVAIL;
   return -1;
 }
+static inline int opencl_get_cache_stats(trusimd_cache_stats *stats) {
+  memset((void *)stats, 0, sizeof(trusimd_cache_stats));
+  return 0;
+}
+static inline int opencl_evict_kernel(trusimd_hardware *, kernel *) {
+  return 0;
+}
 static inline int opencl_compile_run(trusimd_hardware *, kernel *, int,
+                                     trusimd_event **, trusimd_event *, int,
                                      va_list) {
   trusimd_errno = TRUSIMD_EAVAIL;
   return -1;
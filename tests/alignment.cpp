@@ -0,0 +1,69 @@
+#include <trusimd.hpp>
+#include <iostream>
+
+// Checks a[i] = b[i] + c[i] on the first n elements
+static int check(const char *argv0, float const *a, float const *b,
+                 float const *c, int n) {
+  for (int i = 0; i < n; i++) {
+    if (a[i] != b[i] + c[i]) {
+      std::cerr << argv0 << ": error: " << a[i] << " vs. " << (b[i] + c[i])
+                << std::endl;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  using namespace trusimd;
+
+  // Expect one argument
+  if (argc != 2) {
+    std::cerr << argv[0] << ": error: usage: " << argv[0]
+              << " search_string\n";
+    return -1;
+  }
+
+  // Poll hardware and select hardware based on argv[1]
+  hardware &h = find_hardware(argv[1]);
+  std::cout << argv[0] << ": info: selected " << h.description << '\n';
+
+  // Buffers are allocated with the smallest alignment
+  const int n = 4097;
+  set_option(h, TRUSIMD_ALIGNMENT, 0);
+  buffer_pair<float> a(h, n + 1), b(h, n + 1), c(h, n + 1);
+  for (int i = 0; i <= n; i++) {
+    b[i] = float(i);
+    c[i] = float(2 * i);
+  }
+  b.copy_to_device();
+  c.copy_to_device();
+
+  kernel vector_add("vector_add", float32ptr, float32ptr, float32ptr);
+  {
+    arg(0)[gid] = arg(1)[gid] + arg(2)[gid];
+  }
+
+  // Raising the alignment after allocation must not assume it
+  set_option(h, TRUSIMD_ALIGNMENT, 4096);
+  vector_add(h, n, a, b, c);
+  a.copy_to_host();
+  if (check(argv[0], &a[0], &b[0], &c[0], n) != 0) {
+    return -1;
+  }
+  std::cout << argv[0] << ": info: buffers allocated before OK\n";
+
+  // Pointers inside buffers are only aligned on their elements
+  float *a1 = a.device() + 1;
+  float *b1 = b.device() + 1;
+  float *c1 = c.device() + 1;
+  set_option(h, TRUSIMD_ALIGNMENT, 64);
+  vector_add(h, n, a1, b1, c1);
+  a.copy_to_host();
+  if (check(argv[0], &a[1], &b[1], &c[1], n) != 0) {
+    return -1;
+  }
+  std::cout << argv[0] << ": info: pointers inside buffers OK\n";
+
+  return 0;
+}
@@ -0,0 +1,111 @@
+#include <trusimd.hpp>
+#include <iostream>
+
+// Checks if_/else_ and for_ against the host for every n in [0, max_n], the
+// conditions differ between lanes of a vector:
+//   if (x[i] < 0) {
+//     y[i] = (c[i] == 0 ? x[i] : x[i] + x[i]);
+//   } else {
+//     v = c[i];
+//     for (j = begin; j < end; j++) v += c[i];
+//     z[i] = v;
+//   }
+static int check(const char *argv0, trusimd::hardware &h, int max_n) {
+  using namespace trusimd;
+  buffer_pair<float> x(h, max_n + 1), y(h, max_n + 1);
+  buffer_pair<int> c(h, max_n + 1), z(h, max_n + 1);
+  for (int i = 0; i <= max_n; i++) {
+    x[i] = float(i % 9) - 4.0f;
+    c[i] = i % 5;
+  }
+  x.copy_to_device();
+  c.copy_to_device();
+
+  kernel cf("control_flow", float32ptr, float32ptr, int32ptr, int32ptr,
+            int32, int32);
+  {
+    var xv = arg(0)[gid];
+    var cv = arg(2)[gid];
+    if_(xv > xv + xv);
+    {
+      arg(1)[gid] = xv + xv;
+      if_(cv == cv + cv);
+      {
+        arg(1)[gid] = xv;
+      }
+      end_if();
+    }
+    else_();
+    {
+      var v(vector(int32));
+      v = cv;
+      var j(int32);
+      for_(j, arg(4), arg(5));
+      {
+        v = v + cv;
+      }
+      end_for();
+      arg(3)[gid] = v;
+    }
+    end_if();
+  }
+
+  const int begin = 1, end = 4;
+  for (int n = 0; n <= max_n; n++) {
+    for (int i = 0; i <= max_n; i++) {
+      y[i] = 99.0f;
+      z[i] = 99;
+    }
+    y.copy_to_device();
+    z.copy_to_device();
+    cf(h, n, x, y, c, z, begin, end);
+    y.copy_to_host();
+    z.copy_to_host();
+    for (int i = 0; i <= max_n; i++) {
+      float ey = 99.0f;
+      int ez = 99;
+      if (i < n && x[i] < 0.0f) {
+        ey = (c[i] == 0 ? x[i] : x[i] + x[i]);
+      } else if (i < n) {
+        ez = c[i];
+        for (int j = begin; j < end; j++) {
+          ez += c[i];
+        }
+      }
+      if (y[i] != ey || z[i] != ez) {
+        std::cerr << argv0 << ": error: n = " << n << ", i = " << i
+                  << ": y = " << y[i] << " vs. " << ey << ", z = " << z[i]
+                  << " vs. " << ez << std::endl;
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  using namespace trusimd;
+
+  // Expect one argument
+  if (argc != 2) {
+    std::cerr << argv[0] << ": error: usage: " << argv[0]
+              << " search_string\n";
+    return -1;
+  }
+
+  // Poll hardware and select hardware based on argv[1]
+  hardware &h = find_hardware(argv[1]);
+  std::cout << argv[0] << ": info: selected " << h.description << '\n';
+
+  // Blocks run masked in vectors and natively in the scalar tail, both are
+  // checked with the masked tail too
+  for (int masked = 0; masked < 2; masked++) {
+    set_option(h, TRUSIMD_MASKED_TAIL, masked);
+    if (check(argv[0], h, 70) != 0) {
+      return -1;
+    }
+  }
+  std::cout << argv[0] << ": info: control flow OK" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,53 @@
+import sys
+from trusimd import *
+
+# Expect one argument
+if len(sys.argv) == 1:
+    print('{}: error: usage: {} search_string'. \
+          format(sys.argv[0], sys.argv[0]))
+    sys.exit(1)
+
+# Poll hardware and select hardware based on argv[1]
+hardwares = poll_hardware()
+h = [x for x in hardwares \
+     if x.description.lower().find(sys.argv[1].lower()) >= 0]
+
+if len(h) == 0:
+    print('{}: info: no hardware could be selected'.format(sys.argv[0]))
+    sys.exit(0)
+h = h[0]
+print('{}: info: selected {}'.format(sys.argv[0], h))
+
+# Kernel, the condition differs between lanes so v is a vector:
+#   z[i] = (x[i] > 0 ? x[i] : x[i] * (end - begin + 1))
+with kernel('control_flow', int32ptr, int32ptr, int32, int32) as cf:
+    xv = arg(0)[gid]
+    if_(xv < xv + xv)
+    arg(1)[gid] = xv
+    else_()
+    v = var(vector(int32))
+    v.value = xv
+    j = var(int32)
+    for_(j, arg(2), arg(3))
+    v.value = v + xv
+    end_for()
+    arg(1)[gid] = v
+    end_if()
+
+# Check against the host, n goes past one vector with a tail
+n = 37
+begin, end = 1, 4
+x = buffer_pair(h, n, int32)
+z = buffer_pair(h, n, int32)
+for i in range(n):
+    x[i] = i % 7 - 3
+x.copy_to_device()
+cf.run(h, n, x, z, begin, end)
+z.copy_to_host()
+for i in range(n):
+    expected = x[i] if x[i] > 0 else x[i] * (end - begin + 1)
+    if z[i] != expected:
+        print('{}: error: z[{}] = {} vs. {}'. \
+              format(sys.argv[0], i, z[i], expected))
+        sys.exit(-1)
+print('{}: info: control flow OK'.format(sys.argv[0]))
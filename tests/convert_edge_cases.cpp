@@ -0,0 +1,117 @@
+#include <trusimd.hpp>
+#include <iostream>
+#include <cmath>
+#include <limits>
+
+// Special values, the ones that are in range of no integer type are only
+// specified with TRUSIMD_CONVERT_SAT
+static const float nan_ = std::numeric_limits<float>::quiet_NaN();
+static const float inf = std::numeric_limits<float>::infinity();
+static const float values[] = {nan_, inf,    -inf,   0.0f,    -0.0f,
+                               0.5f, -0.5f,  1.5f,   -2.5f,   127.5f,
+                               -128.5f, 255.5f, 1e10f, -1e10f, -nan_};
+static const int nb_values = int(sizeof(values) / sizeof(values[0]));
+
+// Returns false when the result is unspecified
+template <typename I> static bool expected(float x, int mode, I *res) {
+  const double lo = double(std::numeric_limits<I>::min());
+  const double hi = double(std::numeric_limits<I>::max());
+  if (x != x) {
+    *res = I(0);
+    return (mode & TRUSIMD_CONVERT_SAT) != 0;
+  }
+  double r = (mode & TRUSIMD_CONVERT_ROUND ? std::nearbyint(double(x))
+                                           : std::trunc(double(x)));
+  if (r < lo || r > hi) {
+    *res = I(r < lo ? lo : hi);
+    return (mode & TRUSIMD_CONVERT_SAT) != 0;
+  }
+  *res = I(r);
+  return true;
+}
+
+template <typename I>
+static int check_int(const char *argv0, const char *name, int mode,
+                     trusimd::buffer_pair<float> const &x,
+                     trusimd::buffer_pair<I> const &y, int n) {
+  for (int i = 0; i < n; i++) {
+    I e;
+    if (expected(x[i], mode, &e) && y[i] != e) {
+      std::cerr << argv0 << ": error: mode " << mode << ", " << name << "("
+                << x[i] << ") = " << double(y[i]) << " vs. " << double(e)
+                << std::endl;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  using namespace trusimd;
+
+  // Expect one argument
+  if (argc != 2) {
+    std::cerr << argv[0] << ": error: usage: " << argv[0]
+              << " search_string\n";
+    return -1;
+  }
+
+  // Poll hardware and select hardware based on argv[1]
+  hardware &h = find_hardware(argv[1]);
+  std::cout << argv[0] << ": info: selected " << h.description << '\n';
+
+  // Values are repeated so that they go through vectors and the tail
+  const int n = 4 * nb_values + 3;
+  buffer_pair<float> x(h, n);
+  buffer_pair<double> d(h, n);
+  buffer_pair<signed char> i8(h, n);
+  buffer_pair<unsigned char> u8(h, n);
+  buffer_pair<int> i32(h, n);
+  buffer_pair<unsigned> u32(h, n);
+  for (int i = 0; i < n; i++) {
+    x[i] = values[(i * 7) % nb_values];
+  }
+  x.copy_to_device();
+
+  // Modes only change conversions to integers, floats keep NaN and Inf.
+  // Every mode is checked with the scalar and the masked tail.
+  const int modes[] = {TRUSIMD_CONVERT_TRUNC, TRUSIMD_CONVERT_ROUND,
+                       TRUSIMD_CONVERT_SAT,
+                       TRUSIMD_CONVERT_ROUND | TRUSIMD_CONVERT_SAT};
+  for (int t = 0; t < 8; t++) {
+    int m = t % 4;
+    set_option(h, TRUSIMD_MASKED_TAIL, t / 4);
+    kernel cvt("cvt", float32ptr, float64ptr, int8ptr, uint8ptr, int32ptr,
+               uint32ptr);
+    {
+      var xv = arg(0)[gid];
+      arg(1)[gid] = convert(xv, float64, modes[m]);
+      arg(2)[gid] = convert(xv, int8, modes[m]);
+      arg(3)[gid] = convert(xv, uint8, modes[m]);
+      arg(4)[gid] = convert(xv, int32, modes[m]);
+      arg(5)[gid] = convert(xv, uint32, modes[m]);
+    }
+    cvt(h, n, x, d, i8, u8, i32, u32);
+    d.copy_to_host();
+    i8.copy_to_host();
+    u8.copy_to_host();
+    i32.copy_to_host();
+    u32.copy_to_host();
+    for (int i = 0; i < n; i++) {
+      if (!(d[i] == double(x[i]) || (d[i] != d[i] && x[i] != x[i]))) {
+        std::cerr << argv[0] << ": error: mode " << modes[m]
+                  << ", float64(" << x[i] << ") = " << d[i] << std::endl;
+        return -1;
+      }
+    }
+    if (check_int(argv[0], "int8", modes[m], x, i8, n) != 0 ||
+        check_int(argv[0], "uint8", modes[m], x, u8, n) != 0 ||
+        check_int(argv[0], "int32", modes[m], x, i32, n) != 0 ||
+        check_int(argv[0], "uint32", modes[m], x, u32, n) != 0) {
+      return -1;
+    }
+  }
+  std::cout << argv[0] << ": info: conversions OK" << std::endl;
+
+  return 0;
+}
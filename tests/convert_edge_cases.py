@@ -0,0 +1,42 @@
+import sys
+from trusimd import *
+
+# Expect one argument
+if len(sys.argv) == 1:
+    print('{}: error: usage: {} search_string'. \
+          format(sys.argv[0], sys.argv[0]))
+    sys.exit(1)
+
+# Poll hardware and select hardware based on argv[1]
+hardwares = poll_hardware()
+h = [x for x in hardwares \
+     if x.description.lower().find(sys.argv[1].lower()) >= 0]
+
+if len(h) == 0:
+    print('{}: info: no hardware could be selected'.format(sys.argv[0]))
+    sys.exit(0)
+h = h[0]
+print('{}: info: selected {}'.format(sys.argv[0], h))
+
+# Saturating conversions of NaN and infinities, they go to 0 and the bounds
+# of the destination whether rounding or not
+inf = float('inf')
+values = [float('nan'), inf, -inf, 1.5, -1.5, 1e10, -1e10]
+n = len(values)
+x = buffer_pair(h, n, float32)
+y = buffer_pair(h, n, int8)
+for i in range(n):
+    x[i] = values[i]
+x.copy_to_device()
+for mode in [TRUSIMD_CONVERT_SAT, TRUSIMD_CONVERT_ROUND | TRUSIMD_CONVERT_SAT]:
+    with kernel('cvt', float32ptr, int8ptr) as cvt:
+        arg(1)[gid] = convert(arg(0)[gid], int8, mode)
+    cvt.run(h, n, x, y)
+    y.copy_to_host()
+    r = 2 if mode & TRUSIMD_CONVERT_ROUND else 1
+    expected = [0, 127, -128, r, -r, 127, -128]
+    if [y[i] for i in range(n)] != expected:
+        print('{}: error: mode {}: {} vs. {}'. \
+              format(sys.argv[0], mode, [y[i] for i in range(n)], expected))
+        sys.exit(-1)
+print('{}: info: conversions OK'.format(sys.argv[0]))
@@ -0,0 +1,51 @@
+import sys
+import math
+from trusimd import *
+
+# Expect one argument
+if len(sys.argv) == 1:
+    print('{}: error: usage: {} search_string'. \
+          format(sys.argv[0], sys.argv[0]))
+    sys.exit(1)
+
+# Poll hardware and select hardware based on argv[1]
+hardwares = poll_hardware()
+h = [x for x in hardwares \
+     if x.description.lower().find(sys.argv[1].lower()) >= 0]
+
+if len(h) == 0:
+    print('{}: info: no hardware could be selected'.format(sys.argv[0]))
+    sys.exit(0)
+h = h[0]
+print('{}: info: selected {}'.format(sys.argv[0], h))
+
+# Kernel, values are exact in float32 so results compare exactly
+with kernel('elementwise', float32ptr, float32ptr, float32ptr, float32ptr,
+            float32ptr, float32ptr, float32ptr) as ew:
+    a = arg(0)[gid]
+    b = arg(1)[gid]
+    arg(2)[gid] = fma(a, b, a)
+    arg(3)[gid] = minimum(a, b)
+    arg(4)[gid] = maximum(a, b)
+    arg(5)[gid] = abs(a)
+    arg(6)[gid] = sqrt(b)
+
+n = 37
+bufs = [buffer_pair(h, n, float32) for i in range(7)]
+for i in range(n):
+    bufs[0][i] = float(i % 9 - 4)
+    bufs[1][i] = float((i % 5) * (i % 5))
+for b in bufs[:2]:
+    b.copy_to_device()
+ew.run(h, n, *bufs)
+for b in bufs[2:]:
+    b.copy_to_host()
+for i in range(n):
+    x, y = bufs[0][i], bufs[1][i]
+    expected = [x * y + x, min(x, y), max(x, y), abs(x), math.sqrt(y)]
+    got = [b[i] for b in bufs[2:]]
+    if got != expected:
+        print('{}: error: {}, {}: {} vs. {}'. \
+              format(sys.argv[0], x, y, got, expected))
+        sys.exit(-1)
+print('{}: info: elementwise operations OK'.format(sys.argv[0]))
@@ -0,0 +1,72 @@
+#include <trusimd.hpp>
+#include <iostream>
+#include <chrono>
+
+int main(int argc, char **argv) {
+  using namespace trusimd;
+
+  // Expect one argument
+  if (argc != 2) {
+    std::cerr << argv[0] << ": error: usage: " << argv[0]
+              << " search_string\n";
+    return -1;
+  }
+
+  // Poll hardware and select OpenCL hardware based on argv[1]
+  hardware &h = find_hardware(argv[1]);
+  std::cerr << argv[0] << ": info: selected " << h.description << '\n';
+  if (h.accelerator != TRUSIMD_OPENCL) {
+    std::cerr << argv[0] << ": error: selected hardware is not OpenCL\n";
+    return -1;
+  }
+
+  // Create memory buffers
+  const int max_n = 1 << 22;
+  const int nb_runs = 20;
+  buffer_pair<float> a(h, max_n), b(h, max_n), c(h, max_n);
+  for (int i = 0; i < max_n; i++) {
+    b[i] = float(i);
+    c[i] = float(i);
+  }
+  b.copy_to_device();
+  c.copy_to_device();
+
+  // Kernel
+  kernel vector_add("vector_add", float32ptr, float32ptr, float32ptr);
+  {
+    arg(0)[gid] = arg(1)[gid] + arg(2)[gid];
+  }
+
+  // Time scalar and vectorized kernels, both are compiled on the first
+  // launch, odd sizes exercise the scalar tail of vectorized kernels
+  std::cout << "n,scalar_ns,vectorized_ns\n";
+  for (int n = 1000; n <= max_n; n = n * 2 + 1) {
+    double ns[2];
+    for (int vectorize = 0; vectorize < 2; vectorize++) {
+      set_option(h, TRUSIMD_OPENCL_VECTORIZE, vectorize);
+      vector_add(h, n, a, b, c);
+      std::chrono::steady_clock::time_point t0 =
+          std::chrono::steady_clock::now();
+      for (int r = 0; r < nb_runs; r++) {
+        vector_add(h, n, a, b, c);
+      }
+      ns[vectorize] = std::chrono::duration<double, std::nano>(
+                          std::chrono::steady_clock::now() - t0)
+                          .count() /
+                      nb_runs;
+    }
+    std::cout << n << ',' << ns[0] << ',' << ns[1] << '\n';
+
+    // Check result of the last launch
+    a.copy_to_host();
+    for (int i = 0; i < n; i++) {
+      if (a[i] != b[i] + c[i]) {
+        std::cerr << argv[0] << ": error: " << a[i] << " vs. "
+                  << (b[i] + c[i]) << std::endl;
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,90 @@
+#include <trusimd.hpp>
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+// Same as convert(x, int8, TRUSIMD_CONVERT_ROUND | TRUSIMD_CONVERT_SAT)
+static signed char quantize(float x) {
+  if (x != x) {
+    return 0;
+  }
+  float r = std::nearbyint(x);
+  return (signed char)(r < -128.0f ? -128.0f : r > 127.0f ? 127.0f : r);
+}
+
+int main(int argc, char **argv) {
+  using namespace trusimd;
+
+  // Expect one argument
+  if (argc != 2) {
+    std::cerr << argv[0] << ": error: usage: " << argv[0]
+              << " search_string\n";
+    return -1;
+  }
+
+  // Poll hardware and select hardware based on argv[1]
+  hardware &h = find_hardware(argv[1]);
+  std::cerr << argv[0] << ": info: selected " << h.description << '\n';
+
+  // Create memory buffers, values go past the int8 range on both sides and
+  // include ties that round to even
+  const int max_n = 1 << 22;
+  const int nb_runs = 20;
+  buffer_pair<float> x(h, max_n);
+  buffer_pair<signed char> q(h, max_n);
+  std::vector<signed char> expected(max_n);
+  for (int i = 0; i < max_n; i++) {
+    x[i] = float(i % 601 - 300) * 0.5f;
+  }
+  x.copy_to_device();
+
+  // Kernel
+  kernel quantize_int8("quantize_int8", float32ptr, int8ptr);
+  {
+    arg(1)[gid] = convert(arg(0)[gid], int8,
+                          TRUSIMD_CONVERT_ROUND | TRUSIMD_CONVERT_SAT);
+  }
+
+  // Time the kernel against the scalar host loop, the kernel is compiled on
+  // first launch
+  std::cout << "n,kernel_ns,host_ns\n";
+  for (int n = 1000; n <= max_n; n = n * 2 + 1) {
+    double ns[2];
+    for (int host = 0; host < 2; host++) {
+      // First iteration is a warm-up
+      std::chrono::steady_clock::time_point t0;
+      for (int r = 0; r <= nb_runs; r++) {
+        if (r == 1) {
+          t0 = std::chrono::steady_clock::now();
+        }
+        if (host) {
+          for (int i = 0; i < n; i++) {
+            expected[i] = quantize(x[i]);
+          }
+        } else {
+          quantize_int8(h, n, x, q);
+        }
+        if (r == nb_runs) {
+          ns[host] = std::chrono::duration<double, std::nano>(
+                         std::chrono::steady_clock::now() - t0)
+                         .count() /
+                     nb_runs;
+        }
+      }
+    }
+    std::cout << n << ',' << ns[0] << ',' << ns[1] << '\n';
+
+    // Check results of the last launches
+    q.copy_to_host();
+    for (int i = 0; i < n; i++) {
+      if (q[i] != expected[i]) {
+        std::cerr << argv[0] << ": error: " << int(q[i]) << " vs. "
+                  << int(expected[i]) << " for " << x[i] << std::endl;
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,94 @@
+#include <trusimd.hpp>
+#include <iostream>
+#include <chrono>
+
+int main(int argc, char **argv) {
+  using namespace trusimd;
+
+  // Expect one argument
+  if (argc != 2) {
+    std::cerr << argv[0] << ": error: usage: " << argv[0]
+              << " search_string\n";
+    return -1;
+  }
+
+  // Poll hardware and select hardware based on argv[1]
+  hardware &h = find_hardware(argv[1]);
+  std::cerr << argv[0] << ": info: selected " << h.description << '\n';
+
+  // Create memory buffers, values are multiples of 0.5 small enough so that
+  // sums are exact whatever the order of additions
+  const int max_n = 1 << 22;
+  const int nb_runs = 20;
+  buffer_pair<float> a(h, max_n), b(h, max_n), c(h, max_n), s(h, 1);
+  for (int i = 0; i < max_n; i++) {
+    b[i] = float(i % 2);
+    c[i] = 0.5f;
+  }
+  b.copy_to_device();
+  c.copy_to_device();
+
+  // Kernels
+  kernel sum_add("sum_add", float32ptr, float32ptr, float32ptr);
+  {
+    reduce(TRUSIMD_REDUCE_SUM, arg(0), arg(1)[gid] + arg(2)[gid]);
+  }
+  kernel vector_add("vector_add", float32ptr, float32ptr, float32ptr);
+  {
+    arg(0)[gid] = arg(1)[gid] + arg(2)[gid];
+  }
+
+  // Time the in-kernel reduction against copying sums back to the
+  // host and summing them there, both kernels are compiled on first launch
+  std::cout << "n,kernel_ns,host_ns\n";
+  for (int n = 1000; n <= max_n; n = n * 2 + 1) {
+    float expected = 0.0f;
+    for (int i = 0; i < n; i++) {
+      expected += b[i] + c[i];
+    }
+
+    double ns[2];
+    float sum[2] = {0.0f, 0.0f};
+    for (int host = 0; host < 2; host++) {
+      // First iteration is a warm-up
+      std::chrono::steady_clock::time_point t0;
+      for (int r = 0; r <= nb_runs; r++) {
+        if (r == 1) {
+          t0 = std::chrono::steady_clock::now();
+        }
+        if (host) {
+          vector_add(h, n, a, b, c);
+          a.copy_to_host();
+          sum[host] = 0.0f;
+          for (int i = 0; i < n; i++) {
+            sum[host] += a[i];
+          }
+        } else {
+          s[0] = 0.0f;
+          s.copy_to_device();
+          sum_add(h, n, s, b, c);
+          s.copy_to_host();
+          sum[host] = s[0];
+        }
+        if (r == nb_runs) {
+          ns[host] = std::chrono::duration<double, std::nano>(
+                         std::chrono::steady_clock::now() - t0)
+                         .count() /
+                     nb_runs;
+        }
+      }
+    }
+    std::cout << n << ',' << ns[0] << ',' << ns[1] << '\n';
+
+    // Check results of the last launches
+    for (int host = 0; host < 2; host++) {
+      if (sum[host] != expected) {
+        std::cerr << argv[0] << ": error: " << sum[host] << " vs. "
+                  << expected << std::endl;
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
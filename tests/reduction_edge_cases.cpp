@@ -0,0 +1,79 @@
+#include <trusimd.hpp>
+#include <iostream>
+#include <algorithm>
+
+// Reduces x[0..n) into s (sum), lo (min) and hi (max) that start with
+// known values, for n = 0 they must be left untouched. Values are small
+// integers so that the float sum is exact whatever the order.
+static int check(const char *argv0, trusimd::hardware &h, int n) {
+  using namespace trusimd;
+  buffer_pair<float> x(h, n + 1), s(h, 1);
+  buffer_pair<int> ix(h, n + 1), lo(h, 1), hi(h, 1);
+  float es = 3.0f;
+  int elo = 1000, ehi = -1000;
+  for (int i = 0; i < n; i++) {
+    x[i] = float(i % 7);
+    ix[i] = (i * 37) % 1001 - 500;
+    es += x[i];
+    elo = std::min(elo, ix[i]);
+    ehi = std::max(ehi, ix[i]);
+  }
+  s[0] = 3.0f;
+  lo[0] = 1000;
+  hi[0] = -1000;
+  x.copy_to_device();
+  ix.copy_to_device();
+  s.copy_to_device();
+  lo.copy_to_device();
+  hi.copy_to_device();
+
+  kernel red("red", float32ptr, float32ptr, int32ptr, int32ptr, int32ptr);
+  {
+    reduce(TRUSIMD_REDUCE_SUM, arg(1), arg(0)[gid]);
+    reduce(TRUSIMD_REDUCE_MIN, arg(3), arg(2)[gid]);
+    reduce(TRUSIMD_REDUCE_MAX, arg(4), arg(2)[gid]);
+  }
+  red(h, n, x, s, ix, lo, hi);
+  s.copy_to_host();
+  lo.copy_to_host();
+  hi.copy_to_host();
+  if (s[0] != es || lo[0] != elo || hi[0] != ehi) {
+    std::cerr << argv0 << ": error: n = " << n << ": sum = " << s[0]
+              << " vs. " << es << ", min = " << lo[0] << " vs. " << elo
+              << ", max = " << hi[0] << " vs. " << ehi << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  using namespace trusimd;
+
+  // Expect one argument
+  if (argc != 2) {
+    std::cerr << argv[0] << ": error: usage: " << argv[0]
+              << " search_string\n";
+    return -1;
+  }
+
+  // Poll hardware and select hardware based on argv[1]
+  hardware &h = find_hardware(argv[1]);
+  std::cout << argv[0] << ": info: selected " << h.description << '\n';
+
+  // Small chunks on several threads so that LLVM partial results are merged
+  // across chunks, sizes go around the work-group sizes of OpenCL (up to
+  // 1024) and CUDA (128) and past several work-groups
+  set_option(h, TRUSIMD_NB_THREADS, 4);
+  set_option(h, TRUSIMD_CHUNK_SIZE, 64);
+  const int sizes[] = {0,   1,    2,    63,   64,   65,    127,  128,
+                       129, 255,  256,  257,  1023, 1024,  1025, 4097,
+                       65537};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    if (check(argv[0], h, sizes[i]) != 0) {
+      return -1;
+    }
+  }
+  std::cout << argv[0] << ": info: reductions OK" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,49 @@
+import sys
+from trusimd import *
+
+# Expect one argument
+if len(sys.argv) == 1:
+    print('{}: error: usage: {} search_string'. \
+          format(sys.argv[0], sys.argv[0]))
+    sys.exit(1)
+
+# Poll hardware and select hardware based on argv[1]
+hardwares = poll_hardware()
+h = [x for x in hardwares \
+     if x.description.lower().find(sys.argv[1].lower()) >= 0]
+
+if len(h) == 0:
+    print('{}: info: no hardware could be selected'.format(sys.argv[0]))
+    sys.exit(0)
+h = h[0]
+print('{}: info: selected {}'.format(sys.argv[0], h))
+
+# Kernel, the results accumulate into the values already in s, lo and hi
+with kernel('red', int32ptr, int32ptr, int32ptr, int32ptr) as red:
+    reduce(TRUSIMD_REDUCE_SUM, arg(1), arg(0)[gid])
+    reduce(TRUSIMD_REDUCE_MIN, arg(2), arg(0)[gid])
+    reduce(TRUSIMD_REDUCE_MAX, arg(3), arg(0)[gid])
+
+# Empty range, one element and more than one work-group
+for n in [0, 1, 1000]:
+    x = buffer_pair(h, n + 1, int32)
+    s = buffer_pair(h, 1, int32)
+    lo = buffer_pair(h, 1, int32)
+    hi = buffer_pair(h, 1, int32)
+    for i in range(n):
+        x[i] = (i * 37) % 1001 - 500
+    s[0] = 3
+    lo[0] = 1000
+    hi[0] = -1000
+    for b in [x, s, lo, hi]:
+        b.copy_to_device()
+    red.run(h, n, x, s, lo, hi)
+    for b in [s, lo, hi]:
+        b.copy_to_host()
+    values = [x[i] for i in range(n)]
+    expected = [3 + sum(values), min(values + [1000]), max(values + [-1000])]
+    if [s[0], lo[0], hi[0]] != expected:
+        print('{}: error: n = {}: {} vs. {}'. \
+              format(sys.argv[0], n, [s[0], lo[0], hi[0]], expected))
+        sys.exit(-1)
+print('{}: info: reductions OK'.format(sys.argv[0]))
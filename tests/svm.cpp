@@ -0,0 +1,72 @@
+#include <trusimd.hpp>
+#include <iostream>
+
+int main(int argc, char **argv) {
+  using namespace trusimd;
+
+  // Expect one argument
+  if (argc != 2) {
+    std::cerr << argv[0] << ": error: usage: " << argv[0]
+              << " search_string\n";
+    return -1;
+  }
+
+  // Poll hardware and select an OpenCL device based on argv[1]
+  hardware &h = find_hardware(argv[1]);
+  std::cout << argv[0] << ": info: selected " << h.description << '\n';
+  if (h.accelerator != TRUSIMD_OPENCL) {
+    std::cerr << argv[0] << ": error: not an OpenCL device" << std::endl;
+    return -1;
+  }
+  set_option(h, TRUSIMD_SVM, 1);
+
+  // Devices without SVM must refuse the allocations instead of silently
+  // falling back to OpenCL buffers
+  const int n = 1000;
+  void *host_ptr;
+  void *dev_ptr = trusimd_device_malloc_shared(&h, n * sizeof(float),
+                                               &host_ptr);
+  if (dev_ptr == NULL) {
+    if (trusimd_errno != TRUSIMD_EAVAIL ||
+        trusimd_device_malloc(&h, n * sizeof(float)) != NULL ||
+        trusimd_errno != TRUSIMD_EAVAIL) {
+      std::cerr << argv[0] << ": error: SVM unavailable but allocations do "
+                << "not fail with TRUSIMD_EAVAIL" << std::endl;
+      return -1;
+    }
+    std::cout << argv[0] << ": info: SVM not available" << std::endl;
+    return 0;
+  }
+  trusimd_device_free(&h, dev_ptr);
+
+  // SVM buffers are the same pointer on the host and on the device
+  buffer_pair<float> a(h, n), b(h, n), c(h, n);
+  if (a.host() != a.device() || c.host() != c.device()) {
+    std::cerr << argv[0] << ": error: buffers are not SVM pointers"
+              << std::endl;
+    return -1;
+  }
+  for (int i = 0; i < n; i++) {
+    a[i] = float(i);
+    b[i] = 1.0f;
+  }
+  a.copy_to_device();
+  b.copy_to_device();
+
+  kernel add("add", float32ptr, float32ptr, float32ptr);
+  {
+    arg(2)[gid] = arg(0)[gid] + arg(1)[gid];
+  }
+  add(h, n, a, b, c);
+  c.copy_to_host();
+  for (int i = 0; i < n; i++) {
+    if (c[i] != float(i) + 1.0f) {
+      std::cerr << argv[0] << ": error: c[" << i << "] = " << c[i]
+                << " vs. " << float(i) + 1.0f << std::endl;
+      return -1;
+    }
+  }
+  std::cout << argv[0] << ": info: SVM buffers OK" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,75 @@
+#include <trusimd.hpp>
+#include <iostream>
+
+// Launches c[i] = a[i] + b[i] for all n in [0, max_n] and checks that
+// elements past n are left untouched
+template <typename T>
+static int check(const char *argv0, trusimd::hardware &h, trusimd_type tptr,
+                 int max_n) {
+  using namespace trusimd;
+  buffer_pair<T> a(h, max_n + 1), b(h, max_n + 1), c(h, max_n + 1);
+  for (int i = 0; i <= max_n; i++) {
+    a[i] = T(i % 50);
+    b[i] = T(1);
+  }
+  a.copy_to_device();
+  b.copy_to_device();
+
+  kernel add("add", tptr, tptr, tptr);
+  {
+    arg(2)[gid] = arg(0)[gid] + arg(1)[gid];
+  }
+
+  for (int n = 0; n <= max_n; n++) {
+    for (int i = 0; i <= max_n; i++) {
+      c[i] = T(99);
+    }
+    c.copy_to_device();
+    add(h, n, a, b, c);
+    c.copy_to_host();
+    for (int i = 0; i <= max_n; i++) {
+      T expected = (i < n ? T(a[i] + b[i]) : T(99));
+      if (c[i] != expected) {
+        std::cerr << argv0 << ": error: n = " << n << ", c[" << i
+                  << "] = " << double(c[i]) << " vs. " << double(expected)
+                  << std::endl;
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  using namespace trusimd;
+
+  // Expect one argument
+  if (argc != 2) {
+    std::cerr << argv[0] << ": error: usage: " << argv[0]
+              << " search_string\n";
+    return -1;
+  }
+
+  // Poll hardware and select hardware based on argv[1]
+  hardware &h = find_hardware(argv[1]);
+  std::cout << argv[0] << ": info: selected " << h.description << '\n';
+
+  // Sizes go past two vectors of the narrowest type on the widest ISA, so
+  // that n = 0, 1, the vector length and one past it are all covered. On
+  // OpenCL devices the tail is the scalar guard of vectorized kernels.
+  bool opencl = (h.accelerator == TRUSIMD_OPENCL);
+  for (int on = 0; on < 2; on++) {
+    set_option(h, opencl ? TRUSIMD_OPENCL_VECTORIZE : TRUSIMD_MASKED_TAIL,
+               on);
+    if (check<float>(argv[0], h, float32ptr, 130) != 0 ||
+        check<unsigned char>(argv[0], h, uint8ptr, 130) != 0) {
+      return -1;
+    }
+    std::cout << argv[0] << ": info: "
+              << (opencl ? (on ? "vectorized" : "scalar")
+                         : (on ? "masked tail" : "scalar tail"))
+              << " OK" << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,68 @@
+#include <trusimd.hpp>
+#include <iostream>
+#include <chrono>
+
+int main(int argc, char **argv) {
+  using namespace trusimd;
+
+  // Expect one argument
+  if (argc != 2) {
+    std::cerr << argv[0] << ": error: usage: " << argv[0]
+              << " search_string\n";
+    return -1;
+  }
+
+  // Poll hardware and select hardware based on argv[1]
+  hardware &h = find_hardware(argv[1]);
+  std::cerr << argv[0] << ": info: selected " << h.description << '\n';
+  set_option(h, TRUSIMD_NB_THREADS, 1);
+
+  // Create memory buffers
+  const int max_n = 4096;
+  const int nb_runs = 100;
+  buffer_pair<float> a(h, max_n), b(h, max_n), c(h, max_n);
+  for (int i = 0; i < max_n; i++) {
+    b[i] = float(i);
+    c[i] = float(i);
+  }
+  b.copy_to_device();
+  c.copy_to_device();
+
+  // Kernel
+  kernel vector_add("vector_add", float32ptr, float32ptr, float32ptr);
+  {
+    arg(0)[gid] = arg(1)[gid] + arg(2)[gid];
+  }
+
+  // Time both tail strategies, kernels are compiled on the first launch
+  std::cout << "n,scalar_tail_ns,masked_tail_ns\n";
+  for (int n = 1; n <= max_n; n++) {
+    double ns[2];
+    for (int masked = 0; masked < 2; masked++) {
+      set_option(h, TRUSIMD_MASKED_TAIL, masked);
+      vector_add(h, n, a, b, c);
+      std::chrono::steady_clock::time_point t0 =
+          std::chrono::steady_clock::now();
+      for (int r = 0; r < nb_runs; r++) {
+        vector_add(h, n, a, b, c);
+      }
+      ns[masked] = std::chrono::duration<double, std::nano>(
+                       std::chrono::steady_clock::now() - t0)
+                       .count() /
+                   nb_runs;
+    }
+    std::cout << n << ',' << ns[0] << ',' << ns[1] << '\n';
+  }
+
+  // Check result of the last launch
+  a.copy_to_host();
+  for (int i = 0; i < max_n; i++) {
+    if (a[i] != b[i] + c[i]) {
+      std::cerr << argv[0] << ": error: " << a[i] << " vs. " << (b[i] + c[i])
+                << std::endl;
+      return -1;
+    }
+  }
+
+  return 0;
+}
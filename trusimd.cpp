@@ -4,10 +4,14 @@
 #include <set>
 #include <map>
 #include <cerrno>
+#include <cstdlib>
 #include <cstring>
 #include <string>
 #include <sstream>
 #include <algorithm>
+#include <mutex>
+#include <memory>
+#include <initializer_list>
 
 #ifndef NO_EXCEPTIONS
 #include <exception>
@@ -35,6 +39,27 @@ template <typename T> static inline void print_T(std::string *buf_, T v) {
   (*buf_) += ss.str();
 }
 
+// alignment must be a power of two multiple of sizeof(void *)
+static inline void *aligned_malloc(size_t alignment, size_t n) {
+#ifdef _MSC_VER
+  return _aligned_malloc(n, alignment);
+#else
+  void *res;
+  if (posix_memalign(&res, alignment, n) != 0) {
+    return NULL;
+  }
+  return res;
+#endif
+}
+
+static inline void aligned_free(void *ptr) {
+#ifdef _MSC_VER
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
 // ----------------------------------------------------------------------------
 // type
 
@@ -65,24 +90,79 @@ static inline type remove_pointer(type t) {
   return res;
 }
 
+// ----------------------------------------------------------------------------
+// Reduction into the first element of a pointer argument, see trusimd_reduce
+
+struct reduction {
+  int op; // TRUSIMD_REDUCE_SUM, _MIN or _MAX
+  int ptr;
+  type t; // scalar element type
+};
+
+// if/else or for being recorded, see trusimd_if and trusimd_for
+struct block {
+  bool loop;
+  bool varying;  // if whose condition differs between lanes of vectors
+  bool has_else;
+  int num;       // labels of the block are numbered by it
+  int cond;      // if condition, as an LLVM IR value computed before the if
+  int var, end;  // loop counter and its bound, as LLVM IR values
+  std::string mask_vec, mask_msk; // active lanes before the block
+  unsigned spirv_else, spirv_merge, spirv_continue, spirv_header;
+};
+
 // ----------------------------------------------------------------------------
 
 struct trusimd_kernel {
   std::string name;
+  bool ended;
 
   // LLVM IR
   std::set<int> user_vars;
-  std::vector<size_t> type_pos;
-  std::string llvm_ir_vec, llvm_ir_sca;
+  int min_vector_width; // narrowest element type used in vectors, in bits
+  std::string llvm_ir_vec, llvm_ir_sca, llvm_ir_msk;
+  std::set<std::string> llvm_ir_decls;
+  size_t llvm_ir_tail_pos; // where the scalar loop begins in llvm_ir_vec
+  size_t llvm_ir_entry_pos; // where accumulators are set up in llvm_ir_vec
+  std::string llvm_ir_allocas; // of variables, moved there as well
+  size_t llvm_ir_hash;
   int ir_indentation;
 
   // CUDA/OpenCL
   std::map<int, std::string> expr;
   std::string cuda_code;
   std::string opencl_code;
+  size_t cuda_sig_pos, cuda_body_pos; // as opencl_sig_pos, opencl_body_pos
   int c_indentation;
 
+  // OpenCL with vectorN types, each work-item processes ?????????? elements
+  std::map<int, std::string> expr_vec;
+  std::string opencl_code_vec; // body, then whole source once ended
+  std::map<int, int> mask_widths; // boolean vectors are intN of this width
+  size_t opencl_sig_pos, opencl_body_pos; // in opencl_code
+  bool opencl_vec_ok; // false when the kernel cannot be vectorized
+  std::map<std::string, std::string> opencl_keys; // see opencl_get_program
+
+  // SPIR-V, one work-item per element as the OpenCL source, the module is
+  // assembled from these sections by spirv_module
+  std::vector<unsigned> spirv_decorations, spirv_types, spirv_params,
+      spirv_vars, spirv_body;
+  std::vector<unsigned> spirv_param_types, spirv_float_ops;
+  std::set<unsigned> spirv_capabilities;
+  std::map<std::string, unsigned> spirv_type_ids;
+  std::map<int, unsigned> spirv_ids; // pointers for user variables
+  unsigned spirv_bound, spirv_fn, spirv_gid;
+  unsigned spirv_opencl_std; // extended instruction set, 0 = not imported
+  bool spirv_ok; // false when the kernel uses what OpenCL SPIR-V cannot do
+  std::vector<unsigned> spirv; // see trusimd_get_spirv
+
   // Common to all
+  int precision; // floating point policy, TRUSIMD_STRICT by default
+  std::vector<reduction> reductions;
+  std::vector<block> blocks; // enclosing the current statement
+  int nb_blocks;
+  std::string ir_mask_vec; // active lanes of the vector body, "" = all
+  std::string ir_mask_msk; // active lanes of the masked tail
   std::vector<type> vars;
   std::vector<type> args;
   std::vector<int> args_vars;
@@ -92,6 +172,228 @@ struct trusimd_kernel {
 
 typedef trusimd_kernel kernel;
 
+// ----------------------------------------------------------------------------
+// Per hardware options, they are kept outside of trusimd_hardware so that
+// they survive a new call to trusimd_poll
+
+static const long option_defaults[TRUSIMD_NB_OPTIONS] = {
+    0, // TRUSIMD_NB_THREADS
+    0, // TRUSIMD_CHUNK_SIZE
+    0, // TRUSIMD_MASKED_TAIL
+    64, // TRUSIMD_ALIGNMENT
+    0,  // TRUSIMD_POOL_SLAB_SIZE
+    0,  // TRUSIMD_SVM
+    0,  // TRUSIMD_PROFILING
+    0,  // TRUSIMD_OPENCL_VECTORIZE
+    0   // TRUSIMD_OPENCL_SPIRV
+};
+
+static std::mutex options_mutex;
+static std::map<std::string, std::vector<long> > options;
+
+static inline std::string hardware_key(trusimd_hardware *h) {
+  std::string res((const char *)&h->accelerator, sizeof(h->accelerator));
+  res.append(h->id, sizeof(h->id));
+  return res;
+}
+
+static inline long get_option(trusimd_hardware *h, int option) {
+  std::lock_guard<std::mutex> lock(options_mutex);
+  std::map<std::string, std::vector<long> >::const_iterator it =
+      options.find(hardware_key(h));
+  if (it == options.end()) {
+    return option_defaults[option];
+  }
+  return it->second[size_t(option)];
+}
+
+// ----------------------------------------------------------------------------
+// Directory where backends persist compiled kernels across processes, it
+// defaults to the TRUSIMD_CACHE_DIR environment variable, empty = none
+
+static std::mutex cache_dir_mutex;
+static bool cache_dir_set = false;
+static std::string cache_dir;
+
+static inline std::string get_cache_dir() {
+  std::lock_guard<std::mutex> lock(cache_dir_mutex);
+  if (!cache_dir_set) {
+    const char *env = getenv("TRUSIMD_CACHE_DIR");
+    cache_dir = (env == NULL ? "" : env);
+    cache_dir_set = true;
+  }
+  return cache_dir;
+}
+
+// ----------------------------------------------------------------------------
+// SPIR-V binary encoding, only what kernels need
+
+enum SpvOp {
+  SpvExtInstImport = 11,
+  SpvExtInst = 12,
+  SpvMemoryModel = 14,
+  SpvEntryPoint = 15,
+  SpvExecutionMode = 16,
+  SpvCapability = 17,
+  SpvTypeVoid = 19,
+  SpvTypeBool = 20,
+  SpvTypeInt = 21,
+  SpvTypeFloat = 22,
+  SpvTypeVector = 23,
+  SpvTypePointer = 32,
+  SpvTypeFunction = 33,
+  SpvConstant = 43,
+  SpvFunction = 54,
+  SpvFunctionParameter = 55,
+  SpvFunctionEnd = 56,
+  SpvVariable = 59,
+  SpvLoad = 61,
+  SpvStore = 62,
+  SpvInBoundsPtrAccessChain = 70,
+  SpvDecorate = 71,
+  SpvCompositeExtract = 81,
+  SpvConvertFToU = 109,
+  SpvConvertFToS = 110,
+  SpvConvertSToF = 111,
+  SpvConvertUToF = 112,
+  SpvUConvert = 113,
+  SpvSConvert = 114,
+  SpvFConvert = 115,
+  SpvSatConvertSToU = 118,
+  SpvSatConvertUToS = 119,
+  SpvIAdd = 128,
+  SpvFAdd = 129,
+  SpvISub = 130,
+  SpvFSub = 131,
+  SpvIMul = 132,
+  SpvFMul = 133,
+  SpvUDiv = 134,
+  SpvSDiv = 135,
+  SpvFDiv = 136,
+  SpvUMod = 137,
+  SpvSRem = 138,
+  SpvLogicalEqual = 164,
+  SpvLogicalNotEqual = 165,
+  SpvLogicalOr = 166,
+  SpvLogicalAnd = 167,
+  SpvSelect = 169,
+  SpvIEqual = 170,
+  SpvINotEqual = 171,
+  SpvUGreaterThan = 172,
+  SpvSGreaterThan = 173,
+  SpvUGreaterThanEqual = 174,
+  SpvSGreaterThanEqual = 175,
+  SpvULessThan = 176,
+  SpvSLessThan = 177,
+  SpvULessThanEqual = 178,
+  SpvSLessThanEqual = 179,
+  SpvFOrdEqual = 180,
+  SpvFUnordNotEqual = 183,
+  SpvFOrdLessThan = 184,
+  SpvFOrdGreaterThan = 186,
+  SpvFOrdLessThanEqual = 188,
+  SpvFOrdGreaterThanEqual = 190,
+  SpvShiftRightLogical = 194,
+  SpvShiftRightArithmetic = 195,
+  SpvShiftLeftLogical = 196,
+  SpvBitwiseOr = 197,
+  SpvBitwiseXor = 198,
+  SpvBitwiseAnd = 199,
+  SpvLoopMerge = 246,
+  SpvSelectionMerge = 247,
+  SpvLabel = 248,
+  SpvBranch = 249,
+  SpvBranchConditional = 250,
+  SpvReturn = 253
+};
+
+static inline void spirv_emit(std::vector<unsigned> *buf, SpvOp op,
+                              std::initializer_list<unsigned> operands) {
+  buf->push_back(unsigned(operands.size() + 1) << 16 | unsigned(op));
+  buf->insert(buf->end(), operands.begin(), operands.end());
+}
+
+// Literal strings are nul-terminated and padded to whole little-endian words
+static inline void spirv_string(std::vector<unsigned> *buf, const char *s) {
+  size_t n = strlen(s) + 1;
+  for (size_t i = 0; i < n; i += 4) {
+    unsigned w = 0;
+    for (size_t j = 0; j < 4 && i + j < n; j++) {
+      w |= unsigned((unsigned char)s[i + j]) << (8 * j);
+    }
+    buf->push_back(w);
+  }
+}
+
+// Assemble the module, the precision policy of the kernel may have changed
+// since its operations were recorded
+static inline std::vector<unsigned> spirv_module(kernel *k) {
+  std::vector<unsigned> res;
+  unsigned bound = k->spirv_bound;
+  unsigned void_t = bound++, fn_t = bound++, entry = bound++;
+  res.push_back(0x07230203); // magic number
+  res.push_back(0x00010000); // version 1.0
+  res.push_back(0);          // generator
+  res.push_back(bound);
+  res.push_back(0);          // schema
+  for (std::set<unsigned>::const_iterator it = k->spirv_capabilities.begin();
+       it != k->spirv_capabilities.end(); ++it) {
+    spirv_emit(&res, SpvCapability, {*it});
+  }
+  if (k->spirv_opencl_std != 0) {
+    std::vector<unsigned> set;
+    spirv_string(&set, "OpenCL.std");
+    res.push_back(unsigned(set.size() + 2) << 16 |
+                  unsigned(SpvExtInstImport));
+    res.push_back(k->spirv_opencl_std);
+    res.insert(res.end(), set.begin(), set.end());
+  }
+  spirv_emit(&res, SpvMemoryModel, {2 /* Physical64 */, 2 /* OpenCL */});
+  std::vector<unsigned> name;
+  spirv_string(&name, k->name.c_str());
+  res.push_back(unsigned(name.size() + 4) << 16 | unsigned(SpvEntryPoint));
+  res.push_back(6 /* Kernel */);
+  res.push_back(k->spirv_fn);
+  res.insert(res.end(), name.begin(), name.end());
+  res.push_back(k->spirv_gid);
+  if (k->precision == TRUSIMD_STRICT) {
+    spirv_emit(&res, SpvExecutionMode, {k->spirv_fn, 31 /* ContractionOff */});
+  }
+  res.insert(res.end(), k->spirv_decorations.begin(),
+             k->spirv_decorations.end());
+  if (k->precision == TRUSIMD_FAST) {
+    for (size_t i = 0; i < k->spirv_float_ops.size(); i++) {
+      spirv_emit(&res, SpvDecorate,
+                 {k->spirv_float_ops[i], 40 /* FPFastMathMode */,
+                  0x1f /* NotNaN NotInf NSZ AllowRecip Fast */});
+    }
+  }
+  res.insert(res.end(), k->spirv_types.begin(), k->spirv_types.end());
+  spirv_emit(&res, SpvTypeVoid, {void_t});
+  res.push_back(unsigned(k->spirv_param_types.size() + 3) << 16 |
+                unsigned(SpvTypeFunction));
+  res.push_back(fn_t);
+  res.push_back(void_t);
+  res.insert(res.end(), k->spirv_param_types.begin(),
+             k->spirv_param_types.end());
+  spirv_emit(&res, SpvFunction, {void_t, k->spirv_fn, 0, fn_t});
+  res.insert(res.end(), k->spirv_params.begin(), k->spirv_params.end());
+  spirv_emit(&res, SpvLabel, {entry});
+  res.insert(res.end(), k->spirv_vars.begin(), k->spirv_vars.end());
+  res.insert(res.end(), k->spirv_body.begin(), k->spirv_body.end());
+  spirv_emit(&res, SpvFunctionEnd, {});
+  return res;
+}
+
+// ----------------------------------------------------------------------------
+// Events of asynchronous operations, backends without native events complete
+// operations before returning and leave native to NULL
+
+struct trusimd_event {
+  int accelerator;
+  void *native; // OpenCL: cl_event
+};
+
 // ----------------------------------------------------------------------------
 // Backends
 
@@ -149,7 +451,10 @@ static inline void print_irvec_type(kernel *k, std::string *buf_, type t) {
     print_irsca_type(&buf, t);
     return;
   }
-  k->type_pos.push_back(buf.size() + 1);
+  if (t.width >= 8 &&
+      (k->min_vector_width == 0 || t.width < k->min_vector_width)) {
+    k->min_vector_width = t.width;
+  }
   buf += "<?????????? x ";
   print_ir_type(&buf, t);
   buf.push_back('>');
@@ -161,6 +466,30 @@ static inline void print_irvec_type(kernel *k, std::string *buf_, type t) {
   }
 }
 
+// Print type as it appears in the name of LLVM intrinsics
+static inline void print_ir_mangled_type(std::string *buf_, type t) {
+  std::string &buf = *buf_;
+  for (int i = 0; i < t.nb_times_ptr; i++) {
+    buf += "p0";
+  }
+  if (t.scalar_vector == TRUSIMD_VECTOR) {
+    buf += "v??????????";
+  }
+  switch(t.kind) {
+  case TRUSIMD_SIGNED:
+  case TRUSIMD_UNSIGNED:
+    buf += 'i';
+    break;
+  case TRUSIMD_FLOAT:
+    buf += 'f';
+    break;
+  case TRUSIMD_BFLOAT:
+    buf += "bf";
+    break;
+  }
+  print_T(&buf, t.width);
+}
+
 // ----------------------------------------------------------------------------
 // Print CUDA/OpenCL type
 
@@ -215,10 +544,67 @@ static inline void print_opencl_type(std::string *buf_, type t) {
   print_c_type(buf_, t);
 }
 
+// Name of OpenCL types as in vectors and convert_<type> builtins
+static inline void print_opencl_base_type(std::string *buf_, type t) {
+  std::string &buf = *buf_;
+  if (t.kind == TRUSIMD_UNSIGNED) {
+    buf.push_back('u');
+  }
+  if (t.kind == TRUSIMD_FLOAT) {
+    buf += (t.width == 16 ? "half" : t.width == 32 ? "float" : "double");
+  } else if (t.width == 8) {
+    buf += "char";
+  } else if (t.width == 16) {
+    buf += "short";
+  } else if (t.width == 32) {
+    buf += "int";
+  } else if (t.width == 64) {
+    buf += "long";
+  }
+}
+
+// OpenCL has no vectors of booleans and half vectors need an extension
+static inline void print_opencl_vec_type(kernel *k, std::string *buf_,
+                                         type t) {
+  std::string &buf = *buf_;
+  if (t.scalar_vector == TRUSIMD_SCALAR) {
+    print_c_type(&buf, t);
+    return;
+  }
+  if (t.width == 1 || t.kind == TRUSIMD_BFLOAT ||
+      (t.kind == TRUSIMD_FLOAT && t.width == 16)) {
+    k->opencl_vec_ok = false;
+    return;
+  }
+  print_opencl_base_type(&buf, t);
+  buf += "??????????";
+  for (int i = 0; i < t.nb_times_ptr; i++) {
+    buf.push_back('*');
+  }
+}
+
 // ----------------------------------------------------------------------------
 // Print helper
 
-enum PrintLang { IRVec, IRSca, CU, CL };
+enum PrintLang { IRVec, IRSca, IRMsk, CU, CL, CLVec };
+
+static inline void print_var_name(PrintLang lang, kernel *k,
+                                  std::string *buf_, int var_num) {
+  std::string &buf = *buf_;
+  if (lang == IRVec ||
+      ((lang == IRSca || lang == IRMsk) &&
+       std::find(k->args_vars.begin(), k->args_vars.end(), var_num) !=
+           k->args_vars.end())) {
+    buf += "%v";
+  } else if (lang == IRSca) {
+    buf += "%s";
+  } else if (lang == IRMsk) {
+    buf += "%m";
+  } else {
+    buf.push_back('v');
+  }
+  print_T(&buf, var_num);
+}
 
 static inline void print(PrintLang lang, kernel *k, const char *fmt, ...) {
   va_list ap;
@@ -239,6 +625,10 @@ static inline void print(PrintLang lang, kernel *k, const char *fmt, ...) {
       buf_ = &k->llvm_ir_sca;
       indentation = k->ir_indentation;
       break;
+    case IRMsk:
+      buf_ = &k->llvm_ir_msk;
+      indentation = k->ir_indentation;
+      break;
     case CU:
       buf_ = &k->cuda_code;
       indentation = k->c_indentation;
@@ -247,6 +637,13 @@ static inline void print(PrintLang lang, kernel *k, const char *fmt, ...) {
       buf_ = &k->opencl_code;
       indentation = k->c_indentation;
       break;
+    case CLVec:
+      buf_ = &k->opencl_code_vec;
+      indentation = k->c_indentation + 2;
+      break;
+    default:
+      va_end(ap);
+      THROW(TRUSIMD_EINDEX);
     }
     std::string &buf = *buf_;
     for (const char *s = fmt; s[0]; s++) {
@@ -275,23 +672,14 @@ static inline void print(PrintLang lang, kernel *k, const char *fmt, ...) {
       }
       case 'V': {
         int var_num = va_arg(ap, int);
-        if (lang == IRVec ||
-            (lang == IRSca &&
-             std::find(k->args_vars.begin(), k->args_vars.end(), var_num) !=
-                 k->args_vars.end())) {
-          buf += "%v";
-        } else if (lang == IRSca) {
-          buf += "%s";
-        } else {
-          buf.push_back('v');
-        }
-        print_T(&buf, var_num);
+        print_var_name(lang, k, &buf, var_num);
         break;
       }
       case 'T': {
         type t = va_arg(ap, type);
         switch (lang) {
         case IRVec:
+        case IRMsk:
           print_irvec_type(k, &buf, t);
           break;
         case IRSca:
@@ -303,6 +691,9 @@ static inline void print(PrintLang lang, kernel *k, const char *fmt, ...) {
         case CL:
           print_opencl_type(&buf, t);
           break;
+        case CLVec:
+          print_opencl_vec_type(k, &buf, t);
+          break;
         }
         break;
       }
@@ -336,9 +727,178 @@ static inline int need_ir_var(kernel *k, int var_num) {
   int nv = pick_next_var(k, t);
   print(IRVec, k, "|V = load T, T* V\n", nv, t, t, var_num);
   print(IRSca, k, "|V = load T, T* V\n", nv, t, t, var_num);
+  print(IRMsk, k, "|V = load T, T* V\n", nv, t, t, var_num);
   return nv;
 }
 
+// ----------------------------------------------------------------------------
+// SPIR-V helpers, types are declared once and vectors are processed one
+// element per work-item as in the OpenCL source
+
+static inline unsigned spirv_new_id(kernel *k) { return k->spirv_bound++; }
+
+static inline unsigned spirv_pointer_type(kernel *k, unsigned pointee,
+                                          unsigned storage_class) {
+  std::string key("P");
+  print_T(&key, storage_class);
+  key.push_back('/');
+  print_T(&key, pointee);
+  std::map<std::string, unsigned>::const_iterator it =
+      k->spirv_type_ids.find(key);
+  if (it != k->spirv_type_ids.end()) {
+    return it->second;
+  }
+  unsigned id = spirv_new_id(k);
+  spirv_emit(&k->spirv_types, SpvTypePointer, {id, storage_class, pointee});
+  k->spirv_type_ids[key] = id;
+  return id;
+}
+
+// Integers are signless in OpenCL SPIR-V, pointers are to global memory
+static inline unsigned spirv_type(kernel *k, type t) {
+  if (t.nb_times_ptr > 0) {
+    if (t.nb_times_ptr > 1 || t.width == 1) {
+      k->spirv_ok = false;
+    }
+    type pointee = t;
+    pointee.nb_times_ptr--;
+    return spirv_pointer_type(k, spirv_type(k, pointee),
+                              5 /* CrossWorkgroup */);
+  }
+  std::string key(t.width == 1 ? "B" : t.kind == TRUSIMD_FLOAT ? "F" : "I");
+  print_T(&key, t.width);
+  std::map<std::string, unsigned>::const_iterator it =
+      k->spirv_type_ids.find(key);
+  if (it != k->spirv_type_ids.end()) {
+    return it->second;
+  }
+  unsigned id = spirv_new_id(k);
+  if (t.width == 1) {
+    spirv_emit(&k->spirv_types, SpvTypeBool, {id});
+  } else if (t.kind == TRUSIMD_FLOAT) {
+    spirv_emit(&k->spirv_types, SpvTypeFloat, {id, unsigned(t.width)});
+    if (t.width == 16) {
+      k->spirv_capabilities.insert(8 /* Float16Buffer */);
+      k->spirv_capabilities.insert(9 /* Float16 */);
+    } else if (t.width == 64) {
+      k->spirv_capabilities.insert(10 /* Float64 */);
+    }
+  } else {
+    if (t.kind == TRUSIMD_BFLOAT) {
+      k->spirv_ok = false;
+    }
+    spirv_emit(&k->spirv_types, SpvTypeInt, {id, unsigned(t.width), 0});
+    if (t.width == 8) {
+      k->spirv_capabilities.insert(39 /* Int8 */);
+    } else if (t.width == 16) {
+      k->spirv_capabilities.insert(22 /* Int16 */);
+    }
+  }
+  k->spirv_type_ids[key] = id;
+  return id;
+}
+
+// Values of user variables are loaded where they are used
+static inline unsigned spirv_value(kernel *k, int var_num) {
+  if (k->user_vars.find(var_num) == k->user_vars.end()) {
+    return k->spirv_ids[var_num];
+  }
+  unsigned id = spirv_new_id(k);
+  spirv_emit(&k->spirv_body, SpvLoad,
+             {spirv_type(k, k->vars[var_num]), id, k->spirv_ids[var_num]});
+  return id;
+}
+
+// ----------------------------------------------------------------------------
+// LLVM IR helper to declare masked loads/stores used by the vector tail,
+// returns the name of the intrinsic
+
+static inline std::string need_ir_masked_op(kernel *k, bool load,
+                                            type vec_t) {
+  type ptr_t = vec_t;
+  ptr_t.nb_times_ptr = 1;
+  std::string name(load ? "@llvm.masked.load." : "@llvm.masked.store.");
+  print_ir_mangled_type(&name, vec_t);
+  name += '.';
+  print_ir_mangled_type(&name, ptr_t);
+  std::string decl("declare ");
+  if (load) {
+    print_irvec_type(k, &decl, vec_t);
+    decl += " " + name + "(";
+    print_irvec_type(k, &decl, ptr_t);
+    decl += ", i32, <?????????? x i1>, ";
+    print_irvec_type(k, &decl, vec_t);
+  } else {
+    decl += "void " + name + "(";
+    print_irvec_type(k, &decl, vec_t);
+    decl += ", ";
+    print_irvec_type(k, &decl, ptr_t);
+    decl += ", i32, <?????????? x i1>";
+  }
+  decl += ")\n";
+  k->llvm_ir_decls.insert(decl);
+  return name;
+}
+
+// ----------------------------------------------------------------------------
+// LLVM IR helper giving the alignment of a memory access, pointer arguments
+// are aligned on the largest power of two up to TRUSIMD_ALIGNMENT that they
+// all are aligned on at launch and chunks start on a multiple of the vector
+// length, so that vector accesses at the global index of a kernel argument
+// are aligned on min(alignment, vector size). The value is only known at
+// compile time, "?align=N?" is replaced then where N is the size of the
+// element in bytes, 0 meaning the alignment itself.
+
+static inline std::string ir_alignment(kernel *k, int ptr, type t,
+                                       type vec_t) {
+  if (t == vec_t || t.width < 8 ||
+      std::find(k->args_vars.begin(), k->args_vars.end(), ptr) ==
+          k->args_vars.end()) {
+    return "1";
+  }
+  std::string res("?align=");
+  print_T(&res, t.width / 8);
+  res += '?';
+  return res;
+}
+
+// ----------------------------------------------------------------------------
+// LLVM IR helper giving the scoped alias metadata of a memory access through
+// a kernel argument: each TRUSIMD_NOALIAS argument has its own scope and no
+// access through another argument may alias it.
+
+static inline std::string ir_alias_scope(kernel *k, int arg_i) {
+  std::string res("!{!\"");
+  res += k->name + ".arg";
+  print_T(&res, arg_i);
+  res += "\", !{!\"" + k->name + "\"}}";
+  return res;
+}
+
+static inline std::string ir_alias_metadata(kernel *k, int ptr) {
+  std::vector<int>::const_iterator it =
+      std::find(k->args_vars.begin(), k->args_vars.end(), ptr);
+  if (it == k->args_vars.end()) {
+    return std::string();
+  }
+  int arg_i = int(it - k->args_vars.begin());
+  std::string res, scopes;
+  for (int i = 0; i < int(k->args.size()); i++) {
+    if (!(k->args[size_t(i)].flags & TRUSIMD_NOALIAS)) {
+      continue;
+    }
+    if (i == arg_i) {
+      res += ", !alias.scope !{" + ir_alias_scope(k, i) + "}";
+    } else {
+      scopes += (scopes.empty() ? "" : ", ") + ir_alias_scope(k, i);
+    }
+  }
+  if (!scopes.empty()) {
+    res += ", !noalias !{" + scopes + "}";
+  }
+  return res;
+}
+
 // ----------------------------------------------------------------------------
 // Helper for binary operators
 
@@ -389,74 +949,95 @@ static inline int trusimd_binop(kernel *k, BinOp bin_op, int left, int right) {
     break;
   }
 
-  // operator selection
+  // operator selection, "?fmf?" is replaced by the fast-math flags of the
+  // precision policy of the kernel when it is compiled
   const char *llvm_ir_op;
   const char *c_op;
+  SpvOp spirv_op;
   switch(bin_op) {
   case Add:
     c_op = " + ";
     if (is_int(lt)) {
       llvm_ir_op = "add";
+      spirv_op = SpvIAdd;
     } else {
-      llvm_ir_op = "fadd";
+      llvm_ir_op = "fadd?fmf?";
+      spirv_op = SpvFAdd;
     }
     break;
   case Sub:
     c_op = " - ";
     if (is_int(lt)) {
       llvm_ir_op = "sub";
+      spirv_op = SpvISub;
     } else {
-      llvm_ir_op = "fsub";
+      llvm_ir_op = "fsub?fmf?";
+      spirv_op = SpvFSub;
     }
     break;
   case Mul:
     c_op = " * ";
     if (is_int(lt)) {
       llvm_ir_op = "mul";
+      spirv_op = SpvIMul;
     } else {
-      llvm_ir_op = "fmul";
+      llvm_ir_op = "fmul?fmf?";
+      spirv_op = SpvFMul;
     }
     break;
   case Div:
     c_op = " / ";
     if (is_int(lt)) {
       llvm_ir_op = (is_signed(lt) ? "sdiv" : "udiv");
+      spirv_op = (is_signed(lt) ? SpvSDiv : SpvUDiv);
     } else {
-      llvm_ir_op = "fdiv";
+      llvm_ir_op = "fdiv?fmf?";
+      spirv_op = SpvFDiv;
     }
     break;
   case Rem:
     c_op = " % ";
     llvm_ir_op = (is_signed(lt) ? "srem" : "urem");
+    spirv_op = (is_signed(lt) ? SpvSRem : SpvUMod);
     break;
   case Xor:
     c_op = " ^ ";
     llvm_ir_op = "xor";
+    spirv_op = (is_bool(lt) ? SpvLogicalNotEqual : SpvBitwiseXor);
     break;
   case And:
     c_op = (is_bool(lt) ? " && " : " & ");
     llvm_ir_op = "and";
+    spirv_op = (is_bool(lt) ? SpvLogicalAnd : SpvBitwiseAnd);
     break;
   case AndNot:
     c_op = (is_bool(lt) ? " && " : " & ");
     llvm_ir_op = "andnot";
+    spirv_op = SpvBitwiseAnd;
+    k->spirv_ok = false;
     break;
   case Or:
     c_op = (is_bool(lt) ? " || " : " | ");
     llvm_ir_op = "or";
+    spirv_op = (is_bool(lt) ? SpvLogicalOr : SpvBitwiseOr);
     break;
   case Shl:
     c_op = " << ";
     llvm_ir_op = "shl";
+    spirv_op = SpvShiftLeftLogical;
     break;
   case Shr:
     c_op = " >> ";
     llvm_ir_op = "lshr";
+    spirv_op = SpvShiftRightLogical;
     break;
   case Shra:
     c_op = " >> ";
     llvm_ir_op = "ashr";
+    spirv_op = SpvShiftRightArithmetic;
     break;
+  default:
+    THROW(TRUSIMD_EINDEX);
   }
 
   // LLVM IR
@@ -465,13 +1046,560 @@ static inline int trusimd_binop(kernel *k, BinOp bin_op, int left, int right) {
   int nv = pick_next_var(k, lt);
   print(IRVec, k, "|V = S T V, V\n\n", nv, llvm_ir_op, lt, vl, vr);
   print(IRSca, k, "|V = S T V, V\n\n", nv, llvm_ir_op, lt, vl, vr);
+  print(IRMsk, k, "|V = S T V, V\n\n", nv, llvm_ir_op, lt, vl, vr);
 
-  // C code
+  // C code, the global index is the first lane in vectorized OpenCL
   k->expr[nv] = "(" + k->expr[left] + c_op + k->expr[right] + ")";
+  k->expr_vec[nv] =
+      "(" + k->expr_vec[left] + c_op + k->expr_vec[right] + ")";
+  if (left == k->global_index_var || right == k->global_index_var) {
+    k->opencl_vec_ok = false;
+  }
+  if (is_bool(lt) && lt.scalar_vector == TRUSIMD_VECTOR) {
+    std::map<int, int>::const_iterator il = k->mask_widths.find(left);
+    std::map<int, int>::const_iterator ir = k->mask_widths.find(right);
+    if (il != k->mask_widths.end() && ir != k->mask_widths.end() &&
+        il->second == ir->second) {
+      k->mask_widths[nv] = il->second;
+    }
+  }
+
+  // SPIR-V
+  unsigned sl = spirv_value(k, left);
+  unsigned sr = spirv_value(k, right);
+  unsigned id = spirv_new_id(k);
+  spirv_emit(&k->spirv_body, spirv_op, {spirv_type(k, lt), id, sl, sr});
+  k->spirv_ids[nv] = id;
+  if (!is_int(lt)) {
+    k->spirv_float_ops.push_back(id);
+  }
 
   return nv;
 }
 
+// ----------------------------------------------------------------------------
+// LLVM IR helper to declare an intrinsic whose operands and result have type
+// t, returns its name
+
+static inline std::string need_ir_intrinsic(kernel *k, const char *base,
+                                            type t, int nb_args,
+                                            const char *extra_args) {
+  std::string name("@llvm.");
+  name += base;
+  name.push_back('.');
+  print_ir_mangled_type(&name, t);
+  std::string decl("declare ");
+  print_irvec_type(k, &decl, t);
+  decl += " " + name + "(";
+  for (int i = 0; i < nb_args; i++) {
+    if (i > 0) {
+      decl += ", ";
+    }
+    print_irvec_type(k, &decl, t);
+  }
+  decl += extra_args;
+  decl += ")\n";
+  k->llvm_ir_decls.insert(decl);
+  return name;
+}
+
+// ----------------------------------------------------------------------------
+// Helper for operations that map to one instruction on most hardware, they
+// are LLVM intrinsics, OpenCL/CUDA builtins and OpenCL.std instructions
+
+enum IntrOp { Fma, Min, Max, Abs, Sqrt };
+
+static inline int trusimd_intrinsic(kernel *k, IntrOp intr_op, int a, int b,
+                                    int c) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    int args[3] = {a, b, c};
+    int nb_args = (intr_op == Fma ? 3 : intr_op == Min || intr_op == Max ? 2
+                                                                         : 1);
+    type t = k->vars[a];
+
+    // Type checking
+    bool is_float = (t.kind == TRUSIMD_FLOAT);
+    bool ok = !is_pointer(t);
+    for (int i = 1; i < nb_args; i++) {
+      ok = ok && k->vars[args[i]] == t;
+    }
+    switch (intr_op) {
+    case Fma:
+    case Sqrt:
+      ok = ok && is_float;
+      break;
+    case Min:
+    case Max:
+      ok = ok && (is_float || (is_int(t) && !is_bool(t)));
+      break;
+    case Abs:
+      ok = ok && (is_float || (is_signed(t) && !is_bool(t)));
+      break;
+    }
+    if (!ok) {
+      trusimd_errno = TRUSIMD_ETYPE;
+      return -1;
+    }
+
+    // Intrinsic selection, llvm.abs takes whether INT_MIN is poison
+    const char *llvm_ir_name;
+    const char *c_name;
+    unsigned spirv_inst;
+    const char *extra_decl = "";
+    const char *extra_call = "";
+    switch (intr_op) {
+    case Fma:
+      llvm_ir_name = "fma";
+      c_name = "fma";
+      spirv_inst = 26 /* fma */;
+      break;
+    case Min:
+      if (is_float) {
+        llvm_ir_name = "minnum";
+        c_name = "fmin";
+        spirv_inst = 28 /* fmin */;
+      } else {
+        llvm_ir_name = (is_signed(t) ? "smin" : "umin");
+        c_name = "min";
+        spirv_inst = (is_signed(t) ? 158 /* s_min */ : 159 /* u_min */);
+      }
+      break;
+    case Max:
+      if (is_float) {
+        llvm_ir_name = "maxnum";
+        c_name = "fmax";
+        spirv_inst = 27 /* fmax */;
+      } else {
+        llvm_ir_name = (is_signed(t) ? "smax" : "umax");
+        c_name = "max";
+        spirv_inst = (is_signed(t) ? 156 /* s_max */ : 157 /* u_max */);
+      }
+      break;
+    case Abs:
+      if (is_float) {
+        llvm_ir_name = "fabs";
+        c_name = "fabs";
+      } else {
+        llvm_ir_name = "abs";
+        c_name = "abs";
+        extra_decl = ", i1";
+        extra_call = ", i1 false";
+      }
+      spirv_inst = (is_float ? 23 /* fabs */ : 141 /* s_abs */);
+      break;
+    case Sqrt:
+      llvm_ir_name = "sqrt";
+      c_name = "sqrt";
+      spirv_inst = 61 /* sqrt */;
+      break;
+    default:
+      trusimd_errno = TRUSIMD_EINDEX;
+      return -1;
+    }
+
+    // LLVM IR, the scalar body calls the scalar version
+    int v[3];
+    for (int i = 0; i < nb_args; i++) {
+      v[i] = need_ir_var(k, args[i]);
+    }
+    int nv = pick_next_var(k, t);
+    type sca_t = t;
+    sca_t.scalar_vector = TRUSIMD_SCALAR;
+    std::string vec_name(
+        need_ir_intrinsic(k, llvm_ir_name, t, nb_args, extra_decl));
+    std::string sca_name(
+        need_ir_intrinsic(k, llvm_ir_name, sca_t, nb_args, extra_decl));
+    const PrintLang langs[3] = {IRVec, IRSca, IRMsk};
+    for (int l = 0; l < 3; l++) {
+      print(langs[l], k, "|V = callS T S(", nv, (is_float ? "?fmf?" : ""), t,
+            (langs[l] == IRSca ? sca_name : vec_name).c_str());
+      for (int i = 0; i < nb_args; i++) {
+        print(langs[l], k, "ST V", (i > 0 ? ", " : ""), t, v[i]);
+      }
+      print(langs[l], k, "S)\n\n", extra_call);
+    }
+
+    // C code, OpenCL abs on integers returns unsigned integers
+    std::string operands, operands_vec;
+    for (int i = 0; i < nb_args; i++) {
+      operands += (i > 0 ? ", " : "") + k->expr[args[i]];
+      operands_vec += (i > 0 ? ", " : "") + k->expr_vec[args[i]];
+      if (args[i] == k->global_index_var) {
+        k->opencl_vec_ok = false;
+      }
+    }
+    k->expr[nv] = std::string(c_name) + "(" + operands + ")";
+    k->expr_vec[nv] = std::string(c_name) + "(" + operands_vec + ")";
+    if (intr_op == Abs && !is_float) {
+      std::string cast;
+      print_c_type(&cast, t);
+      k->expr[nv] = "((" + cast + ")" + k->expr[nv] + ")";
+      if (t.scalar_vector == TRUSIMD_VECTOR) {
+        cast = "as_";
+        print_opencl_vec_type(k, &cast, t);
+        k->expr_vec[nv] = cast + "(" + k->expr_vec[nv] + ")";
+      } else {
+        k->expr_vec[nv] = k->expr[nv];
+      }
+    }
+
+    // SPIR-V
+    if (k->spirv_opencl_std == 0) {
+      k->spirv_opencl_std = spirv_new_id(k);
+    }
+    unsigned ids[3];
+    for (int i = 0; i < nb_args; i++) {
+      ids[i] = spirv_value(k, args[i]);
+    }
+    k->spirv_ids[nv] = spirv_new_id(k);
+    k->spirv_body.push_back(unsigned(5 + nb_args) << 16 |
+                            unsigned(SpvExtInst));
+    k->spirv_body.push_back(spirv_type(k, t));
+    k->spirv_body.push_back(k->spirv_ids[nv]);
+    k->spirv_body.push_back(k->spirv_opencl_std);
+    k->spirv_body.push_back(spirv_inst);
+    k->spirv_body.insert(k->spirv_body.end(), ids, ids + nb_args);
+
+    return nv;
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Reduction helpers. On LLVM each call of the kernel function accumulates
+// into a vector (whole vectors and masked tail) and a scalar (scalar tail),
+// reduces both at the end and combines the result into memory with a
+// compare-and-swap loop as chunks run concurrently. On OpenCL/CUDA each
+// work-item accumulates into a private variable, work-groups combine those in
+// local memory and write one partial result each, then a second kernel with
+// the same arguments and one work-group combines the partials into memory.
+
+// Value that leaves others unchanged, in LLVM IR
+static inline std::string ir_reduce_identity(int op, type t) {
+  if (t.kind == TRUSIMD_FLOAT) {
+    return op == TRUSIMD_REDUCE_SUM   ? "-0.0"
+           : op == TRUSIMD_REDUCE_MIN ? "0x7FF0000000000000"
+                                      : "0xFFF0000000000000";
+  }
+  if (op == TRUSIMD_REDUCE_SUM || (op == TRUSIMD_REDUCE_MAX && !is_signed(t))) {
+    return "0";
+  }
+  if (!is_signed(t)) {
+    return "-1";
+  }
+  unsigned long long max = (1ULL << (t.width - 1)) - 1;
+  std::string res(op == TRUSIMD_REDUCE_MIN ? "" : "-");
+  print_T(&res, op == TRUSIMD_REDUCE_MIN ? max : max + 1);
+  return res;
+}
+
+// Prints dst = op(a, b), min and max do not take fast-math flags as no
+// infinity flags would make their identity poison
+static inline void print_ir_reduce_op(PrintLang lang, kernel *k, int op,
+                                      type t, std::string const &dst,
+                                      std::string const &a,
+                                      std::string const &b) {
+  std::string ty;
+  print_irvec_type(k, &ty, t);
+  if (op == TRUSIMD_REDUCE_SUM) {
+    print(lang, k, "|S = S S S, S\n", dst.c_str(),
+          (is_int(t) ? "add" : "fadd?fmf?"), ty.c_str(), a.c_str(),
+          b.c_str());
+    return;
+  }
+  const char *base;
+  if (t.kind == TRUSIMD_FLOAT) {
+    base = (op == TRUSIMD_REDUCE_MIN ? "minnum" : "maxnum");
+  } else if (is_signed(t)) {
+    base = (op == TRUSIMD_REDUCE_MIN ? "smin" : "smax");
+  } else {
+    base = (op == TRUSIMD_REDUCE_MIN ? "umin" : "umax");
+  }
+  std::string f(need_ir_intrinsic(k, base, t, 2, ""));
+  print(lang, k, "|S = call S S(S S, S S)\n", dst.c_str(), ty.c_str(),
+        f.c_str(), ty.c_str(), a.c_str(), ty.c_str(), b.c_str());
+}
+
+// Accumulators are set up before the loops
+static inline void print_ir_reductions_entry(kernel *k) {
+  for (size_t i = 0; i < k->reductions.size(); i++) {
+    reduction const &r = k->reductions[i];
+    type vec_t = r.t;
+    vec_t.scalar_vector = TRUSIMD_VECTOR;
+    std::string vty, ty, id(ir_reduce_identity(r.op, r.t));
+    print_irvec_type(k, &vty, vec_t);
+    print_irsca_type(&ty, r.t);
+    print(IRVec, k,
+          "  %redD_ins = insertelement S undef, S S, i32 0\n"
+          "  %redD_splat = shufflevector S %redD_ins, S undef,\n"
+          "                             <?????????? x i32> "
+          "zeroinitializer\n"
+          "  %redD_vec = alloca S\n"
+          "  %redD_sca = alloca S\n"
+          "  store S %redD_splat, S* %redD_vec\n"
+          "  store S S, S* %redD_sca\n\n",
+          int(i), vty.c_str(), ty.c_str(), id.c_str(), int(i), vty.c_str(),
+          int(i), vty.c_str(), int(i), vty.c_str(), int(i), ty.c_str(),
+          vty.c_str(), int(i), vty.c_str(), int(i), ty.c_str(), id.c_str(),
+          ty.c_str(), int(i));
+  }
+}
+
+// Accumulators are reduced and combined into memory after the loops
+static inline void print_ir_reductions_exit(PrintLang lang, kernel *k) {
+  for (size_t i = 0; i < k->reductions.size(); i++) {
+    reduction const &r = k->reductions[i];
+    type vec_t = r.t;
+    vec_t.scalar_vector = TRUSIMD_VECTOR;
+    std::string vty, ty, mangled;
+    print_irvec_type(k, &vty, vec_t);
+    print_irsca_type(&ty, r.t);
+    print_ir_mangled_type(&mangled, vec_t);
+    print(lang, k,
+          "  %redD_v = load S, S* %redD_vec\n"
+          "  %redD_s = load S, S* %redD_sca\n",
+          int(i), vty.c_str(), vty.c_str(), int(i), int(i), ty.c_str(),
+          ty.c_str(), int(i));
+    std::string name("@llvm.vector.reduce.");
+    std::string decl("declare " + ty + " ");
+    std::string red("%red"), s("%red"), h("%red");
+    print_T(&red, int(i));
+    print_T(&s, int(i));
+    print_T(&h, int(i));
+    red += "_r";
+    s += "_s";
+    h += "_h";
+    if (r.op == TRUSIMD_REDUCE_SUM && r.t.kind == TRUSIMD_FLOAT) {
+      // the start value is the scalar accumulator, in order unless the
+      // fast-math flags allow reassociation
+      name += "fadd." + mangled;
+      k->llvm_ir_decls.insert(decl + name + "(" + ty + ", " + vty + ")\n");
+      print(lang, k, "  S = call?fmf? S S(S S, S %redD_v)\n", red.c_str(),
+            ty.c_str(), name.c_str(), ty.c_str(), s.c_str(), vty.c_str(),
+            int(i));
+    } else {
+      if (r.op == TRUSIMD_REDUCE_SUM) {
+        name += "add.";
+      } else if (r.t.kind == TRUSIMD_FLOAT) {
+        name += (r.op == TRUSIMD_REDUCE_MIN ? "fmin." : "fmax.");
+      } else if (is_signed(r.t)) {
+        name += (r.op == TRUSIMD_REDUCE_MIN ? "smin." : "smax.");
+      } else {
+        name += (r.op == TRUSIMD_REDUCE_MIN ? "umin." : "umax.");
+      }
+      name += mangled;
+      k->llvm_ir_decls.insert(decl + name + "(" + vty + ")\n");
+      print(lang, k, "  S = call S S(S %redD_v)\n", h.c_str(), ty.c_str(),
+            name.c_str(), vty.c_str(), int(i));
+      print_ir_reduce_op(lang, k, r.op, r.t, red, s, h);
+    }
+
+    // Other chunks may update the same memory concurrently
+    std::string ity("i");
+    print_T(&ity, r.t.width);
+    std::string o("%red"), n("%red");
+    print_T(&o, int(i));
+    print_T(&n, int(i));
+    o += "_o";
+    n += "_n";
+    print(lang, k,
+          "  %redD_p = bitcast S* V to S*\n"
+          "  br label %redD_cas\n\n"
+          "redD_cas:\n\n"
+          "  %redD_old = load atomic S, S* %redD_p monotonic, align D\n"
+          "  S = bitcast S %redD_old to S\n",
+          int(i), ty.c_str(), r.ptr, ity.c_str(), int(i), int(i),
+          int(i), ity.c_str(), ity.c_str(), int(i), r.t.width / 8,
+          o.c_str(), ity.c_str(), int(i), ty.c_str());
+    print_ir_reduce_op(lang, k, r.op, r.t, n, o, red);
+    print(lang, k,
+          "  %redD_new = bitcast S S to S\n"
+          "  %redD_x = cmpxchg S* %redD_p, S %redD_old, S %redD_new "
+          "seq_cst seq_cst\n"
+          "  %redD_ok = extractvalue { S, i1 } %redD_x, 1\n"
+          "  br i1 %redD_ok, label %redD_done, label %redD_cas\n\n"
+          "redD_done:\n\n",
+          int(i), ty.c_str(), n.c_str(), ity.c_str(), int(i), ity.c_str(),
+          int(i), ity.c_str(), int(i), ity.c_str(), int(i), int(i),
+          ity.c_str(), int(i), int(i), int(i), int(i), int(i));
+  }
+}
+
+// Value that leaves others unchanged, in OpenCL C or CUDA
+static inline std::string c_reduce_identity(PrintLang lang, int op, type t) {
+  std::string ty;
+  print_c_type(&ty, t);
+  if (op == TRUSIMD_REDUCE_SUM) {
+    return "((" + ty + ")0)";
+  }
+  if (t.kind == TRUSIMD_FLOAT) {
+    std::string inf("INFINITY");
+    if (lang == CU) {
+      inf = (t.width == 64 ? "__longlong_as_double(0x7ff0000000000000LL)"
+                           : "__int_as_float(0x7f800000)");
+    }
+    return "((" + ty + ")(" + (op == TRUSIMD_REDUCE_MIN ? "" : "-") + inf +
+           "))";
+  }
+  type ut = t;
+  ut.kind = TRUSIMD_UNSIGNED;
+  std::string all_ones("((");
+  print_c_type(&all_ones, ut);
+  all_ones += ")-1)";
+  if (!is_signed(t)) {
+    return "((" + ty + ")" + (op == TRUSIMD_REDUCE_MIN ? all_ones : "0") +
+           ")";
+  }
+  std::string max("((" + ty + ")(" + all_ones + " >> 1))");
+  if (op == TRUSIMD_REDUCE_MIN) {
+    return max;
+  }
+  return "((" + ty + ")(-" + max + " - 1))";
+}
+
+static inline std::string c_reduce_op(int op, type t, std::string const &a,
+                                      std::string const &b) {
+  if (op == TRUSIMD_REDUCE_SUM) {
+    return "(" + a + " + " + b + ")";
+  }
+  std::string f(t.kind == TRUSIMD_FLOAT ? "f" : "");
+  f += (op == TRUSIMD_REDUCE_MIN ? "min" : "max");
+  return f + "(" + a + ", " + b + ")";
+}
+
+// Appends src from the given position, non-empty lines being indented more
+static inline void append_indented(std::string *dst, std::string const &src,
+                                   size_t from, const char *indentation) {
+  for (size_t i = from; i < src.size();) {
+    size_t eol = std::min(src.find('\n', i), src.size() - 1);
+    if (eol > i) {
+      *dst += indentation;
+    }
+    dst->append(src, i, eol + 1 - i);
+    i = eol + 1;
+  }
+}
+
+// Turns the CUDA or OpenCL code of a kernel with reductions into the two
+// kernels, there is no early return as all work-items reach the barriers
+static inline void print_c_reductions(PrintLang lang, kernel *k,
+                                      size_t sig_pos, size_t body_pos) {
+  std::string &code = (lang == CU ? k->cuda_code : k->opencl_code);
+  std::string sig(code, 0, sig_pos), body;
+  append_indented(&body, code, body_pos, "  ");
+  code.clear();
+  size_t paren = sig.find('(');
+  const char *barrier =
+      (lang == CL ? "barrier(CLK_LOCAL_MEM_FENCE)" : "__syncthreads()");
+  for (int pass = 0; pass < 2; pass++) {
+    print(lang, k, "SSS", sig.substr(0, paren).c_str(),
+          (pass == 0 ? "" : "_reduce"), sig.substr(paren).c_str());
+    for (size_t i = 0; i < k->reductions.size(); i++) {
+      type t = k->reductions[i].t;
+      if (lang == CL) {
+        print(lang, k, ", __global T *red_partialD, __local T *red_localD",
+              t, int(i), t, int(i));
+      } else {
+        print(lang, k, ", T *red_partialD", t, int(i));
+      }
+    }
+    if (lang == CL) {
+      print(lang, k,
+            ") {\n\n"
+            "  int red_lid = (int)get_local_id(0);\n"
+            "  int red_lsz = (int)get_local_size(0);\n");
+    } else {
+      print(lang, k,
+            ") {\n\n"
+            "  int red_lid = (int)threadIdx.x;\n"
+            "  int red_lsz = (int)block\\Dim.x;\n"
+            "  extern __shared__ long long red_shared[];\n");
+    }
+    for (size_t i = 0; i < k->reductions.size(); i++) {
+      reduction const &r = k->reductions[i];
+      if (lang == CU) {
+        print(lang, k, "  T *red_localD = (T *)(red_shared + D * red_lsz);\n",
+              r.t, int(i), r.t, int(i));
+      }
+      print(lang, k, "  T redD = S;\n", r.t, int(i),
+            c_reduce_identity(lang, r.op, r.t).c_str());
+    }
+
+    // Each work-item accumulates elements, or partials in the second pass
+    if (pass == 0) {
+      if (lang == CL) {
+        print(lang, k, "  int V = (int)get_global_id(0);\n",
+              k->global_index_var);
+      } else {
+        print(lang, k,
+              "  int V = (int)(block\\Dim.x * blockIdx.x + threadIdx.x);\n",
+              k->global_index_var);
+      }
+      print(lang, k, "  if (V < size) {\nS  }\n", k->global_index_var,
+            body.c_str());
+    } else {
+      print(lang, k,
+            "  for (int red_i = red_lid; red_i < size; red_i += red_lsz) {\n");
+      for (size_t i = 0; i < k->reductions.size(); i++) {
+        reduction const &r = k->reductions[i];
+        std::string red("red");
+        print_T(&red, int(i));
+        std::string partial("red_partial");
+        print_T(&partial, int(i));
+        print(lang, k, "    S = S;\n", red.c_str(),
+              c_reduce_op(r.op, r.t, red, partial + "[red_i]").c_str());
+      }
+      print(lang, k, "  }\n");
+    }
+
+    // Tree reduction in local memory, works for any work-group size
+    for (size_t i = 0; i < k->reductions.size(); i++) {
+      print(lang, k, "  red_localD[red_lid] = redD;\n", int(i), int(i));
+    }
+    print(lang, k,
+          "  S;\n"
+          "  for (int red_s = 1; red_s < red_lsz; red_s *= 2) {\n"
+          "    if (red_lid % (2 * red_s) == 0 &&\n"
+          "        red_lid + red_s < red_lsz) {\n",
+          barrier);
+    for (size_t i = 0; i < k->reductions.size(); i++) {
+      reduction const &r = k->reductions[i];
+      std::string local("red_local");
+      print_T(&local, int(i));
+      print(lang, k, "      S[red_lid] = S;\n", local.c_str(),
+            c_reduce_op(r.op, r.t, local + "[red_lid]",
+                        local + "[red_lid + red_s]")
+                .c_str());
+    }
+    print(lang, k,
+          "    }\n"
+          "    S;\n"
+          "  }\n"
+          "  if (red_lid == 0) {\n",
+          barrier);
+    for (size_t i = 0; i < k->reductions.size(); i++) {
+      reduction const &r = k->reductions[i];
+      if (pass == 0) {
+        print(lang, k, "    red_partialD[S] = red_localD[0];\n", int(i),
+              (lang == CL ? "get_group_id(0)" : "blockIdx.x"), int(i));
+      } else {
+        std::string local("red_local");
+        print_T(&local, int(i));
+        std::string dst(k->expr[r.ptr] + "[0]");
+        print(lang, k, "    S = S;\n", dst.c_str(),
+              c_reduce_op(r.op, r.t, dst, local + "[0]").c_str());
+      }
+    }
+    print(lang, k, "  }\n}\nS", (pass == 0 ? "\n" : ""));
+  }
+}
+
 // ============================================================================
 //
 // FROM HERE ONLY EXPORTED FUNCTION
@@ -516,9 +1644,31 @@ kernel *trusimd_create_kernel_ap(const char *name, va_list ap) {
     res = new kernel;
     res->name = std::string(name);
     res->next_var = -1;
+    res->ended = false;
+    res->llvm_ir_tail_pos = 0;
+    res->llvm_ir_hash = 0;
+    res->min_vector_width = 0;
     res->c_indentation = 0;
     res->ir_indentation = 0;
-    print(IRVec, res, "define void @S(i64 %size, i8* %args) {\n\n", name);
+    res->opencl_vec_ok = true;
+    res->precision = TRUSIMD_STRICT;
+    res->nb_blocks = 0;
+    res->ir_mask_msk = "%tail_mask";
+    res->spirv_bound = 1;
+    res->spirv_ok = true;
+    res->spirv_fn = spirv_new_id(res);
+    res->spirv_opencl_std = 0;
+    res->spirv_capabilities.insert(4 /* Addresses */);
+    res->spirv_capabilities.insert(6 /* Kernel */);
+    res->spirv_capabilities.insert(11 /* Int64 */);
+    unsigned spirv_int_t =
+        spirv_type(res, {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 32, 0, 0});
+    unsigned spirv_size = spirv_new_id(res);
+    res->spirv_param_types.push_back(spirv_int_t);
+    spirv_emit(&res->spirv_params, SpvFunctionParameter,
+               {spirv_int_t, spirv_size});
+    print(IRVec, res, "define void @S(i64 %begin, i64 %end, i8* %args) {\n\n",
+          name);
     res->ir_indentation = 2;
     print(CU, res, "__kernel__ void S(int size", name);
     print(CL, res, "__kernel void S(int size", name);
@@ -529,45 +1679,77 @@ kernel *trusimd_create_kernel_ap(const char *name, va_list ap) {
       }
       res->args.push_back(t);
       int argptr_i8 =
-          pick_next_var(res, {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 8, 0});
+          pick_next_var(res, {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 8, 0, 0});
       int argptr_T = pick_next_var(res, t);
       int nv = pick_next_var(res, t);
       res->expr[nv] = "v";
       res->args_vars.push_back(nv);
       print_T(&(res->expr[nv]), nv);
+      res->expr_vec[nv] = res->expr[nv];
       print(IRVec, res,
             "|V = getelementptr inbounds i8, i8* %args, i64 D\n"
             "|V = bitcast i8* V to T*\n"
-            "|V = load T, T* V\n\n",
-            argptr_i8, 8 * arg_i, argptr_T, argptr_i8, t, nv, t, t, argptr_T);
-      print(CU, res, ", T V", t, nv);
-      print(CL, res, ", __global T V", t, nv);
+            "|V = load T, T* VS\n\n",
+            argptr_i8, 8 * arg_i, argptr_T, argptr_i8, t, nv, t, t, argptr_T,
+            (is_pointer(t) ? ", !align !{i64 ?align=0?}" : ""));
+      bool restrict_ = (is_pointer(t) && (t.flags & TRUSIMD_NOALIAS));
+      print(CU, res, ", T SV", t, (restrict_ ? "__restrict__ " : ""), nv);
+      print(CL, res, ", __global T SV", t, (restrict_ ? "restrict " : ""), nv);
+      unsigned spirv_arg_t = spirv_type(res, t);
+      res->spirv_ids[nv] = spirv_new_id(res);
+      res->spirv_param_types.push_back(spirv_arg_t);
+      spirv_emit(&res->spirv_params, SpvFunctionParameter,
+                 {spirv_arg_t, res->spirv_ids[nv]});
+      if (restrict_) {
+        spirv_emit(&res->spirv_decorations, SpvDecorate,
+                   {res->spirv_ids[nv], 38 /* FuncParamAttr */,
+                    4 /* NoAlias */});
+      }
     }
-    int gid_var = pick_next_var(res, {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 64, 0});
+    int gid_var =
+        pick_next_var(res, {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 64, 0, 0});
     res->expr[gid_var] = "v";
     print_T(&(res->expr[gid_var]), gid_var);
+    res->expr_vec[gid_var] = res->expr[gid_var];
     res->global_index_var = gid_var;
+    res->llvm_ir_entry_pos = res->llvm_ir_vec.size();
     print(IRVec, res,
           "  %global_index_ptr = alloca i64\n"
-          "  store i64 0, i64* %global_index_ptr\n"
+          "  store i64 %begin, i64* %global_index_ptr\n"
           "  br label %for_vec_cond\n\n"
           "for_vec_cond:\n\n"
           "  V = load i64, i64* %global_index_ptr\n"
           "  %ipn = add i64 V, ??????????\n"
-          "  %b_vec = icmp sgt i64 %ipn, %size\n"
-          "  br i1 %b_vec, label %for_sca_cond, label %for_vec_body\n\n"
+          "  %b_vec = icmp sgt i64 %ipn, %end\n"
+          "  br i1 %b_vec, label %for_tail, label %for_vec_body\n\n"
           "for_vec_body:\n\n",
           gid_var, gid_var);
     print(IRSca, res,
           "\n"
+          "for_tail:\n\n"
+          "  br label %for_sca_cond\n\n"
           "for_sca_cond:\n\n"
           "  V = load i64, i64* %global_index_ptr\n"
-          "  %b_sca = icmp sge i64 V, %size\n"
+          "  %b_sca = icmp sge i64 V, %end\n"
           "  br i1 %b_sca, label %for_sca_exit, label %for_sca_body\n\n"
           "for_sca_body:\n\n",
           gid_var, gid_var);
-    // convenient but not optimized
-    res->type_pos.push_back(res->llvm_ir_vec.find("??????????"));
+    // the tail can also be one vector iteration under a mask
+    std::string decl("declare <?????????? x i1> "
+                     "@llvm.get.active.lane.mask.v??????????i1.i64(i64, "
+                     "i64)\n");
+    res->llvm_ir_decls.insert(decl);
+    print(IRMsk, res,
+          "\n"
+          "for_tail:\n\n"
+          "  V = load i64, i64* %global_index_ptr\n"
+          "  %b_msk = icmp sge i64 V, %end\n"
+          "  br i1 %b_msk, label %for_msk_exit, label %for_msk_body\n\n"
+          "for_msk_body:\n\n"
+          "  %tail_mask = call <?????????? x i1> "
+          "@llvm.get.active.lane.mask.v??????????i1.i64(i64 V, i64 %end)\n\n",
+          gid_var, gid_var, gid_var);
+    res->cuda_sig_pos = res->cuda_code.size();
     print(CU, res,
           ") {\n\n"
           "  int V = (int)(block\\Dim.x * blockIdx.x + threadIdx.x);\n"
@@ -575,6 +1757,8 @@ kernel *trusimd_create_kernel_ap(const char *name, va_list ap) {
           "    return;\n"
           "  }\n\n",
           gid_var, gid_var);
+    res->cuda_body_pos = res->cuda_code.size();
+    res->opencl_sig_pos = res->opencl_code.size();
     print(CL, res,
           ") {\n\n"
           "  int V = (int)get_global_id(0);\n"
@@ -582,6 +1766,44 @@ kernel *trusimd_create_kernel_ap(const char *name, va_list ap) {
           "    return;\n"
           "  }\n\n",
           res->global_index_var, res->global_index_var);
+    res->opencl_body_pos = res->opencl_code.size();
+
+    // SPIR-V: the global index is the first component of a builtin vector
+    unsigned spirv_long_t =
+        spirv_type(res, {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 64, 0, 0});
+    unsigned spirv_bool_t =
+        spirv_type(res, {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 1, 0, 0});
+    unsigned spirv_v3_t = spirv_new_id(res);
+    spirv_emit(&res->spirv_types, SpvTypeVector,
+               {spirv_v3_t, spirv_long_t, 3});
+    unsigned spirv_gid_ptr_t =
+        spirv_pointer_type(res, spirv_v3_t, 1 /* Input */);
+    res->spirv_gid = spirv_new_id(res);
+    spirv_emit(&res->spirv_types, SpvVariable,
+               {spirv_gid_ptr_t, res->spirv_gid, 1 /* Input */});
+    spirv_emit(&res->spirv_decorations, SpvDecorate,
+               {res->spirv_gid, 11 /* BuiltIn */,
+                28 /* GlobalInvocationId */});
+    unsigned spirv_v3 = spirv_new_id(res);
+    unsigned spirv_gid_value = spirv_new_id(res);
+    unsigned spirv_size_long = spirv_new_id(res);
+    unsigned spirv_past = spirv_new_id(res);
+    unsigned spirv_return = spirv_new_id(res);
+    unsigned spirv_body = spirv_new_id(res);
+    spirv_emit(&res->spirv_body, SpvLoad,
+               {spirv_v3_t, spirv_v3, res->spirv_gid});
+    spirv_emit(&res->spirv_body, SpvCompositeExtract,
+               {spirv_long_t, spirv_gid_value, spirv_v3, 0});
+    spirv_emit(&res->spirv_body, SpvSConvert,
+               {spirv_long_t, spirv_size_long, spirv_size});
+    spirv_emit(&res->spirv_body, SpvSGreaterThanEqual,
+               {spirv_bool_t, spirv_past, spirv_gid_value, spirv_size_long});
+    spirv_emit(&res->spirv_body, SpvBranchConditional,
+               {spirv_past, spirv_return, spirv_body});
+    spirv_emit(&res->spirv_body, SpvLabel, {spirv_return});
+    spirv_emit(&res->spirv_body, SpvReturn, {});
+    spirv_emit(&res->spirv_body, SpvLabel, {spirv_body});
+    res->spirv_ids[gid_var] = spirv_gid_value;
     res->ir_indentation = 2;
     res->c_indentation = 2;
 #ifndef NO_EXCEPTIONS
@@ -602,22 +1824,79 @@ kernel *trusimd_create_kernel(const char *name, ...) {
 }
 
 void trusimd_end_kernel(kernel *k) {
+  // Kernels may be ended several times by wrappers (prepare, run...)
+  if (k->ended) {
+    return;
+  }
+  while (!k->blocks.empty()) { // blocks left open end with the kernel
+    if (k->blocks.back().loop) {
+      trusimd_end_for(k);
+    } else {
+      trusimd_end_if(k);
+    }
+  }
+  k->ended = true;
   k->c_indentation = 0;
-  k->ir_indentation = 0;
+  std::string loops(k->llvm_ir_vec, k->llvm_ir_entry_pos);
+  k->llvm_ir_vec.resize(k->llvm_ir_entry_pos);
+  k->llvm_ir_vec += k->llvm_ir_allocas;
+  print_ir_reductions_entry(k);
+  k->llvm_ir_vec += loops;
   print(IRSca, k,
         "  %ip1 = add nsw i64 V, 1\n"
         "  store i64 %ip1, i64* %global_index_ptr\n"
         "  br label %for_sca_cond\n\n"
-        "for_sca_exit:\n\n"
-        "  ret void\n\n",
+        "for_sca_exit:\n\n",
         k->global_index_var);
+  print_ir_reductions_exit(IRSca, k);
+  print(IRSca, k, "  ret void\n\n");
+  print(IRMsk, k,
+        "  br label %for_msk_exit\n\n"
+        "for_msk_exit:\n\n");
+  print_ir_reductions_exit(IRMsk, k);
+  print(IRMsk, k, "  ret void\n\n");
+  k->ir_indentation = 0;
   print(IRVec, k,
         "  store i64 %ipn, i64* %global_index_ptr\n"
-        "  br label %for_vec_cond\n\n"
-        "S"
-        "}\n",
-        k->llvm_ir_sca.c_str());
+        "  br label %for_vec_cond\n\n");
+  k->llvm_ir_tail_pos = k->llvm_ir_vec.size();
+  k->llvm_ir_hash = std::hash<std::string>()(k->llvm_ir_vec);
+  print(IRVec, k, "S}\n", k->llvm_ir_sca.c_str());
+  for (std::set<std::string>::const_iterator it = k->llvm_ir_decls.begin();
+       it != k->llvm_ir_decls.end(); ++it) {
+    k->llvm_ir_vec += "\n" + *it;
+  }
+  spirv_emit(&k->spirv_body, SpvReturn, {});
+
+  // Kernels with reductions are neither vectorized nor SPIR-V on OpenCL
+  if (!k->reductions.empty()) {
+    print_c_reductions(CU, k, k->cuda_sig_pos, k->cuda_body_pos);
+    print_c_reductions(CL, k, k->opencl_sig_pos, k->opencl_body_pos);
+    return;
+  }
   print(CU, k, "}\n");
+
+  // Vectorized OpenCL: whole vectors first, then the scalar body for the
+  // tail, the backend replaces ?????????? by the number of lanes
+  std::string body_vec;
+  body_vec.swap(k->opencl_code_vec);
+  std::string sig(k->opencl_code, 0, k->opencl_sig_pos);
+  print(CLVec, k,
+        "S) {\n\n"
+        "  int V = (int)get_global_id(0) * ??????????;\n"
+        "  if (V >= size) {\n"
+        "    return;\n"
+        "  }\n"
+        "  if (V + ?????????? <= size) {\n"
+        "S"
+        "  } else {\n"
+        "    for (; V < size; V++) {\n",
+        sig.c_str(), k->global_index_var, k->global_index_var,
+        k->global_index_var, body_vec.c_str(), k->global_index_var,
+        k->global_index_var);
+  append_indented(&k->opencl_code_vec, k->opencl_code, k->opencl_body_pos,
+                  "    ");
+  print(CLVec, k, "    }\n  }\n}\n");
   print(CL, k, "}\n");
 }
 
@@ -636,6 +1915,12 @@ const char *trusimd_get_cuda(kernel *k) { return k->cuda_code.c_str(); }
 const char *trusimd_get_opencl(kernel *k) { return k->opencl_code.c_str(); }
 const char *trusimd_get_llvmir(kernel *k) { return k->llvm_ir_vec.c_str(); }
 
+const unsigned *trusimd_get_spirv(kernel *k, size_t *nb_words) {
+  k->spirv = spirv_module(k);
+  *nb_words = k->spirv.size();
+  return &k->spirv[0];
+}
+
 // ----------------------------------------------------------------------------
 // Get error message
 
@@ -670,57 +1955,188 @@ int trusimd_add(kernel *k, int left, int right) {
 }
 
 // ----------------------------------------------------------------------------
-// Variable creation
+// Intrinsics
 
-int trusimd_var(kernel *k, type t) {
+int trusimd_fma(kernel *k, int a, int b, int c) {
+  return trusimd_intrinsic(k, Fma, a, b, c);
+}
+
+int trusimd_min(kernel *k, int a, int b) {
+  return trusimd_intrinsic(k, Min, a, b, -1);
+}
+
+int trusimd_max(kernel *k, int a, int b) {
+  return trusimd_intrinsic(k, Max, a, b, -1);
+}
+
+int trusimd_abs(kernel *k, int a) {
+  return trusimd_intrinsic(k, Abs, a, -1, -1);
+}
+
+int trusimd_sqrt(kernel *k, int a) {
+  return trusimd_intrinsic(k, Sqrt, a, -1, -1);
+}
+
+// ----------------------------------------------------------------------------
+// Comparisons and selection, they produce and consume booleans which are
+// <N x i1> masks in vector LLVM IR and bool in CUDA/OpenCL
+
+int trusimd_cmp(kernel *k, int op, int a, int b) {
 #ifndef NO_EXCEPTIONS
   try {
 #endif
-    int nv = pick_next_var(k, t);
-    k->user_vars.insert(nv);
+    // Type checking, booleans only compare for (in)equality
+    if (op < TRUSIMD_CMP_EQ || op > TRUSIMD_CMP_GE) {
+      trusimd_errno = TRUSIMD_EINDEX;
+      return -1;
+    }
+    type t = k->vars[a];
+    if (is_pointer(t) || k->vars[b] != t ||
+        (is_bool(t) && op != TRUSIMD_CMP_EQ && op != TRUSIMD_CMP_NE)) {
+      trusimd_errno = TRUSIMD_ETYPE;
+      return -1;
+    }
+
+    // Predicates indexed by op, floats compare ordered except for != which
+    // is true when an operand is NaN as in C
+    static const char *const c_ops[6] = {" == ", " != ", " < ",
+                                         " <= ", " > ",  " >= "};
+    static const char *const ir_signed[6] = {"eq",  "ne",  "slt",
+                                             "sle", "sgt", "sge"};
+    static const char *const ir_unsigned[6] = {"eq",  "ne",  "ult",
+                                               "ule", "ugt", "uge"};
+    static const char *const ir_float[6] = {"oeq", "une", "olt",
+                                            "ole", "ogt", "oge"};
+    static const SpvOp spirv_signed[6] = {
+        SpvIEqual,         SpvINotEqual,    SpvSLessThan,
+        SpvSLessThanEqual, SpvSGreaterThan, SpvSGreaterThanEqual};
+    static const SpvOp spirv_unsigned[6] = {
+        SpvIEqual,         SpvINotEqual,    SpvULessThan,
+        SpvULessThanEqual, SpvUGreaterThan, SpvUGreaterThanEqual};
+    static const SpvOp spirv_float[6] = {
+        SpvFOrdEqual,         SpvFUnordNotEqual,  SpvFOrdLessThan,
+        SpvFOrdLessThanEqual, SpvFOrdGreaterThan, SpvFOrdGreaterThanEqual};
+    const char *ir_op, *ir_pred;
+    SpvOp spirv_op;
+    if (is_bool(t)) {
+      ir_op = "icmp";
+      ir_pred = ir_unsigned[op];
+      spirv_op = (op == TRUSIMD_CMP_EQ ? SpvLogicalEqual : SpvLogicalNotEqual);
+    } else if (is_int(t)) {
+      ir_op = "icmp";
+      ir_pred = (is_signed(t) ? ir_signed[op] : ir_unsigned[op]);
+      spirv_op = (is_signed(t) ? spirv_signed[op] : spirv_unsigned[op]);
+    } else {
+      ir_op = "fcmp?fmf?";
+      ir_pred = ir_float[op];
+      spirv_op = spirv_float[op];
+    }
 
     // LLVM IR
-    print(IRVec, k, "|V = alloca T\n\n", nv, t);
-    print(IRSca, k, "|V = alloca T\n\n", nv, t);
+    type mask_t = t;
+    mask_t.kind = TRUSIMD_UNSIGNED;
+    mask_t.width = 1;
+    mask_t.flags = 0;
+    int va = need_ir_var(k, a);
+    int vb = need_ir_var(k, b);
+    int nv = pick_next_var(k, mask_t);
+    print(IRVec, k, "|V = S S T V, V\n\n", nv, ir_op, ir_pred, t, va, vb);
+    print(IRSca, k, "|V = S S T V, V\n\n", nv, ir_op, ir_pred, t, va, vb);
+    print(IRMsk, k, "|V = S S T V, V\n\n", nv, ir_op, ir_pred, t, va, vb);
+
+    // C code, comparisons of OpenCL vectors give -1/0 integers as wide as
+    // the compared elements
+    k->expr[nv] = "(" + k->expr[a] + c_ops[op] + k->expr[b] + ")";
+    k->expr_vec[nv] = "(" + k->expr_vec[a] + c_ops[op] + k->expr_vec[b] + ")";
+    if (a == k->global_index_var || b == k->global_index_var) {
+      k->opencl_vec_ok = false;
+    }
+    if (t.scalar_vector == TRUSIMD_VECTOR) {
+      if (!is_bool(t)) {
+        k->mask_widths[nv] = t.width;
+      } else if (k->mask_widths.count(a) && k->mask_widths.count(b) &&
+                 k->mask_widths[a] == k->mask_widths[b]) {
+        k->mask_widths[nv] = k->mask_widths[a];
+      }
+    }
 
-    // CUDA/OpenCL
-    print(CU, k, "|T V;\n", t, nv);
-    print(CL, k, "|T V;\n", t, nv);
-    k->expr[nv] = "v";
-    print_T(&(k->expr[nv]), nv);
+    // SPIR-V
+    unsigned sa = spirv_value(k, a);
+    unsigned sb = spirv_value(k, b);
+    k->spirv_ids[nv] = spirv_new_id(k);
+    spirv_emit(&k->spirv_body, spirv_op,
+               {spirv_type(k, mask_t), k->spirv_ids[nv], sa, sb});
 
     return nv;
 #ifndef NO_EXCEPTIONS
-  } catch(std::exception &) {
-    errno = ENOMEM;
+  } catch (std::exception &) {
+    trusimd_errno = TRUSIMD_ENOMEM;
     return -1;
   }
 #endif
 }
 
-// ----------------------------------------------------------------------------
-// Assignment
-
-int trusimd_assign(kernel *k, int lvalue, int rvalue) {
+int trusimd_select(kernel *k, int mask, int a, int b) {
 #ifndef NO_EXCEPTIONS
   try {
 #endif
-    // LLVM IR
-    type t = k->vars[lvalue];
-    if (t != k->vars[rvalue]) {
+    // Type checking, a scalar mask may select between vectors
+    type mt = k->vars[mask];
+    type t = k->vars[a];
+    if (!is_bool(mt) || is_pointer(mt) || is_pointer(t) || k->vars[b] != t ||
+        (mt.scalar_vector == TRUSIMD_VECTOR &&
+         t.scalar_vector != TRUSIMD_VECTOR)) {
       trusimd_errno = TRUSIMD_ETYPE;
       return -1;
     }
-    print(IRVec, k, "|store T V, T* V\n\n", t, rvalue, t, lvalue);
-    print(IRSca, k, "|store T V, T* V\n\n", t, rvalue, t, lvalue);
 
-    // CUDA/OpenCL
-    print(CU, k, "|V = S;\n", lvalue, k->expr[rvalue].c_str());
-    print(CL, k, "|V = S;\n", lvalue, k->expr[rvalue].c_str());
+    // LLVM IR
+    int vm = need_ir_var(k, mask);
+    int va = need_ir_var(k, a);
+    int vb = need_ir_var(k, b);
+    int nv = pick_next_var(k, t);
+    print(IRVec, k, "|V = select T V, T V, T V\n\n", nv, mt, vm, t, va, t,
+          vb);
+    print(IRSca, k, "|V = select T V, T V, T V\n\n", nv, mt, vm, t, va, t,
+          vb);
+    print(IRMsk, k, "|V = select T V, T V, T V\n\n", nv, mt, vm, t, va, t,
+          vb);
+
+    // C code, OpenCL select on vectors needs a mask as wide as the elements
+    k->expr[nv] =
+        "(" + k->expr[mask] + " ? " + k->expr[a] + " : " + k->expr[b] + ")";
+    if (mt.scalar_vector == TRUSIMD_VECTOR) {
+      k->expr_vec[nv] = "select(" + k->expr_vec[b] + ", " + k->expr_vec[a] +
+                        ", " + k->expr_vec[mask] + ")";
+      std::map<int, int>::const_iterator it = k->mask_widths.find(mask);
+      if (it == k->mask_widths.end() || it->second != t.width) {
+        k->opencl_vec_ok = false;
+      }
+    } else {
+      k->expr_vec[nv] = "(" + k->expr_vec[mask] + " ? " + k->expr_vec[a] +
+                        " : " + k->expr_vec[b] + ")";
+    }
+    if (mask == k->global_index_var || a == k->global_index_var ||
+        b == k->global_index_var) {
+      k->opencl_vec_ok = false;
+    }
+    if (is_bool(t) && t.scalar_vector == TRUSIMD_VECTOR &&
+        k->mask_widths.count(a) && k->mask_widths.count(b) &&
+        k->mask_widths[a] == k->mask_widths[b]) {
+      k->mask_widths[nv] = k->mask_widths[a];
+    }
 
-    return 0;
+    // SPIR-V
+    unsigned sm = spirv_value(k, mask);
+    unsigned sa = spirv_value(k, a);
+    unsigned sb = spirv_value(k, b);
+    k->spirv_ids[nv] = spirv_new_id(k);
+    spirv_emit(&k->spirv_body, SpvSelect,
+               {spirv_type(k, t), k->spirv_ids[nv], sm, sa, sb});
+
+    return nv;
 #ifndef NO_EXCEPTIONS
-  } catch(std::exception &) {
+  } catch (std::exception &) {
     trusimd_errno = TRUSIMD_ENOMEM;
     return -1;
   }
@@ -728,49 +2144,257 @@ int trusimd_assign(kernel *k, int lvalue, int rvalue) {
 }
 
 // ----------------------------------------------------------------------------
-// Load from memory
+// Conversions. Integers saturate by clamping in the wider of the source and
+// destination types before truncating, floating point values saturate with
+// the dedicated intrinsics, builtins or instructions of each target.
+
+// Booleans are 0 or 1 whatever their kind
+static inline unsigned long long int_max(type t) {
+  if (is_signed(t) && !is_bool(t)) {
+    return (1ULL << (t.width - 1)) - 1;
+  }
+  return (t.width == 64 ? ~0ULL : (1ULL << t.width) - 1);
+}
 
-int trusimd_load(kernel *k, int ptr, int offset) {
+static inline long long int_min(type t) {
+  return (is_signed(t) && !is_bool(t) ? -(long long)int_max(t) - 1 : 0);
+}
+
+// Operand of type t holding a decimal constant, splat in vector bodies
+static inline std::string ir_splat(PrintLang lang, kernel *k, type t,
+                                   std::string const &name,
+                                   std::string const &value) {
+  if (lang == IRSca || t.scalar_vector == TRUSIMD_SCALAR) {
+    return value;
+  }
+  type sca_t = t;
+  sca_t.scalar_vector = TRUSIMD_SCALAR;
+  print(lang, k,
+        "|Sb = insertelement T undef, T S, i32 0\n"
+        "|S = shufflevector T Sb, T undef, <?????????? x i32> "
+        "zeroinitializer\n",
+        name.c_str(), t, sca_t, value.c_str(), name.c_str(), t, name.c_str(),
+        t);
+  return name;
+}
+
+int trusimd_convert(kernel *k, int v, type t, int mode) {
 #ifndef NO_EXCEPTIONS
   try {
 #endif
-    // Type checking
-    type ptr_t = k->vars[ptr];
-    type t = remove_pointer(ptr_t);
-    type vec_t = t;
-    if (offset == k->global_index_var) { // should be done more seriously
-      vec_t.scalar_vector = TRUSIMD_VECTOR;
+    // Type checking, the result is a vector if the value is one
+    if ((mode & ~(TRUSIMD_CONVERT_ROUND | TRUSIMD_CONVERT_SAT)) != 0) {
+      trusimd_errno = TRUSIMD_EINDEX;
+      return -1;
     }
-    type offset_t = k->vars[offset];
-    if (!is_int(offset_t)) {
+    type st = k->vars[v];
+    if (is_pointer(st) || is_pointer(t) || st.kind == TRUSIMD_BFLOAT ||
+        t.kind == TRUSIMD_BFLOAT || is_bool(t)) {
       trusimd_errno = TRUSIMD_ETYPE;
       return -1;
     }
+    type dt = t;
+    dt.scalar_vector = st.scalar_vector;
+    dt.flags = 0;
+
+    // Modes only change conversions to integers, integers saturate against
+    // the bounds of the destination that the source range exceeds
+    bool src_float = (st.kind == TRUSIMD_FLOAT);
+    bool dst_float = (dt.kind == TRUSIMD_FLOAT);
+    bool src_signed = is_signed(st) && !is_bool(st);
+    bool round = (mode & TRUSIMD_CONVERT_ROUND) && src_float && !dst_float;
+    bool sat = (mode & TRUSIMD_CONVERT_SAT) && !dst_float;
+    std::string hi, lo;
+    if (sat && !src_float) {
+      if (int_max(st) > int_max(dt)) {
+        print_T(&hi, int_max(dt));
+      }
+      if (int_min(st) < int_min(dt)) {
+        print_T(&lo, int_min(dt));
+      }
+    }
 
-    // LLVM IR
-    int vptr = need_ir_var(k, ptr);
-    int tmp = pick_next_var(k, vec_t);
-    int voffset = need_ir_var(k, offset);
-    print(IRVec, k, "|V = getelementptr inbounds T, T* V, T V\n", tmp, t, t,
-          vptr, offset_t, voffset);
-    int tmp2 = tmp;
-    if (t != vec_t) {
-      tmp2 = pick_next_var(k, vec_t);
-      print(IRVec, k, "|V = bitcast T* V to T*\n", tmp2, t, tmp, vec_t);
+    // LLVM IR, the scalar body calls the scalar version of intrinsics
+    int vv = need_ir_var(k, v);
+    int nv = pick_next_var(k, dt);
+    type wide_t = st;
+    wide_t.width = std::max(st.width, dt.width);
+    const PrintLang langs[3] = {IRVec, IRSca, IRMsk};
+    for (int l = 0; l < 3; l++) {
+      PrintLang lang = langs[l];
+      std::string x, name;
+      print_var_name(lang, k, &x, vv);
+      print_var_name(lang, k, &name, nv);
+      type lst = st, ldt = dt, lwide_t = wide_t;
+      if (lang == IRSca) {
+        lst.scalar_vector = TRUSIMD_SCALAR;
+        ldt.scalar_vector = TRUSIMD_SCALAR;
+        lwide_t.scalar_vector = TRUSIMD_SCALAR;
+      }
+      if (round) {
+        std::string fn(need_ir_intrinsic(k, "roundeven", lst, 1, ""));
+        print(lang, k, "|Sr = call T S(T S)\n", name.c_str(), st, fn.c_str(),
+              st, x.c_str());
+        x = name + "r";
+      }
+      const char *op;
+      if (src_float && dst_float) {
+        op = (st.width < dt.width ? "fpext"
+              : st.width > dt.width ? "fptrunc" : "bitcast");
+      } else if (dst_float) {
+        op = (src_signed ? "sitofp" : "uitofp");
+      } else if (src_float && sat) {
+        std::string fn(is_signed(dt) ? "@llvm.fptosi.sat."
+                                     : "@llvm.fptoui.sat.");
+        print_ir_mangled_type(&fn, ldt);
+        fn.push_back('.');
+        print_ir_mangled_type(&fn, lst);
+        std::string decl("declare ");
+        print_irvec_type(k, &decl, ldt);
+        decl += " " + fn + "(";
+        print_irvec_type(k, &decl, lst);
+        decl += ")\n";
+        k->llvm_ir_decls.insert(decl);
+        print(lang, k, "|V = call T S(T S)\n\n", nv, dt, fn.c_str(), st,
+              x.c_str());
+        continue;
+      } else if (src_float) {
+        op = (is_signed(dt) ? "fptosi" : "fptoui");
+      } else if (!hi.empty() || !lo.empty()) {
+        if (st.width < wide_t.width) {
+          print(lang, k, "|Sw = S T S to T\n", name.c_str(),
+                (src_signed ? "sext" : "zext"), st, x.c_str(), wide_t);
+          x = name + "w";
+        }
+        if (!hi.empty()) {
+          std::string fn(need_ir_intrinsic(
+              k, (src_signed ? "smin" : "umin"), lwide_t, 2, ""));
+          std::string c(ir_splat(lang, k, wide_t, name + "hi", hi));
+          print(lang, k, "|Sh = call T S(T S, T S)\n", name.c_str(), wide_t,
+                fn.c_str(), wide_t, x.c_str(), wide_t, c.c_str());
+          x = name + "h";
+        }
+        if (!lo.empty()) {
+          std::string fn(need_ir_intrinsic(k, "smax", lwide_t, 2, ""));
+          std::string c(ir_splat(lang, k, wide_t, name + "lo", lo));
+          print(lang, k, "|Sl = call T S(T S, T S)\n", name.c_str(), wide_t,
+                fn.c_str(), wide_t, x.c_str(), wide_t, c.c_str());
+          x = name + "l";
+        }
+        print(lang, k, "|V = S T S to T\n\n", nv,
+              (wide_t.width > dt.width ? "trunc" : "bitcast"), wide_t,
+              x.c_str(), dt);
+        continue;
+      } else {
+        op = (st.width < dt.width ? (src_signed ? "sext" : "zext")
+              : st.width > dt.width ? "trunc" : "bitcast");
+      }
+      print(lang, k, "|V = S T S to T\n\n", nv, op, st, x.c_str(), dt);
     }
-    int nv = pick_next_var(k, vec_t);
-    print(IRVec, k, "|V = load T, T* V, align 1\n\n", nv, vec_t, vec_t, tmp2);
 
-    print(IRSca, k, "|V = getelementptr inbounds T, T* V, T V\n", tmp, t, t,
-          vptr, offset_t, voffset);
-    print(IRSca, k, "|V = load T, T* V\n\n", nv, t, t, tmp);
+    // C code, in a variable as CUDA casts where OpenCL calls convert_<type>.
+    // CUDA converts floating point values to 32 and 64-bits integers with
+    // saturation, narrower integers are clamped from int.
+    std::string cu(k->expr[v]), c_type;
+    print_c_type(&c_type, dt);
+    if (round) {
+      cu = "rint(" + cu + ")";
+    }
+    if (sat && src_float && dt.width <= 16) {
+      std::string b;
+      print_T(&b, int_max(dt));
+      cu = "min((int)" + cu + ", " + b + ")";
+      b.clear();
+      print_T(&b, int_min(dt));
+      cu = "max(" + cu + ", " + b + ")";
+    } else if (sat) {
+      std::string src_type;
+      print_c_type(&src_type, st);
+      if (!hi.empty()) {
+        cu = "min(" + cu + ", (" + src_type + ")" + hi + ")";
+      }
+      if (!lo.empty()) {
+        cu = "max(" + cu + ", (" + src_type + ")" + lo + ")";
+      }
+    }
+    cu = "((" + c_type + ")" + cu + ")";
+    std::string suffix(sat ? "_sat" : "");
+    suffix += (round ? "_rte" : "");
+    std::string cl, cl_vec;
+    if (is_bool(st)) {
+      cl = "((" + c_type + ")" + k->expr[v] + ")";
+      cl_vec = "((" + c_type + ")" + k->expr_vec[v] + ")";
+      if (st.scalar_vector == TRUSIMD_VECTOR) {
+        k->opencl_vec_ok = false;
+      }
+    } else {
+      cl = "convert_";
+      print_opencl_base_type(&cl, dt);
+      cl_vec = cl;
+      if (st.scalar_vector == TRUSIMD_VECTOR) {
+        cl_vec += "??????????";
+      }
+      cl += suffix + "(" + k->expr[v] + ")";
+      cl_vec += suffix + "(" + k->expr_vec[v] + ")";
+    }
+    if (v == k->global_index_var) {
+      k->opencl_vec_ok = false;
+    }
+    print(CU, k, "|T V = S;\n\n", dt, nv, cu.c_str());
+    print(CL, k, "|T V = S;\n\n", dt, nv, cl.c_str());
+    print(CLVec, k, "|T V = S;\n\n", dt, nv, cl_vec.c_str());
+    k->expr[nv] = "v";
+    print_T(&(k->expr[nv]), nv);
+    k->expr_vec[nv] = k->expr[nv];
 
-    // CUDA/OpenCL
-    k->expr[nv] = k->expr[ptr] + "[" + k->expr[offset] + "]";
+    // SPIR-V, integers being signless converting between integers of the
+    // same width is a no-op unless it saturates a change of signedness
+    unsigned sv = spirv_value(k, v);
+    if (is_bool(st)) {
+      k->spirv_ok = false;
+    }
+    if (round) {
+      if (k->spirv_opencl_std == 0) {
+        k->spirv_opencl_std = spirv_new_id(k);
+      }
+      unsigned id = spirv_new_id(k);
+      spirv_emit(&k->spirv_body, SpvExtInst,
+                 {spirv_type(k, st), id, k->spirv_opencl_std, 53 /* rint */,
+                  sv});
+      sv = id;
+    }
+    SpvOp spirv_op;
+    bool spirv_nop = (st.width == dt.width);
+    if (src_float && dst_float) {
+      spirv_op = SpvFConvert;
+    } else if (dst_float) {
+      spirv_op = (src_signed ? SpvConvertSToF : SpvConvertUToF);
+      spirv_nop = false;
+    } else if (src_float) {
+      spirv_op = (is_signed(dt) ? SpvConvertFToS : SpvConvertFToU);
+      spirv_nop = false;
+    } else if (sat && src_signed != is_signed(dt)) {
+      spirv_op = (src_signed ? SpvSatConvertSToU : SpvSatConvertUToS);
+      spirv_nop = false;
+    } else {
+      spirv_op = (src_signed ? SpvSConvert : SpvUConvert);
+    }
+    if (spirv_nop) {
+      k->spirv_ids[nv] = sv;
+    } else {
+      k->spirv_ids[nv] = spirv_new_id(k);
+      spirv_emit(&k->spirv_body, spirv_op,
+                 {spirv_type(k, dt), k->spirv_ids[nv], sv});
+      if (sat && spirv_op != SpvSatConvertSToU &&
+          spirv_op != SpvSatConvertUToS) {
+        spirv_emit(&k->spirv_decorations, SpvDecorate,
+                   {k->spirv_ids[nv], 28 /* SaturatedConversion */});
+      }
+    }
 
     return nv;
 #ifndef NO_EXCEPTIONS
-  } catch(std::exception &) {
+  } catch (std::exception &) {
     trusimd_errno = TRUSIMD_ENOMEM;
     return -1;
   }
@@ -778,52 +2402,90 @@ int trusimd_load(kernel *k, int ptr, int offset) {
 }
 
 // ----------------------------------------------------------------------------
-// Store to memory
+// Reductions, see the reduction helpers for how they are computed
 
-int trusimd_store(kernel *k, int ptr, int offset, int v) {
+int trusimd_reduce(kernel *k, int op, int ptr, int v) {
 #ifndef NO_EXCEPTIONS
   try {
 #endif
-    // Type checking
+    // Type checking, the result goes to a pointer argument
+    if (op < TRUSIMD_REDUCE_SUM || op > TRUSIMD_REDUCE_MAX) {
+      trusimd_errno = TRUSIMD_EINDEX;
+      return -1;
+    }
     type ptr_t = k->vars[ptr];
     type t = remove_pointer(ptr_t);
     type vec_t = t;
-    if (offset == k->global_index_var) { // should be done more seriously
-      vec_t.scalar_vector = TRUSIMD_VECTOR;
-    }
-    type offset_t = k->vars[offset];
-    if (!is_int(offset_t) || (k->vars[v] != t && k->vars[v] != vec_t)) {
+    vec_t.scalar_vector = TRUSIMD_VECTOR;
+    type v_t = k->vars[v];
+    if (std::find(k->args_vars.begin(), k->args_vars.end(), ptr) ==
+            k->args_vars.end() ||
+        ptr_t.nb_times_ptr != 1 || is_bool(t) || t.kind == TRUSIMD_BFLOAT ||
+        (v_t != t && v_t != vec_t)) {
       trusimd_errno = TRUSIMD_ETYPE;
       return -1;
     }
+    int i = int(k->reductions.size());
+    reduction r = {op, ptr, t};
+    k->reductions.push_back(r);
 
-    // LLVM IR
-    int tmp = pick_next_var(k, ptr_t);
-    int vptr = need_ir_var(k, ptr);
-    int voffset = need_ir_var(k, offset);
-    print(IRVec, k, "|V = getelementptr inbounds T, T* V, T V\n", tmp, t, t,
-          vptr, offset_t, voffset);
-    int tmp2 = tmp;
-    if (t != vec_t) {
-      tmp2 = pick_next_var(k, vec_t);
-      print(IRVec, k, "|V = bitcast T* V to T*\n", tmp2, t, tmp, vec_t);
-    }
+    // LLVM IR, scalar values are broadcast to all lanes of vectors and only
+    // active lanes are accumulated
     int vv = need_ir_var(k, v);
-    print(IRVec, k, "|store T V, T* V, align 1\n\n", vec_t, vv, vec_t, tmp2);
+    int nv = pick_next_var(k, vec_t);
+    std::string vty;
+    print_irvec_type(k, &vty, vec_t);
+    const PrintLang langs[3] = {IRVec, IRSca, IRMsk};
+    for (int l = 0; l < 3; l++) {
+      std::string name("%red"), value;
+      print_T(&name, i);
+      name += '_';
+      print_var_name(langs[l], k, &name, nv);
+      name.erase(name.find('%', 1), 1);
+      print_var_name(langs[l], k, &value, vv);
+      if (langs[l] != IRSca && v_t == t) {
+        print(langs[l], k,
+              "|Sb = insertelement S undef, T S, i32 0\n"
+              "|Sc = shufflevector S Sb, S undef, <?????????? x i32> "
+              "zeroinitializer\n",
+              name.c_str(), vty.c_str(), t, value.c_str(), name.c_str(),
+              vty.c_str(), name.c_str(), vty.c_str());
+        value = name + "c";
+      }
+      std::string const &mask =
+          (langs[l] == IRVec ? k->ir_mask_vec : k->ir_mask_msk);
+      if (langs[l] != IRSca && !mask.empty()) {
+        print(langs[l], k,
+              "|Sm = select <?????????? x i1> S, S S, S %redD_splat\n",
+              name.c_str(), mask.c_str(), vty.c_str(), value.c_str(),
+              vty.c_str(), i);
+        value = name + "m";
+      }
+      type acc_t = (langs[l] == IRSca ? t : vec_t);
+      const char *acc = (langs[l] == IRSca ? "sca" : "vec");
+      print(langs[l], k, "|Sa = load T, T* %redD_S\n", name.c_str(), acc_t,
+            acc_t, i, acc);
+      print_ir_reduce_op(langs[l], k, op, acc_t, name + "n", name + "a",
+                         value);
+      print(langs[l], k, "|store T Sn, T* %redD_S\n\n", acc_t,
+            name.c_str(), acc_t, i, acc);
+    }
 
-    print(IRSca, k, "|V = getelementptr inbounds T, T* V, T V\n", tmp, t, t,
-          vptr, offset_t, voffset);
-    print(IRSca, k, "|store T V, T* V\n\n", t, vv, t, tmp);
+    // CUDA/OpenCL, the private accumulator is declared by trusimd_end_kernel
+    std::string red("red");
+    print_T(&red, i);
+    print(CU, k, "|S = S;\n\n", red.c_str(),
+          c_reduce_op(op, t, red, k->expr[v]).c_str());
+    print(CL, k, "|S = S;\n\n", red.c_str(),
+          c_reduce_op(op, t, red, k->expr[v]).c_str());
+    k->opencl_vec_ok = false;
 
-    // CUDA/OpenCL
-    print(CU, k, "|S[S] = S;\n\n", k->expr[ptr].c_str(),
-          k->expr[offset].c_str(), k->expr[v].c_str());
-    print(CL, k, "|S[S] = S;\n\n", k->expr[ptr].c_str(),
-          k->expr[offset].c_str(), k->expr[v].c_str());
+    // SPIR-V
+    k->spirv_ok = false;
 
     return 0;
 #ifndef NO_EXCEPTIONS
-  } catch(std::exception &) {
+  } catch (std::exception &) {
     trusimd_errno = TRUSIMD_ENOMEM;
     return -1;
   }
@@ -831,94 +2493,868 @@ int trusimd_store(kernel *k, int ptr, int offset, int v) {
 }
 
 // ----------------------------------------------------------------------------
-// Get global ID
-
-int trusimd_get_global_id(kernel *k) { return k->global_index_var; }
-
-// ----------------------------------------------------------------------------
-// Find first accelerator
-
-trusimd_hardware *trusimd_find_first_hardware(trusimd_hardware *h, int n,
-                                              int kind) {
-  for (int i = 0; i < n; i++) {
-    if (h->accelerator == kind) {
-      return h + i;
-    }
-  }
-  return NULL;
+// Structured control flow. In CUDA/OpenCL, SPIR-V and the scalar tail of
+// LLVM IR blocks branch natively. In vectors of LLVM IR, conditions that
+// differ between lanes are if-converted: the block runs under the mask of
+// active lanes, stores and assignments only touch active lanes, and the
+// block is skipped when no lane is active.
+
+// Labels of the block in LLVM IR, one prefix per body of the function
+static inline std::string ir_block_label(PrintLang lang, block const &b) {
+  std::string res(lang == IRVec ? "v" : lang == IRSca ? "s" : "m");
+  res += (b.loop ? "for" : "if");
+  print_T(&res, b.num);
+  return res;
 }
 
-// ----------------------------------------------------------------------------
-// Device malloc
+// Branches to then_ if any of the lanes of mask is active, to else_ if not
+static inline void print_ir_any(PrintLang lang, kernel *k,
+                                std::string const &mask,
+                                std::string const &any,
+                                std::string const &then_,
+                                std::string const &else_) {
+  k->llvm_ir_decls.insert("declare i1 @llvm.vector.reduce.or.v??????????i1("
+                          "<?????????? x i1>)\n");
+  print(lang, k,
+        "|S = call i1 @llvm.vector.reduce.or.v??????????i1("
+        "<?????????? x i1> S)\n"
+        "|br i1 S, label %S, label %S\n\n"
+        "S:\n\n",
+        any.c_str(), mask.c_str(), any.c_str(), then_.c_str(), else_.c_str(),
+        then_.c_str());
+}
 
-void *trusimd_device_malloc(trusimd_hardware *h, size_t n) {
+int trusimd_if(kernel *k, int cond) {
 #ifndef NO_EXCEPTIONS
   try {
 #endif
-    // clang-format off
-    switch(h->accelerator) {
-    case TRUSIMD_LLVM: return llvm_device_malloc(h, n);
-    case TRUSIMD_OPENCL: return opencl_device_malloc(h, n);
-    case TRUSIMD_CUDA: return cuda_device_malloc(h, n);
+    // Type checking
+    type t = k->vars[cond];
+    if (!is_bool(t) || is_pointer(t)) {
+      trusimd_errno = TRUSIMD_ETYPE;
+      return -1;
     }
-    // clang-format on
-    return NULL; // should never be reached
+    block b;
+    b.loop = false;
+    b.varying = (t.scalar_vector == TRUSIMD_VECTOR);
+    b.has_else = false;
+    b.num = k->nb_blocks++;
+    b.cond = need_ir_var(k, cond);
+    b.mask_vec = k->ir_mask_vec;
+    b.mask_msk = k->ir_mask_msk;
+
+    // LLVM IR, lanes active in the block are the ones active before it for
+    // which the condition holds
+    const PrintLang langs[3] = {IRVec, IRSca, IRMsk};
+    for (int l = 0; l < 3; l++) {
+      std::string label(ir_block_label(langs[l], b)), c;
+      print_var_name(langs[l], k, &c, b.cond);
+      if (!b.varying || langs[l] == IRSca) {
+        print(langs[l], k, "|br i1 S, label %S_then, label %S_else\n\n"
+              "S_then:\n\n", c.c_str(), label.c_str(), label.c_str(),
+              label.c_str());
+        continue;
+      }
+      std::string &mask =
+          (langs[l] == IRVec ? k->ir_mask_vec : k->ir_mask_msk);
+      if (!mask.empty()) {
+        print(langs[l], k, "|%S_mask = and <?????????? x i1> S, S\n",
+              label.c_str(), mask.c_str(), c.c_str());
+        c = "%" + label + "_mask";
+      }
+      print_ir_any(langs[l], k, c, "%" + label + "_any", label + "_then",
+                   label + "_else");
+      mask = c;
+    }
+
+    // CUDA/OpenCL, vectorized OpenCL only handles uniform conditions
+    print(CU, k, "|if (S) {\n", k->expr[cond].c_str());
+    print(CL, k, "|if (S) {\n", k->expr[cond].c_str());
+    print(CLVec, k, "|if (S) {\n", k->expr_vec[cond].c_str());
+    if (b.varying || cond == k->global_index_var) {
+      k->opencl_vec_ok = false;
+    }
+    k->c_indentation += 2;
+
+    // SPIR-V
+    unsigned spirv_then = spirv_new_id(k);
+    b.spirv_else = spirv_new_id(k);
+    b.spirv_merge = spirv_new_id(k);
+    unsigned sc = spirv_value(k, cond);
+    spirv_emit(&k->spirv_body, SpvSelectionMerge, {b.spirv_merge, 0});
+    spirv_emit(&k->spirv_body, SpvBranchConditional,
+               {sc, spirv_then, b.spirv_else});
+    spirv_emit(&k->spirv_body, SpvLabel, {spirv_then});
+
+    k->blocks.push_back(b);
+    return 0;
 #ifndef NO_EXCEPTIONS
-  } catch (std::exception &e) {
+  } catch (std::exception &) {
     trusimd_errno = TRUSIMD_ENOMEM;
-    return NULL;
+    return -1;
   }
 #endif
 }
 
-// ----------------------------------------------------------------------------
-// Device free
-
-void trusimd_device_free(trusimd_hardware *h, void *ptr) {
+int trusimd_else(kernel *k) {
 #ifndef NO_EXCEPTIONS
   try {
 #endif
-    // clang-format off
-    switch(h->accelerator) {
-    case TRUSIMD_LLVM: llvm_device_free(h, ptr); break;
-    case TRUSIMD_OPENCL: opencl_device_free(h, ptr); break;
-    case TRUSIMD_CUDA: cuda_device_free(h, ptr); break;
+    if (k->blocks.empty() || k->blocks.back().loop ||
+        k->blocks.back().has_else) {
+      trusimd_errno = TRUSIMD_EINDEX;
+      return -1;
     }
-    // clang-format on
+    block &b = k->blocks.back();
+    b.has_else = true;
+
+    // LLVM IR, lanes active in the else block are the ones active before
+    // the if for which the condition does not hold, when masked both blocks
+    // run one after the other
+    const PrintLang langs[3] = {IRVec, IRSca, IRMsk};
+    for (int l = 0; l < 3; l++) {
+      std::string label(ir_block_label(langs[l], b)), c;
+      if (!b.varying || langs[l] == IRSca) {
+        print(langs[l], k, "|br label %S_end\n\nS_else:\n\n", label.c_str(),
+              label.c_str());
+        continue;
+      }
+      print(langs[l], k, "|br label %S_else\n\nS_else:\n\n", label.c_str(),
+            label.c_str());
+      print_var_name(langs[l], k, &c, b.cond);
+      print(langs[l], k,
+            "|%S_not = icmp eq <?????????? x i1> S, zeroinitializer\n",
+            label.c_str(), c.c_str());
+      c = "%" + label + "_not";
+      std::string const &parent =
+          (langs[l] == IRVec ? b.mask_vec : b.mask_msk);
+      if (!parent.empty()) {
+        print(langs[l], k, "|%S_emask = and <?????????? x i1> S, S\n",
+              label.c_str(), parent.c_str(), c.c_str());
+        c = "%" + label + "_emask";
+      }
+      print_ir_any(langs[l], k, c, "%" + label + "_eany", label + "_ebody",
+                   label + "_end");
+      (langs[l] == IRVec ? k->ir_mask_vec : k->ir_mask_msk) = c;
+    }
+
+    // CUDA/OpenCL
+    k->c_indentation -= 2;
+    print(CU, k, "|} else {\n");
+    print(CL, k, "|} else {\n");
+    print(CLVec, k, "|} else {\n");
+    k->c_indentation += 2;
+
+    // SPIR-V
+    spirv_emit(&k->spirv_body, SpvBranch, {b.spirv_merge});
+    spirv_emit(&k->spirv_body, SpvLabel, {b.spirv_else});
+
+    return 0;
 #ifndef NO_EXCEPTIONS
-  } catch (std::exception &e) {
-    // no error on exception
+  } catch (std::exception &) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
   }
 #endif
 }
 
-// ----------------------------------------------------------------------------
-// Copy to device
-
-int trusimd_copy_to_device(trusimd_hardware *h, void *dst, void *src,
-                           size_t n) {
+int trusimd_end_if(kernel *k) {
 #ifndef NO_EXCEPTIONS
   try {
 #endif
-    // clang-format off
-    switch(h->accelerator) {
-    case TRUSIMD_LLVM: return llvm_copy_to_device(h, dst, src, n);
-    case TRUSIMD_OPENCL: return opencl_copy_to_device(h, dst, src, n);
-    case TRUSIMD_CUDA: return cuda_copy_to_device(h, dst, src, n);
+    if (k->blocks.empty() || k->blocks.back().loop) {
+      trusimd_errno = TRUSIMD_EINDEX;
+      return -1;
     }
-    // clang-format on
-    return 0; // should never be reached
+    block const &b = k->blocks.back();
+
+    // LLVM IR, an if without else has an empty else block
+    const PrintLang langs[3] = {IRVec, IRSca, IRMsk};
+    for (int l = 0; l < 3; l++) {
+      std::string label(ir_block_label(langs[l], b));
+      if (!b.has_else) {
+        print(langs[l], k, "|br label %S_end\n\nS_else:\n\n", label.c_str(),
+              label.c_str());
+      }
+      print(langs[l], k, "|br label %S_end\n\nS_end:\n\n", label.c_str(),
+            label.c_str());
+    }
+    k->ir_mask_vec = b.mask_vec;
+    k->ir_mask_msk = b.mask_msk;
+
+    // CUDA/OpenCL
+    k->c_indentation -= 2;
+    print(CU, k, "|}\n\n");
+    print(CL, k, "|}\n\n");
+    print(CLVec, k, "|}\n\n");
+
+    // SPIR-V
+    spirv_emit(&k->spirv_body, SpvBranch, {b.spirv_merge});
+    if (!b.has_else) {
+      spirv_emit(&k->spirv_body, SpvLabel, {b.spirv_else});
+      spirv_emit(&k->spirv_body, SpvBranch, {b.spirv_merge});
+    }
+    spirv_emit(&k->spirv_body, SpvLabel, {b.spirv_merge});
+
+    k->blocks.pop_back();
+    return 0;
 #ifndef NO_EXCEPTIONS
-  } catch (std::exception &e) {
+  } catch (std::exception &) {
     trusimd_errno = TRUSIMD_ENOMEM;
     return -1;
   }
 #endif
 }
 
-// ----------------------------------------------------------------------------
-// Copy to host
-
+int trusimd_for(kernel *k, int var, int begin, int end) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    // Type checking, bounds are the same for all lanes so that loops are
+    // native everywhere
+    type t = k->vars[var];
+    if (k->user_vars.find(var) == k->user_vars.end() || !is_int(t) ||
+        is_bool(t) || t.scalar_vector != TRUSIMD_SCALAR ||
+        k->vars[begin] != t || k->vars[end] != t) {
+      trusimd_errno = TRUSIMD_ETYPE;
+      return -1;
+    }
+    block b;
+    b.loop = true;
+    b.varying = false;
+    b.has_else = false;
+    b.num = k->nb_blocks++;
+    b.var = var;
+    b.end = need_ir_var(k, end);
+    int vbegin = need_ir_var(k, begin);
+
+    // LLVM IR
+    const PrintLang langs[3] = {IRVec, IRSca, IRMsk};
+    for (int l = 0; l < 3; l++) {
+      std::string label(ir_block_label(langs[l], b));
+      print(langs[l], k,
+            "|store T V, T* V\n"
+            "|br label %S_cond\n\n"
+            "S_cond:\n\n"
+            "|%S_i = load T, T* V\n"
+            "|%S_go = icmp S T %S_i, V\n"
+            "|br i1 %S_go, label %S_body, label %S_end\n\n"
+            "S_body:\n\n",
+            t, vbegin, t, var, label.c_str(), label.c_str(), label.c_str(), t,
+            t, var, label.c_str(), (is_signed(t) ? "slt" : "ult"), t,
+            label.c_str(), b.end, label.c_str(), label.c_str(), label.c_str(),
+            label.c_str());
+    }
+
+    // CUDA/OpenCL
+    print(CU, k, "|for (V = S; V < S; V++) {\n", var,
+          k->expr[begin].c_str(), var, k->expr[end].c_str(), var);
+    print(CL, k, "|for (V = S; V < S; V++) {\n", var,
+          k->expr[begin].c_str(), var, k->expr[end].c_str(), var);
+    print(CLVec, k, "|for (V = S; V < S; V++) {\n", var,
+          k->expr_vec[begin].c_str(), var, k->expr_vec[end].c_str(), var);
+    if (begin == k->global_index_var || end == k->global_index_var) {
+      k->opencl_vec_ok = false;
+    }
+    k->c_indentation += 2;
+
+    // SPIR-V, the condition has a block of its own as loop headers only
+    // hold the merge instruction
+    unsigned spirv_cond = spirv_new_id(k);
+    unsigned spirv_body = spirv_new_id(k);
+    b.spirv_header = spirv_new_id(k);
+    b.spirv_continue = spirv_new_id(k);
+    b.spirv_merge = spirv_new_id(k);
+    unsigned spirv_t = spirv_type(k, t);
+    unsigned spirv_bool_t = spirv_type(k, {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 1,
+                                           0, 0});
+    unsigned sb = spirv_value(k, begin);
+    unsigned se = spirv_value(k, end);
+    unsigned si = spirv_new_id(k);
+    unsigned sgo = spirv_new_id(k);
+    spirv_emit(&k->spirv_body, SpvStore, {k->spirv_ids[var], sb});
+    spirv_emit(&k->spirv_body, SpvBranch, {b.spirv_header});
+    spirv_emit(&k->spirv_body, SpvLabel, {b.spirv_header});
+    spirv_emit(&k->spirv_body, SpvLoopMerge,
+               {b.spirv_merge, b.spirv_continue, 0});
+    spirv_emit(&k->spirv_body, SpvBranch, {spirv_cond});
+    spirv_emit(&k->spirv_body, SpvLabel, {spirv_cond});
+    spirv_emit(&k->spirv_body, SpvLoad, {spirv_t, si, k->spirv_ids[var]});
+    spirv_emit(&k->spirv_body, (is_signed(t) ? SpvSLessThan : SpvULessThan),
+               {spirv_bool_t, sgo, si, se});
+    spirv_emit(&k->spirv_body, SpvBranchConditional,
+               {sgo, spirv_body, b.spirv_merge});
+    spirv_emit(&k->spirv_body, SpvLabel, {spirv_body});
+
+    k->blocks.push_back(b);
+    return 0;
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+int trusimd_end_for(kernel *k) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    if (k->blocks.empty() || !k->blocks.back().loop) {
+      trusimd_errno = TRUSIMD_EINDEX;
+      return -1;
+    }
+    block const &b = k->blocks.back();
+    type t = k->vars[b.var];
+
+    // LLVM IR
+    const PrintLang langs[3] = {IRVec, IRSca, IRMsk};
+    for (int l = 0; l < 3; l++) {
+      std::string label(ir_block_label(langs[l], b));
+      print(langs[l], k,
+            "|br label %S_next\n\n"
+            "S_next:\n\n"
+            "|%S_j = load T, T* V\n"
+            "|%S_k = add T %S_j, 1\n"
+            "|store T %S_k, T* V\n"
+            "|br label %S_cond\n\n"
+            "S_end:\n\n",
+            label.c_str(), label.c_str(), label.c_str(), t, t, b.var,
+            label.c_str(), t, label.c_str(), t, label.c_str(), t, b.var,
+            label.c_str(), label.c_str());
+    }
+
+    // CUDA/OpenCL
+    k->c_indentation -= 2;
+    print(CU, k, "|}\n\n");
+    print(CL, k, "|}\n\n");
+    print(CLVec, k, "|}\n\n");
+
+    // SPIR-V
+    unsigned spirv_t = spirv_type(k, t);
+    unsigned one = spirv_new_id(k);
+    if (t.width == 64) {
+      spirv_emit(&k->spirv_types, SpvConstant, {spirv_t, one, 1, 0});
+    } else {
+      spirv_emit(&k->spirv_types, SpvConstant, {spirv_t, one, 1});
+    }
+    unsigned sj = spirv_new_id(k);
+    unsigned sk = spirv_new_id(k);
+    spirv_emit(&k->spirv_body, SpvBranch, {b.spirv_continue});
+    spirv_emit(&k->spirv_body, SpvLabel, {b.spirv_continue});
+    spirv_emit(&k->spirv_body, SpvLoad, {spirv_t, sj, k->spirv_ids[b.var]});
+    spirv_emit(&k->spirv_body, SpvIAdd, {spirv_t, sk, sj, one});
+    spirv_emit(&k->spirv_body, SpvStore, {k->spirv_ids[b.var], sk});
+    spirv_emit(&k->spirv_body, SpvBranch, {b.spirv_header});
+    spirv_emit(&k->spirv_body, SpvLabel, {b.spirv_merge});
+
+    k->blocks.pop_back();
+    return 0;
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Variable creation
+
+int trusimd_var(kernel *k, type t) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    int nv = pick_next_var(k, t);
+    k->user_vars.insert(nv);
+
+    // LLVM IR, allocas are moved to the entry block by trusimd_end_kernel
+    // so that loops do not grow the stack
+    const PrintLang langs[3] = {IRVec, IRSca, IRMsk};
+    std::string *bufs[3] = {&k->llvm_ir_vec, &k->llvm_ir_sca,
+                            &k->llvm_ir_msk};
+    for (int l = 0; l < 3; l++) {
+      size_t pos = bufs[l]->size();
+      print(langs[l], k, "  V = alloca T\n", nv, t);
+      k->llvm_ir_allocas.append(*bufs[l], pos, std::string::npos);
+      bufs[l]->resize(pos);
+    }
+
+    // CUDA/OpenCL
+    print(CU, k, "|T V;\n", t, nv);
+    print(CL, k, "|T V;\n", t, nv);
+    print(CLVec, k, "|T V;\n", t, nv);
+    k->expr[nv] = "v";
+    print_T(&(k->expr[nv]), nv);
+    k->expr_vec[nv] = k->expr[nv];
+
+    // SPIR-V
+    k->spirv_ids[nv] = spirv_new_id(k);
+    spirv_emit(&k->spirv_vars, SpvVariable,
+               {spirv_pointer_type(k, spirv_type(k, t), 7 /* Function */),
+                k->spirv_ids[nv], 7 /* Function */});
+
+    return nv;
+#ifndef NO_EXCEPTIONS
+  } catch(std::exception &) {
+    errno = ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Assignment
+
+int trusimd_assign(kernel *k, int lvalue, int rvalue) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    // Type checking, under a condition that differs between lanes only
+    // vectors can be assigned as each lane keeps its own value
+    type t = k->vars[lvalue];
+    if (t != k->vars[rvalue] ||
+        (!k->ir_mask_vec.empty() && t.scalar_vector != TRUSIMD_VECTOR)) {
+      trusimd_errno = TRUSIMD_ETYPE;
+      return -1;
+    }
+
+    // LLVM IR, inactive lanes keep their previous value
+    int vr = need_ir_var(k, rvalue);
+    if (k->ir_mask_vec.empty()) {
+      print(IRVec, k, "|store T V, T* V\n\n", t, vr, t, lvalue);
+      print(IRMsk, k, "|store T V, T* V\n\n", t, vr, t, lvalue);
+    } else {
+      int old = pick_next_var(k, t);
+      int nv = pick_next_var(k, t);
+      print(IRVec, k,
+            "|V = load T, T* V\n"
+            "|V = select <?????????? x i1> S, T V, T V\n"
+            "|store T V, T* V\n\n",
+            old, t, t, lvalue, nv, k->ir_mask_vec.c_str(), t, vr, t, old, t,
+            nv, t, lvalue);
+      print(IRMsk, k,
+            "|V = load T, T* V\n"
+            "|V = select <?????????? x i1> S, T V, T V\n"
+            "|store T V, T* V\n\n",
+            old, t, t, lvalue, nv, k->ir_mask_msk.c_str(), t, vr, t, old, t,
+            nv, t, lvalue);
+    }
+    print(IRSca, k, "|store T V, T* V\n\n", t, vr, t, lvalue);
+
+    // CUDA/OpenCL
+    print(CU, k, "|V = S;\n", lvalue, k->expr[rvalue].c_str());
+    print(CL, k, "|V = S;\n", lvalue, k->expr[rvalue].c_str());
+    print(CLVec, k, "|V = S;\n", lvalue, k->expr_vec[rvalue].c_str());
+    if (rvalue == k->global_index_var) {
+      k->opencl_vec_ok = false;
+    }
+
+    // SPIR-V
+    spirv_emit(&k->spirv_body, SpvStore,
+               {k->spirv_ids[lvalue], spirv_value(k, rvalue)});
+
+    return 0;
+#ifndef NO_EXCEPTIONS
+  } catch(std::exception &) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Load from memory
+
+int trusimd_load(kernel *k, int ptr, int offset) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    // Type checking
+    type ptr_t = k->vars[ptr];
+    type t = remove_pointer(ptr_t);
+    type vec_t = t;
+    if (offset == k->global_index_var) { // should be done more seriously
+      vec_t.scalar_vector = TRUSIMD_VECTOR;
+    }
+    type offset_t = k->vars[offset];
+    if (!is_int(offset_t)) {
+      trusimd_errno = TRUSIMD_ETYPE;
+      return -1;
+    }
+
+    // LLVM IR
+    int vptr = need_ir_var(k, ptr);
+    int tmp = pick_next_var(k, vec_t);
+    int voffset = need_ir_var(k, offset);
+    print(IRVec, k, "|V = getelementptr inbounds T, T* V, T V\n", tmp, t, t,
+          vptr, offset_t, voffset);
+    int tmp2 = tmp;
+    if (t != vec_t) {
+      tmp2 = pick_next_var(k, vec_t);
+      print(IRVec, k, "|V = bitcast T* V to T*\n", tmp2, t, tmp, vec_t);
+    }
+    int nv = pick_next_var(k, vec_t);
+    std::string align(ir_alignment(k, ptr, t, vec_t));
+    std::string alias(ir_alias_metadata(k, ptr));
+    print(IRVec, k, "|V = load T, T* V, align SS\n\n", nv, vec_t, vec_t, tmp2,
+          align.c_str(), alias.c_str());
+
+    print(IRSca, k, "|V = getelementptr inbounds T, T* V, T V\n", tmp, t, t,
+          vptr, offset_t, voffset);
+    print(IRSca, k, "|V = load T, T* VS\n\n", nv, t, t, tmp, alias.c_str());
+
+    print(IRMsk, k, "|V = getelementptr inbounds T, T* V, T V\n", tmp, t, t,
+          vptr, offset_t, voffset);
+    if (t != vec_t) {
+      print(IRMsk, k,
+            "|V = bitcast T* V to T*\n"
+            "|V = call T S(T* V, i32 S, <?????????? x i1> %tail_mask, "
+            "T undef)S\n\n",
+            tmp2, t, tmp, vec_t, nv, vec_t,
+            need_ir_masked_op(k, true, vec_t).c_str(), vec_t, tmp2,
+            align.c_str(), vec_t, alias.c_str());
+    } else {
+      print(IRMsk, k, "|V = load T, T* VS\n\n", nv, t, t, tmp, alias.c_str());
+    }
+
+    // CUDA/OpenCL, vectorized OpenCL only handles contiguous accesses
+    k->expr[nv] = k->expr[ptr] + "[" + k->expr[offset] + "]";
+    if (t != vec_t) {
+      k->expr_vec[nv] = "vload??????????" "(0, " + k->expr_vec[ptr] +
+                        " + " + k->expr_vec[offset] + ")";
+    } else {
+      k->expr_vec[nv] = k->expr_vec[ptr] + "[" + k->expr_vec[offset] + "]";
+      if (offset_t.scalar_vector == TRUSIMD_VECTOR) {
+        k->opencl_vec_ok = false;
+      }
+    }
+
+    // SPIR-V
+    unsigned spirv_ptr = spirv_new_id(k);
+    k->spirv_ids[nv] = spirv_new_id(k);
+    spirv_emit(&k->spirv_body, SpvInBoundsPtrAccessChain,
+               {spirv_type(k, ptr_t), spirv_ptr, spirv_value(k, ptr),
+                spirv_value(k, offset)});
+    spirv_emit(&k->spirv_body, SpvLoad,
+               {spirv_type(k, t), k->spirv_ids[nv], spirv_ptr});
+
+    return nv;
+#ifndef NO_EXCEPTIONS
+  } catch(std::exception &) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Store to memory
+
+int trusimd_store(kernel *k, int ptr, int offset, int v) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    // Type checking
+    type ptr_t = k->vars[ptr];
+    type t = remove_pointer(ptr_t);
+    type vec_t = t;
+    if (offset == k->global_index_var) { // should be done more seriously
+      vec_t.scalar_vector = TRUSIMD_VECTOR;
+    }
+    type offset_t = k->vars[offset];
+    if (!is_int(offset_t) || (k->vars[v] != t && k->vars[v] != vec_t)) {
+      trusimd_errno = TRUSIMD_ETYPE;
+      return -1;
+    }
+
+    // LLVM IR
+    int tmp = pick_next_var(k, ptr_t);
+    int vptr = need_ir_var(k, ptr);
+    int voffset = need_ir_var(k, offset);
+    print(IRVec, k, "|V = getelementptr inbounds T, T* V, T V\n", tmp, t, t,
+          vptr, offset_t, voffset);
+    int tmp2 = tmp;
+    if (t != vec_t) {
+      tmp2 = pick_next_var(k, vec_t);
+      print(IRVec, k, "|V = bitcast T* V to T*\n", tmp2, t, tmp, vec_t);
+    }
+    int vv = need_ir_var(k, v);
+    std::string align(ir_alignment(k, ptr, t, vec_t));
+    std::string alias(ir_alias_metadata(k, ptr));
+    if (t != vec_t && !k->ir_mask_vec.empty()) {
+      print(IRVec, k,
+            "|call void S(T V, T* V, i32 S, <?????????? x i1> S)S\n\n",
+            need_ir_masked_op(k, false, vec_t).c_str(), vec_t, vv, vec_t, tmp2,
+            align.c_str(), k->ir_mask_vec.c_str(), alias.c_str());
+    } else {
+      print(IRVec, k, "|store T V, T* V, align SS\n\n", vec_t, vv, vec_t,
+            tmp2, align.c_str(), alias.c_str());
+    }
+
+    print(IRSca, k, "|V = getelementptr inbounds T, T* V, T V\n", tmp, t, t,
+          vptr, offset_t, voffset);
+    print(IRSca, k, "|store T V, T* VS\n\n", t, vv, t, tmp, alias.c_str());
+
+    print(IRMsk, k, "|V = getelementptr inbounds T, T* V, T V\n", tmp, t, t,
+          vptr, offset_t, voffset);
+    if (t != vec_t) {
+      print(IRMsk, k,
+            "|V = bitcast T* V to T*\n"
+            "|call void S(T V, T* V, i32 S, <?????????? x i1> S)S\n\n",
+            tmp2, t, tmp, vec_t, need_ir_masked_op(k, false, vec_t).c_str(),
+            vec_t, vv, vec_t, tmp2, align.c_str(), k->ir_mask_msk.c_str(),
+            alias.c_str());
+    } else {
+      print(IRMsk, k, "|store T V, T* VS\n\n", t, vv, t, tmp, alias.c_str());
+    }
+
+    // CUDA/OpenCL
+    print(CU, k, "|S[S] = S;\n\n", k->expr[ptr].c_str(),
+          k->expr[offset].c_str(), k->expr[v].c_str());
+    print(CL, k, "|S[S] = S;\n\n", k->expr[ptr].c_str(),
+          k->expr[offset].c_str(), k->expr[v].c_str());
+    if (t != vec_t) {
+      std::string value(k->expr_vec[v]);
+      if (k->vars[v] == t) { // scalar values are broadcast to all lanes
+        std::string cast("(");
+        print_opencl_vec_type(k, &cast, vec_t);
+        value = cast + ")(" + value + ")";
+      }
+      print(CLVec, k, "|vstore??????????" "(S, 0, S + S);\n\n",
+            value.c_str(), k->expr_vec[ptr].c_str(),
+            k->expr_vec[offset].c_str());
+    } else {
+      print(CLVec, k, "|S[S] = S;\n\n", k->expr_vec[ptr].c_str(),
+            k->expr_vec[offset].c_str(), k->expr_vec[v].c_str());
+      if (offset_t.scalar_vector == TRUSIMD_VECTOR) {
+        k->opencl_vec_ok = false;
+      }
+    }
+
+    // SPIR-V
+    unsigned spirv_ptr = spirv_new_id(k);
+    spirv_emit(&k->spirv_body, SpvInBoundsPtrAccessChain,
+               {spirv_type(k, ptr_t), spirv_ptr, spirv_value(k, ptr),
+                spirv_value(k, offset)});
+    spirv_emit(&k->spirv_body, SpvStore, {spirv_ptr, spirv_value(k, v)});
+
+    return 0;
+#ifndef NO_EXCEPTIONS
+  } catch(std::exception &) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Get global ID
+
+int trusimd_get_global_id(kernel *k) { return k->global_index_var; }
+
+// ----------------------------------------------------------------------------
+// Floating point precision policy, it applies to the whole kernel including
+// already recorded operations and is part of the key of compiled kernels
+
+int trusimd_set_precision(kernel *k, int precision) {
+  if (precision < TRUSIMD_STRICT || precision > TRUSIMD_FAST) {
+    trusimd_errno = TRUSIMD_EINDEX;
+    return -1;
+  }
+  k->precision = precision;
+  return 0;
+}
+
+int trusimd_get_precision(kernel *k) { return k->precision; }
+
+// ----------------------------------------------------------------------------
+// Mark a kernel pointer argument as aliasing no other argument
+
+type trusimd_noalias(type t) {
+  t.flags |= TRUSIMD_NOALIAS;
+  return t;
+}
+
+// ----------------------------------------------------------------------------
+// Vector version of a type, for variables holding one value per lane
+
+type trusimd_vector(type t) {
+  t.scalar_vector = TRUSIMD_VECTOR;
+  return t;
+}
+
+// ----------------------------------------------------------------------------
+// Find first accelerator
+
+trusimd_hardware *trusimd_find_first_hardware(trusimd_hardware *h, int n,
+                                              int kind) {
+  for (int i = 0; i < n; i++) {
+    if (h->accelerator == kind) {
+      return h + i;
+    }
+  }
+  return NULL;
+}
+
+// ----------------------------------------------------------------------------
+// Device malloc
+
+void *trusimd_device_malloc(trusimd_hardware *h, size_t n) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    // clang-format off
+    switch(h->accelerator) {
+    case TRUSIMD_LLVM: return llvm_device_malloc(h, n);
+    case TRUSIMD_OPENCL: return opencl_device_malloc(h, n);
+    case TRUSIMD_CUDA: return cuda_device_malloc(h, n);
+    }
+    // clang-format on
+    return NULL; // should never be reached
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &e) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return NULL;
+  }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Device malloc of a buffer also accessible from the host at *host_ptr, so
+// that copies between the two become no-ops
+
+void *trusimd_device_malloc_shared(trusimd_hardware *h, size_t n,
+                                   void **host_ptr) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    // clang-format off
+    switch(h->accelerator) {
+    case TRUSIMD_LLVM: return llvm_device_malloc_shared(h, n, host_ptr);
+    case TRUSIMD_OPENCL: return opencl_device_malloc_shared(h, n, host_ptr);
+    case TRUSIMD_CUDA: trusimd_errno = TRUSIMD_EAVAIL; return NULL;
+    }
+    // clang-format on
+    return NULL; // should never be reached
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &e) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return NULL;
+  }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Device free
+
+void trusimd_device_free(trusimd_hardware *h, void *ptr) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    // clang-format off
+    switch(h->accelerator) {
+    case TRUSIMD_LLVM: llvm_device_free(h, ptr); break;
+    case TRUSIMD_OPENCL: opencl_device_free(h, ptr); break;
+    case TRUSIMD_CUDA: cuda_device_free(h, ptr); break;
+    }
+    // clang-format on
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &e) {
+    // no error on exception
+  }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Device memory pool
+
+int trusimd_get_pool_stats(trusimd_hardware *h, trusimd_pool_stats *stats) {
+  switch (h->accelerator) {
+  case TRUSIMD_OPENCL:
+    return opencl_get_pool_stats(h, stats);
+  default:
+    memset((void *)stats, 0, sizeof(trusimd_pool_stats));
+    return 0;
+  }
+}
+
+int trusimd_trim_pool(trusimd_hardware *h) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    switch (h->accelerator) {
+    case TRUSIMD_OPENCL:
+      return opencl_trim_pool(h);
+    default:
+      return 0;
+    }
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &e) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Device timings, the number of profiles is returned and at most n of them
+// are written to profiles. Queues must be created after TRUSIMD_PROFILING is
+// set, i.e. before the first use of the hardware.
+
+int trusimd_get_profiles(trusimd_hardware *h, trusimd_profile *profiles,
+                         int n) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    switch (h->accelerator) {
+    case TRUSIMD_OPENCL:
+      return opencl_get_profiles(h, profiles, n);
+    default:
+      return 0;
+    }
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &e) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+void trusimd_reset_profiles(trusimd_hardware *h) {
+  if (h->accelerator == TRUSIMD_OPENCL) {
+    opencl_reset_profiles(h);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Copy to device
+
+int trusimd_copy_to_device(trusimd_hardware *h, void *dst, void *src,
+                           size_t n) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    // clang-format off
+    switch(h->accelerator) {
+    case TRUSIMD_LLVM: return llvm_copy_to_device(h, dst, src, n);
+    case TRUSIMD_OPENCL:
+      return opencl_copy_to_device(h, dst, src, n, 0, NULL, NULL);
+    case TRUSIMD_CUDA: return cuda_copy_to_device(h, dst, src, n);
+    }
+    // clang-format on
+    return 0; // should never be reached
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &e) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Copy to host
+
 int trusimd_copy_to_host(trusimd_hardware *h, void *dst, void *src, size_t n) {
 #ifndef NO_EXCEPTIONS
   try {
@@ -926,7 +3362,8 @@ int trusimd_copy_to_host(trusimd_hardware *h, void *dst, void *src, size_t n) {
     // clang-format off
     switch(h->accelerator) {
     case TRUSIMD_LLVM: return llvm_copy_to_host(h, dst, src, n);
-    case TRUSIMD_OPENCL: return opencl_copy_to_host(h, dst, src, n);
+    case TRUSIMD_OPENCL:
+      return opencl_copy_to_host(h, dst, src, n, 0, NULL, NULL);
     case TRUSIMD_CUDA: return cuda_copy_to_host(h, dst, src, n);
     }
     // clang-format on
@@ -944,6 +3381,10 @@ int trusimd_copy_to_host(trusimd_hardware *h, void *dst, void *src, size_t n) {
 
 int trusimd_compile_run_ap(trusimd_hardware *h, kernel *k, int n, va_list ap) {
   int res = 0;
+  // Devices reject empty launches, there is nothing to compute nor to reduce
+  if (n == 0) {
+    return 0;
+  }
 #ifndef NO_EXCEPTIONS
   try {
 #endif
@@ -952,7 +3393,7 @@ int trusimd_compile_run_ap(trusimd_hardware *h, kernel *k, int n, va_list ap) {
       res = llvm_compile_run(h, k, n, ap);
       break;
     case TRUSIMD_OPENCL:
-      res = opencl_compile_run(h, k, n, ap);
+      res = opencl_compile_run(h, k, 0, NULL, NULL, n, ap);
       break;
     case TRUSIMD_CUDA:
       res = cuda_compile_run(h, k, n, ap);
@@ -975,6 +3416,282 @@ int trusimd_compile_run(trusimd_hardware *h, kernel *k, int n, ...) {
   return res;
 }
 
+// ----------------------------------------------------------------------------
+// Asynchronous copies and launches, only OpenCL has native events, other
+// backends wait for the wait list and complete the operation at once
+
+int trusimd_wait(int nb_events, trusimd_event **events) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    return opencl_wait(nb_events, events);
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &e) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+void trusimd_release_event(trusimd_event *e) {
+  if (e == NULL) {
+    return;
+  }
+  if (e->accelerator == TRUSIMD_OPENCL) {
+    opencl_release_event(e);
+  }
+  delete e;
+}
+
+static inline std::unique_ptr<trusimd_event> new_event(trusimd_hardware *h) {
+  std::unique_ptr<trusimd_event> res(new trusimd_event);
+  res->accelerator = h->accelerator;
+  res->native = NULL;
+  return res;
+}
+
+static inline int end_async(std::unique_ptr<trusimd_event> &e, int code,
+                            trusimd_event **event) {
+  if (code == -1 || event == NULL) {
+    trusimd_release_event(e.release());
+  } else {
+    *event = e.release();
+  }
+  return code;
+}
+
+int trusimd_copy_to_device_async(trusimd_hardware *h, void *dst, void *src,
+                                 size_t n, int nb_events,
+                                 trusimd_event **events,
+                                 trusimd_event **event) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    std::unique_ptr<trusimd_event> e(new_event(h));
+    int code;
+    if (h->accelerator == TRUSIMD_OPENCL) {
+      code = opencl_copy_to_device(h, dst, src, n, nb_events, events, e.get());
+    } else {
+      code = trusimd_wait(nb_events, events);
+      if (code == 0) {
+        code = trusimd_copy_to_device(h, dst, src, n);
+      }
+    }
+    return end_async(e, code, event);
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &e) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+int trusimd_copy_to_host_async(trusimd_hardware *h, void *dst, void *src,
+                               size_t n, int nb_events, trusimd_event **events,
+                               trusimd_event **event) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    std::unique_ptr<trusimd_event> e(new_event(h));
+    int code;
+    if (h->accelerator == TRUSIMD_OPENCL) {
+      code = opencl_copy_to_host(h, dst, src, n, nb_events, events, e.get());
+    } else {
+      code = trusimd_wait(nb_events, events);
+      if (code == 0) {
+        code = trusimd_copy_to_host(h, dst, src, n);
+      }
+    }
+    return end_async(e, code, event);
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &e) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+int trusimd_compile_run_async_ap(trusimd_hardware *h, kernel *k,
+                                 int nb_events, trusimd_event **events,
+                                 trusimd_event **event, int n, va_list ap) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    std::unique_ptr<trusimd_event> e(new_event(h));
+    int code;
+    if (h->accelerator == TRUSIMD_OPENCL && n == 0) {
+      code = opencl_marker(h, nb_events, events, e.get());
+    } else if (h->accelerator == TRUSIMD_OPENCL) {
+      code = opencl_compile_run(h, k, nb_events, events, e.get(), n, ap);
+    } else {
+      code = trusimd_wait(nb_events, events);
+      if (code == 0) {
+        code = trusimd_compile_run_ap(h, k, n, ap);
+      }
+    }
+    return end_async(e, code, event);
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &e) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+int trusimd_compile_run_async(trusimd_hardware *h, kernel *k, int nb_events,
+                              trusimd_event **events, trusimd_event **event,
+                              int n, ...) {
+  va_list ap;
+  va_start(ap, n);
+  int res = trusimd_compile_run_async_ap(h, k, nb_events, events, event, n, ap);
+  va_end(ap);
+  return res;
+}
+
+// ----------------------------------------------------------------------------
+// Streams are copies of a hardware with their own queue, copies and launches
+// on different streams of the same device may run concurrently
+
+int trusimd_create_stream(trusimd_hardware *h, trusimd_hardware *stream,
+                          int flags) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    // clang-format off
+    switch(h->accelerator) {
+    case TRUSIMD_OPENCL: return opencl_create_stream(h, stream, flags);
+    case TRUSIMD_CUDA: return cuda_create_stream(h, stream, flags);
+    default: *stream = *h; return 0;
+    }
+    // clang-format on
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &e) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+int trusimd_destroy_stream(trusimd_hardware *stream) {
+  // clang-format off
+  switch(stream->accelerator) {
+  case TRUSIMD_OPENCL: return opencl_destroy_stream(stream);
+  case TRUSIMD_CUDA: return cuda_destroy_stream(stream);
+  default: return 0;
+  }
+  // clang-format on
+}
+
+// ----------------------------------------------------------------------------
+// Hardware options
+
+int trusimd_set_hardware_option(trusimd_hardware *h, int option, long value) {
+  if (option < 0 || option >= TRUSIMD_NB_OPTIONS) {
+    trusimd_errno = TRUSIMD_EINDEX;
+    return -1;
+  }
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    std::lock_guard<std::mutex> lock(options_mutex);
+    std::vector<long> &v = options[hardware_key(h)];
+    if (v.empty()) {
+      v.assign(option_defaults, option_defaults + TRUSIMD_NB_OPTIONS);
+    }
+    v[size_t(option)] = value;
+    return 0;
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &e) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+long trusimd_get_hardware_option(trusimd_hardware *h, int option) {
+  if (option < 0 || option >= TRUSIMD_NB_OPTIONS) {
+    trusimd_errno = TRUSIMD_EINDEX;
+    return -1;
+  }
+  return get_option(h, option);
+}
+
+// ----------------------------------------------------------------------------
+// Compiled kernels cache
+
+int trusimd_get_cache_stats(trusimd_hardware *h, trusimd_cache_stats *stats) {
+  switch (h->accelerator) {
+  case TRUSIMD_LLVM:
+    return llvm_get_cache_stats(stats);
+  case TRUSIMD_OPENCL:
+    return opencl_get_cache_stats(stats);
+  default:
+    memset((void *)stats, 0, sizeof(trusimd_cache_stats));
+    return 0;
+  }
+}
+
+int trusimd_evict_kernel(trusimd_hardware *h, kernel *k) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    switch (h->accelerator) {
+    case TRUSIMD_LLVM:
+      return llvm_evict_kernel(h, k);
+    case TRUSIMD_OPENCL:
+      return opencl_evict_kernel(h, k);
+    default:
+      return 0;
+    }
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &e) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+int trusimd_set_cache_dir(const char *dir) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    std::lock_guard<std::mutex> lock(cache_dir_mutex);
+    cache_dir = (dir == NULL ? "" : dir);
+    cache_dir_set = true;
+    return 0;
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &e) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Start compiling a kernel in the background, its first launch on the same
+// hardware then waits only for what remains of the compilation
+
+int trusimd_prepare_kernel(trusimd_hardware *h, kernel *k) {
+#ifndef NO_EXCEPTIONS
+  try {
+#endif
+    // Kernels are ended first as the C++ wrapper does, their IR is complete
+    trusimd_end_kernel(k);
+    // clang-format off
+    switch (h->accelerator) {
+    case TRUSIMD_LLVM: return llvm_prepare_kernel(h, k);
+    case TRUSIMD_OPENCL: return opencl_prepare_kernel(h, k);
+    default: return 0;
+    }
+    // clang-format on
+#ifndef NO_EXCEPTIONS
+  } catch (std::exception &e) {
+    trusimd_errno = TRUSIMD_ENOMEM;
+    return -1;
+  }
+#endif
+}
+
 // ----------------------------------------------------------------------------
 
 } // extern "C"
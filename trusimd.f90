@@ -14,6 +14,27 @@ module trusimd
   integer, parameter :: TRUSIMD_SCALAR   = 0
   integer, parameter :: TRUSIMD_VECTOR   = 1
 
+  integer, parameter :: TRUSIMD_NOALIAS  = 1
+
+  integer, parameter :: TRUSIMD_STRICT   = 0
+  integer, parameter :: TRUSIMD_CONTRACT = 1
+  integer, parameter :: TRUSIMD_FAST     = 2
+
+  integer, parameter :: TRUSIMD_REDUCE_SUM = 0
+  integer, parameter :: TRUSIMD_REDUCE_MIN = 1
+  integer, parameter :: TRUSIMD_REDUCE_MAX = 2
+
+  integer, parameter :: TRUSIMD_CMP_EQ = 0
+  integer, parameter :: TRUSIMD_CMP_NE = 1
+  integer, parameter :: TRUSIMD_CMP_LT = 2
+  integer, parameter :: TRUSIMD_CMP_LE = 3
+  integer, parameter :: TRUSIMD_CMP_GT = 4
+  integer, parameter :: TRUSIMD_CMP_GE = 5
+
+  integer, parameter :: TRUSIMD_CONVERT_TRUNC = 0
+  integer, parameter :: TRUSIMD_CONVERT_ROUND = 1
+  integer, parameter :: TRUSIMD_CONVERT_SAT   = 2
+
   integer, parameter :: TRUSIMD_NOHWD    = -1
   integer, parameter :: TRUSIMD_LLVM     = 0
   integer, parameter :: TRUSIMD_CUDA     = 1
@@ -22,6 +43,7 @@ module trusimd
   ! Base types
   type, bind(c) :: trusimd_type
     integer(kind=c_int) :: scalar_vector, kind_, width, nb_times_ptr;
+    integer(kind=c_int) :: flags = 0
   end type
 
   ! Base types
@@ -61,6 +83,56 @@ module trusimd
     module procedure trusimd_add
   end interface
 
+  ! Elementwise operations extending the intrinsics of the same name
+  interface fma
+    module procedure trusimd_fma
+  end interface
+
+  interface min
+    module procedure trusimd_min
+  end interface
+
+  interface max
+    module procedure trusimd_max
+  end interface
+
+  interface abs
+    module procedure trusimd_abs
+  end interface
+
+  interface sqrt
+    module procedure trusimd_sqrt
+  end interface
+
+  interface merge
+    module procedure trusimd_merge
+  end interface
+
+  ! Comparisons giving booleans to use with merge or trusimd_select
+  interface operator(==)
+    module procedure trusimd_eq
+  end interface
+
+  interface operator(/=)
+    module procedure trusimd_ne
+  end interface
+
+  interface operator(<)
+    module procedure trusimd_lt
+  end interface
+
+  interface operator(<=)
+    module procedure trusimd_le
+  end interface
+
+  interface operator(>)
+    module procedure trusimd_gt
+  end interface
+
+  interface operator(>=)
+    module procedure trusimd_ge
+  end interface
+
   interface
     function c_trusimd_get_global_id(k) result(v) &
              bind(c, name="trusimd_get_global_id")
@@ -90,6 +162,7 @@ module trusimd
   type :: trusimd_buffer_pair
     integer     :: n
     type(c_ptr) :: h, host_ptr, dev_ptr
+    logical     :: shared = .false.
   contains
     final :: buffer_pair_dtor
   end type
@@ -123,6 +196,25 @@ contains
     end do
   end subroutine
 
+  ! ---------------------------------------------------------------------------
+  ! Pointer argument that aliases no other argument of the kernel
+  function noalias(t) result(res)
+    type(trusimd_type), intent(in) :: t
+    type(trusimd_type) :: res
+    res = t
+    res%flags = ior(res%flags, TRUSIMD_NOALIAS)
+  end function
+
+  ! ---------------------------------------------------------------------------
+  ! Vector version of a type, variables assigned under a condition that
+  ! differs between lanes must have one
+  function vector(t) result(res)
+    type(trusimd_type), intent(in) :: t
+    type(trusimd_type) :: res
+    res = t
+    res%scalar_vector = TRUSIMD_VECTOR
+  end function
+
   ! ---------------------------------------------------------------------------
   ! My sizeof
   function trusimd_sizeof(t) result(s)
@@ -191,6 +283,212 @@ contains
     end if
   end function
 
+  function trusimd_fma(v1, v2, v3) result(w)
+    type(trusimd_var), intent(in) :: v1, v2, v3
+    type(trusimd_var) :: w
+    interface
+      function c_trusimd_fma(k, v1_, v2_, v3_) result(w_) &
+               bind(c, name="trusimd_fma")
+        import
+        type(c_ptr), value :: k
+        integer(kind=c_int), value :: v1_, v2_, v3_
+        integer(kind=c_int) :: w_
+      end function
+    end interface
+    w%id = c_trusimd_fma(current_kernel, v1%id, v2%id, v3%id)
+    if (w%id == -1) then
+      print '(2A)', ': error: ', trusimd_strerror(trusimd_errno)
+      stop -1
+    end if
+  end function
+
+  function trusimd_min(v1, v2) result(w)
+    type(trusimd_var), intent(in) :: v1, v2
+    type(trusimd_var) :: w
+    interface
+      function c_trusimd_min(k, v1_, v2_) result(w_) &
+               bind(c, name="trusimd_min")
+        import
+        type(c_ptr), value :: k
+        integer(kind=c_int), value :: v1_, v2_
+        integer(kind=c_int) :: w_
+      end function
+    end interface
+    w%id = c_trusimd_min(current_kernel, v1%id, v2%id)
+    if (w%id == -1) then
+      print '(2A)', ': error: ', trusimd_strerror(trusimd_errno)
+      stop -1
+    end if
+  end function
+
+  function trusimd_max(v1, v2) result(w)
+    type(trusimd_var), intent(in) :: v1, v2
+    type(trusimd_var) :: w
+    interface
+      function c_trusimd_max(k, v1_, v2_) result(w_) &
+               bind(c, name="trusimd_max")
+        import
+        type(c_ptr), value :: k
+        integer(kind=c_int), value :: v1_, v2_
+        integer(kind=c_int) :: w_
+      end function
+    end interface
+    w%id = c_trusimd_max(current_kernel, v1%id, v2%id)
+    if (w%id == -1) then
+      print '(2A)', ': error: ', trusimd_strerror(trusimd_errno)
+      stop -1
+    end if
+  end function
+
+  function trusimd_abs(v) result(w)
+    type(trusimd_var), intent(in) :: v
+    type(trusimd_var) :: w
+    interface
+      function c_trusimd_abs(k, v_) result(w_) &
+               bind(c, name="trusimd_abs")
+        import
+        type(c_ptr), value :: k
+        integer(kind=c_int), value :: v_
+        integer(kind=c_int) :: w_
+      end function
+    end interface
+    w%id = c_trusimd_abs(current_kernel, v%id)
+    if (w%id == -1) then
+      print '(2A)', ': error: ', trusimd_strerror(trusimd_errno)
+      stop -1
+    end if
+  end function
+
+  function trusimd_sqrt(v) result(w)
+    type(trusimd_var), intent(in) :: v
+    type(trusimd_var) :: w
+    interface
+      function c_trusimd_sqrt(k, v_) result(w_) &
+               bind(c, name="trusimd_sqrt")
+        import
+        type(c_ptr), value :: k
+        integer(kind=c_int), value :: v_
+        integer(kind=c_int) :: w_
+      end function
+    end interface
+    w%id = c_trusimd_sqrt(current_kernel, v%id)
+    if (w%id == -1) then
+      print '(2A)', ': error: ', trusimd_strerror(trusimd_errno)
+      stop -1
+    end if
+  end function
+
+  function trusimd_cmp(op, v1, v2) result(w)
+    integer, intent(in) :: op
+    type(trusimd_var), intent(in) :: v1, v2
+    type(trusimd_var) :: w
+    interface
+      function c_trusimd_cmp(k, op_, v1_, v2_) result(w_) &
+               bind(c, name="trusimd_cmp")
+        import
+        type(c_ptr), value :: k
+        integer(kind=c_int), value :: op_, v1_, v2_
+        integer(kind=c_int) :: w_
+      end function
+    end interface
+    w%id = c_trusimd_cmp(current_kernel, int(op, kind=c_int), v1%id, v2%id)
+    if (w%id == -1) then
+      print '(2A)', ': error: ', trusimd_strerror(trusimd_errno)
+      stop -1
+    end if
+  end function
+
+  function trusimd_eq(v1, v2) result(w)
+    type(trusimd_var), intent(in) :: v1, v2
+    type(trusimd_var) :: w
+    w = trusimd_cmp(TRUSIMD_CMP_EQ, v1, v2)
+  end function
+
+  function trusimd_ne(v1, v2) result(w)
+    type(trusimd_var), intent(in) :: v1, v2
+    type(trusimd_var) :: w
+    w = trusimd_cmp(TRUSIMD_CMP_NE, v1, v2)
+  end function
+
+  function trusimd_lt(v1, v2) result(w)
+    type(trusimd_var), intent(in) :: v1, v2
+    type(trusimd_var) :: w
+    w = trusimd_cmp(TRUSIMD_CMP_LT, v1, v2)
+  end function
+
+  function trusimd_le(v1, v2) result(w)
+    type(trusimd_var), intent(in) :: v1, v2
+    type(trusimd_var) :: w
+    w = trusimd_cmp(TRUSIMD_CMP_LE, v1, v2)
+  end function
+
+  function trusimd_gt(v1, v2) result(w)
+    type(trusimd_var), intent(in) :: v1, v2
+    type(trusimd_var) :: w
+    w = trusimd_cmp(TRUSIMD_CMP_GT, v1, v2)
+  end function
+
+  function trusimd_ge(v1, v2) result(w)
+    type(trusimd_var), intent(in) :: v1, v2
+    type(trusimd_var) :: w
+    w = trusimd_cmp(TRUSIMD_CMP_GE, v1, v2)
+  end function
+
+  function trusimd_select(mask, v1, v2) result(w)
+    type(trusimd_var), intent(in) :: mask, v1, v2
+    type(trusimd_var) :: w
+    interface
+      function c_trusimd_select(k, mask_, v1_, v2_) result(w_) &
+               bind(c, name="trusimd_select")
+        import
+        type(c_ptr), value :: k
+        integer(kind=c_int), value :: mask_, v1_, v2_
+        integer(kind=c_int) :: w_
+      end function
+    end interface
+    w%id = c_trusimd_select(current_kernel, mask%id, v1%id, v2%id)
+    if (w%id == -1) then
+      print '(2A)', ': error: ', trusimd_strerror(trusimd_errno)
+      stop -1
+    end if
+  end function
+
+  ! Same argument order as the merge intrinsic
+  function trusimd_merge(tsource, fsource, mask) result(w)
+    type(trusimd_var), intent(in) :: tsource, fsource, mask
+    type(trusimd_var) :: w
+    w = trusimd_select(mask, tsource, fsource)
+  end function
+
+  ! Conversion to the kind and width of t, mode defaults to truncation
+  function trusimd_convert(v, t, mode) result(w)
+    type(trusimd_var), intent(in) :: v
+    type(trusimd_type), intent(in) :: t
+    integer, intent(in), optional :: mode
+    type(trusimd_var) :: w
+    integer(kind=c_int) :: mode_
+    interface
+      function c_trusimd_convert(k, v_, t_, mode_) result(w_) &
+               bind(c, name="trusimd_convert")
+        import
+        type(c_ptr), value :: k
+        integer(kind=c_int), value :: v_
+        type(trusimd_type), value :: t_
+        integer(kind=c_int), value :: mode_
+        integer(kind=c_int) :: w_
+      end function
+    end interface
+    mode_ = TRUSIMD_CONVERT_TRUNC
+    if (present(mode)) then
+      mode_ = int(mode, kind=c_int)
+    end if
+    w%id = c_trusimd_convert(current_kernel, v%id, t, mode_)
+    if (w%id == -1) then
+      print '(2A)', ': error: ', trusimd_strerror(trusimd_errno)
+      stop -1
+    end if
+  end function
+
   function ld(v) result(w)
     type(trusimd_var), intent(in) :: v
     type(trusimd_var) :: w
@@ -231,6 +529,124 @@ contains
     end if
   end subroutine
 
+  ! Floating point precision policy of the current kernel
+  subroutine trusimd_set_precision(precision)
+    integer, intent(in) :: precision
+    interface
+      function c_trusimd_set_precision(k, precision_) result(code_) &
+               bind(c, name="trusimd_set_precision")
+        import
+        type(c_ptr), value :: k
+        integer(kind=c_int), value :: precision_
+        integer(kind=c_int) :: code_
+      end function
+    end interface
+    if (c_trusimd_set_precision(current_kernel, &
+                                int(precision, kind=c_int)) == -1) then
+      print '(2A)', ': error: ', trusimd_strerror(trusimd_errno)
+      stop -1
+    end if
+  end subroutine
+
+  ! Structured control flow, loops go from begin to end excluded
+  subroutine trusimd_if(cond)
+    type(trusimd_var), intent(in) :: cond
+    interface
+      function c_trusimd_if(k, cond_) result(code_) &
+               bind(c, name="trusimd_if")
+        import
+        type(c_ptr), value :: k
+        integer(kind=c_int), value :: cond_
+        integer(kind=c_int) :: code_
+      end function
+    end interface
+    if (c_trusimd_if(current_kernel, cond%id) == -1) then
+      print '(2A)', ': error: ', trusimd_strerror(trusimd_errno)
+      stop -1
+    end if
+  end subroutine
+
+  subroutine trusimd_else()
+    interface
+      function c_trusimd_else(k) result(code_) &
+               bind(c, name="trusimd_else")
+        import
+        type(c_ptr), value :: k
+        integer(kind=c_int) :: code_
+      end function
+    end interface
+    if (c_trusimd_else(current_kernel) == -1) then
+      print '(2A)', ': error: ', trusimd_strerror(trusimd_errno)
+      stop -1
+    end if
+  end subroutine
+
+  subroutine trusimd_end_if()
+    interface
+      function c_trusimd_end_if(k) result(code_) &
+               bind(c, name="trusimd_end_if")
+        import
+        type(c_ptr), value :: k
+        integer(kind=c_int) :: code_
+      end function
+    end interface
+    if (c_trusimd_end_if(current_kernel) == -1) then
+      print '(2A)', ': error: ', trusimd_strerror(trusimd_errno)
+      stop -1
+    end if
+  end subroutine
+
+  subroutine trusimd_for(i, begin, end)
+    type(trusimd_var), intent(in) :: i, begin, end
+    interface
+      function c_trusimd_for(k, i_, begin_, end_) result(code_) &
+               bind(c, name="trusimd_for")
+        import
+        type(c_ptr), value :: k
+        integer(kind=c_int), value :: i_, begin_, end_
+        integer(kind=c_int) :: code_
+      end function
+    end interface
+    if (c_trusimd_for(current_kernel, i%id, begin%id, end%id) == -1) then
+      print '(2A)', ': error: ', trusimd_strerror(trusimd_errno)
+      stop -1
+    end if
+  end subroutine
+
+  subroutine trusimd_end_for()
+    interface
+      function c_trusimd_end_for(k) result(code_) &
+               bind(c, name="trusimd_end_for")
+        import
+        type(c_ptr), value :: k
+        integer(kind=c_int) :: code_
+      end function
+    end interface
+    if (c_trusimd_end_for(current_kernel) == -1) then
+      print '(2A)', ': error: ', trusimd_strerror(trusimd_errno)
+      stop -1
+    end if
+  end subroutine
+
+  subroutine trusimd_reduce(op, ptr, v)
+    integer, intent(in) :: op
+    type(trusimd_var), intent(in) :: ptr, v
+    interface
+      function c_trusimd_reduce(k, op_, ptr_, v_) result(code_) &
+               bind(c, name="trusimd_reduce")
+        import
+        type(c_ptr), value :: k
+        integer(kind=c_int), value :: op_, ptr_, v_
+        integer(kind=c_int) :: code_
+      end function
+    end interface
+    if (c_trusimd_reduce(current_kernel, int(op, kind=c_int), ptr%id, v%id) &
+                         == -1) then
+      print '(2A)', ': error: ', trusimd_strerror(trusimd_errno)
+      stop -1
+    end if
+  end subroutine
+
   function arg(i) result(v)
     integer, intent(in) :: i
     type(trusimd_var) :: v
@@ -242,7 +658,7 @@ contains
         integer(kind=c_int) :: n_
       end function
       function c_arg(k_, i_) result(j_) &
-               bind(c, name="c_trusimd_get_kernel_arg")
+               bind(c, name="trusimd_get_kernel_arg")
         import
         type(c_ptr), value :: k_
         integer(kind=c_int), value :: i_
@@ -325,6 +741,14 @@ contains
         integer(kind=c_size_t), value :: n_
         type(c_ptr) :: ptr_
       end function
+      function c_trusimd_device_malloc_shared(h_, n_, host_ptr_) &
+               result(ptr_) bind(c, name="trusimd_device_malloc_shared")
+        import
+        type(c_ptr), value :: h_
+        integer(kind=c_size_t), value :: n_
+        type(c_ptr) :: host_ptr_
+        type(c_ptr) :: ptr_
+      end function
       function c_malloc(n_) result(ptr_) bind(c, name="malloc")
         import
         integer(kind=c_size_t), value :: n_
@@ -332,9 +756,17 @@ contains
       end function
     end interface
     this%n = n * trusimd_sizeof(t)
+    this%h = h%h
+    ! When the host can access device memory there is only one buffer and
+    ! copies are no-ops
+    this%dev_ptr = c_trusimd_device_malloc_shared(h%h, &
+                     int(this%n, kind=c_size_t), this%host_ptr)
+    this%shared = c_associated(this%dev_ptr)
+    if (this%shared) then
+      return
+    end if
     this%host_ptr = c_malloc(int(this%n, kind=c_size_t))
     this%dev_ptr = c_trusimd_device_malloc(h%h, int(this%n, kind=c_size_t))
-    this%h = h%h
   end function
 
   subroutine buffer_pair_dtor(this)
@@ -351,7 +783,9 @@ contains
       end subroutine
     end interface
     call c_trusimd_device_free(this%h, this%dev_ptr)
-    call c_free(this%host_ptr)
+    if (.not. this%shared) then
+      call c_free(this%host_ptr)
+    end if
   end subroutine
 
   function trusimd_copy_to_device(b) result(code)
@@ -28,6 +28,18 @@ struct trusimd_hardware {
 };
 
 struct trusimd_kernel;
+struct trusimd_event;
+
+#define TRUSIMD_NB_THREADS   0 // LLVM: number of threads, 0 = all cores
+#define TRUSIMD_CHUNK_SIZE   1 // LLVM: elements per chunk, 0 = automatic
+#define TRUSIMD_MASKED_TAIL  2 // LLVM: masked vector tail instead of scalar
+#define TRUSIMD_ALIGNMENT    3 // LLVM: alignment in bytes of device buffers
+#define TRUSIMD_POOL_SLAB_SIZE 4 // OpenCL: bytes per pool slab, 0 = no pool
+#define TRUSIMD_SVM          5 // OpenCL: shared virtual memory buffers
+#define TRUSIMD_PROFILING    6 // OpenCL: time copies and launches on device
+#define TRUSIMD_OPENCL_VECTORIZE 7 // OpenCL: vectorN types per work-item
+#define TRUSIMD_OPENCL_SPIRV 8 // OpenCL: build from SPIR-V instead of C
+#define TRUSIMD_NB_OPTIONS   9
 
 #define TRUSIMD_SIGNED    0
 #define TRUSIMD_UNSIGNED  1
@@ -37,11 +49,54 @@ struct trusimd_kernel;
 #define TRUSIMD_SCALAR    0
 #define TRUSIMD_VECTOR    1
 
+#define TRUSIMD_NOALIAS   1 // pointer argument aliases no other argument
+
+#define TRUSIMD_OUT_OF_ORDER 1 // stream may reorder operations, use events
+
+#define TRUSIMD_STRICT    0 // IEEE 754 operations, no contraction
+#define TRUSIMD_CONTRACT  1 // a * b + c may be fused into one rounding
+#define TRUSIMD_FAST      2 // also reassociation, approximations, no NaN/Inf
+
+#define TRUSIMD_REDUCE_SUM 0
+#define TRUSIMD_REDUCE_MIN 1
+#define TRUSIMD_REDUCE_MAX 2
+
+#define TRUSIMD_CMP_EQ 0 // signedness of operands picks the integer variant,
+#define TRUSIMD_CMP_NE 1 // floats compare ordered except for != that is
+#define TRUSIMD_CMP_LT 2 // true when an operand is NaN, as in C
+#define TRUSIMD_CMP_LE 3
+#define TRUSIMD_CMP_GT 4
+#define TRUSIMD_CMP_GE 5
+
+#define TRUSIMD_CONVERT_TRUNC 0 // floats to integers round toward zero,
+#define TRUSIMD_CONVERT_ROUND 1 // or to nearest even, may be or-ed with
+#define TRUSIMD_CONVERT_SAT   2 // clamping to the destination, NaN gives 0
+
 struct trusimd_type {
   int scalar_vector, kind, width, nb_times_ptr;
+  int flags;
 };
 
-const trusimd_type trusimd_notype = {0, 0, 0, 0};
+const trusimd_type trusimd_notype = {0, 0, 0, 0, 0};
+
+struct trusimd_cache_stats {
+  unsigned long hits, misses, nb_entries;
+  double build_time; // in seconds
+};
+
+struct trusimd_pool_stats {
+  unsigned long nb_allocs, nb_frees, nb_slabs;
+  size_t in_use, high_water, reserved; // in bytes
+};
+
+struct trusimd_profile {
+  char name[64]; // kernel name, copy_to_device or copy_to_host
+  unsigned long count;
+  double queued_time;  // from enqueue to submission, in seconds
+  double submit_time;  // from submission to start, in seconds
+  double run_time;     // from start to end, in seconds
+  double max_run_time; // in seconds
+};
 
 #ifdef _MSC_VER
 #define TRUSIMD_TLS __declspec(thread)
@@ -60,21 +115,81 @@ int trusimd_get_kernel_arg(trusimd_kernel *, int);
 const char *trusimd_get_cuda(trusimd_kernel *);
 const char *trusimd_get_opencl(trusimd_kernel *);
 const char *trusimd_get_llvmir(trusimd_kernel *);
+const unsigned *trusimd_get_spirv(trusimd_kernel *, size_t *);
 const char *trusimd_strerror(int);
 int trusimd_var(trusimd_kernel *, trusimd_type);
 int trusimd_assign(trusimd_kernel *, int, int);
 int trusimd_load(trusimd_kernel *, int, int);
 int trusimd_store(trusimd_kernel *, int, int, int);
 int trusimd_add(trusimd_kernel *, int, int);
+int trusimd_fma(trusimd_kernel *, int, int, int); // a * b + c, one rounding
+int trusimd_min(trusimd_kernel *, int, int);
+int trusimd_max(trusimd_kernel *, int, int);
+int trusimd_abs(trusimd_kernel *, int);
+int trusimd_sqrt(trusimd_kernel *, int);
+int trusimd_cmp(trusimd_kernel *, int, int, int); // TRUSIMD_CMP_*, a, b
+int trusimd_select(trusimd_kernel *, int, int, int); // mask ? a : b
+/* Converts a value (2nd argument) to the kind and width of a type, the
+   result is a vector if the value is one. Modes (4th argument) only change
+   conversions to integers, without TRUSIMD_CONVERT_SAT integers wrap around
+   and out of range floats give unspecified values. */
+int trusimd_convert(trusimd_kernel *, int, trusimd_type, int);
+/* Combines the value (4th argument) of every global index into the first
+   element of a pointer argument of the kernel (3rd argument), in no
+   particular order, with TRUSIMD_REDUCE_SUM, _MIN or _MAX. */
+int trusimd_reduce(trusimd_kernel *, int, int, int);
+/* Structured control flow, blocks end with trusimd_end_if/_end_for or with
+   the kernel. As in C, values and variables created in a block are only
+   valid in it. Under a condition differing between lanes (a vector boolean)
+   only vector variables (see trusimd_vector) can be assigned. Loops are
+   counted: the scalar integer variable (2nd argument) goes from begin (3rd)
+   to end (4th) excluded, bounds are the same for all lanes. */
+int trusimd_if(trusimd_kernel *, int);
+int trusimd_else(trusimd_kernel *);
+int trusimd_end_if(trusimd_kernel *);
+int trusimd_for(trusimd_kernel *, int, int, int);
+int trusimd_end_for(trusimd_kernel *);
 int trusimd_get_global_id(trusimd_kernel *);
+int trusimd_set_precision(trusimd_kernel *, int);
+int trusimd_get_precision(trusimd_kernel *);
+trusimd_type trusimd_noalias(trusimd_type);
+trusimd_type trusimd_vector(trusimd_type); // one value per lane
 int trusimd_poll(trusimd_hardware **);
 void *trusimd_device_malloc(trusimd_hardware *, size_t);
+void *trusimd_device_malloc_shared(trusimd_hardware *, size_t, void **);
 void trusimd_device_free(trusimd_hardware *, void *);
 trusimd_hardware *trusimd_find_first_hardware(trusimd_hardware *, int, int);
 int trusimd_copy_to_device(trusimd_hardware *, void *, void *, size_t);
 int trusimd_copy_to_host(trusimd_hardware *, void *, void *, size_t);
 int trusimd_compile_run(trusimd_hardware *, trusimd_kernel *, int, ...);
 int trusimd_compile_run_ap(trusimd_hardware *, trusimd_kernel *, int, va_list);
+/* Asynchronous variants start after the events of the wait list (count then
+   array) and set *event (if not NULL) to an event to pass to trusimd_wait and
+   to release with trusimd_release_event. Host buffers must not be touched
+   before the operation completes. */
+int trusimd_copy_to_device_async(trusimd_hardware *, void *, void *, size_t,
+                                 int, trusimd_event **, trusimd_event **);
+int trusimd_copy_to_host_async(trusimd_hardware *, void *, void *, size_t, int,
+                               trusimd_event **, trusimd_event **);
+int trusimd_compile_run_async(trusimd_hardware *, trusimd_kernel *, int,
+                              trusimd_event **, trusimd_event **, int, ...);
+int trusimd_compile_run_async_ap(trusimd_hardware *, trusimd_kernel *, int,
+                                 trusimd_event **, trusimd_event **, int,
+                                 va_list);
+int trusimd_wait(int, trusimd_event **);
+void trusimd_release_event(trusimd_event *);
+int trusimd_create_stream(trusimd_hardware *, trusimd_hardware *, int);
+int trusimd_get_pool_stats(trusimd_hardware *, trusimd_pool_stats *);
+int trusimd_trim_pool(trusimd_hardware *);
+int trusimd_get_profiles(trusimd_hardware *, trusimd_profile *, int);
+void trusimd_reset_profiles(trusimd_hardware *);
+int trusimd_destroy_stream(trusimd_hardware *);
+int trusimd_set_hardware_option(trusimd_hardware *, int, long);
+long trusimd_get_hardware_option(trusimd_hardware *, int);
+int trusimd_get_cache_stats(trusimd_hardware *, trusimd_cache_stats *);
+int trusimd_evict_kernel(trusimd_hardware *, trusimd_kernel *);
+int trusimd_set_cache_dir(const char *); // NULL or "" = no persistence
+int trusimd_prepare_kernel(trusimd_hardware *, trusimd_kernel *);
 
 #define TRUSIMD_NOERR    0
 #define TRUSIMD_ENOMEM   1
@@ -8,6 +8,7 @@
 #include <cstdlib>
 #include <string>
 #include <cstring>
+#include <vector>
 #include <iostream>
 
 #ifndef NO_EXCEPTIONS
@@ -76,32 +77,43 @@ struct gid_type {
 } gid;
 
 // Base types
-const trusimd_type int8 = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 8, 0};
-const trusimd_type uint8 = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 8, 0};
-const trusimd_type int16 = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 16, 0};
-const trusimd_type uint16 = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 16, 0};
-const trusimd_type float16 = {TRUSIMD_SCALAR, TRUSIMD_FLOAT, 16, 0};
-const trusimd_type bfloat16 = {TRUSIMD_SCALAR, TRUSIMD_BFLOAT, 16, 0};
-const trusimd_type int32 = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 32, 0};
-const trusimd_type uint32 = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 32, 0};
-const trusimd_type float32 = {TRUSIMD_SCALAR, TRUSIMD_FLOAT, 32, 0};
-const trusimd_type int64 = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 64, 0};
-const trusimd_type uint64 = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 64, 0};
-const trusimd_type float64 = {TRUSIMD_SCALAR, TRUSIMD_FLOAT, 64, 0};
+const trusimd_type int8 = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 8, 0, 0};
+const trusimd_type uint8 = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 8, 0, 0};
+const trusimd_type int16 = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 16, 0, 0};
+const trusimd_type uint16 = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 16, 0, 0};
+const trusimd_type float16 = {TRUSIMD_SCALAR, TRUSIMD_FLOAT, 16, 0, 0};
+const trusimd_type bfloat16 = {TRUSIMD_SCALAR, TRUSIMD_BFLOAT, 16, 0, 0};
+const trusimd_type int32 = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 32, 0, 0};
+const trusimd_type uint32 = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 32, 0, 0};
+const trusimd_type float32 = {TRUSIMD_SCALAR, TRUSIMD_FLOAT, 32, 0, 0};
+const trusimd_type int64 = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 64, 0, 0};
+const trusimd_type uint64 = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 64, 0, 0};
+const trusimd_type float64 = {TRUSIMD_SCALAR, TRUSIMD_FLOAT, 64, 0, 0};
 
 // Pointers to base types
-const trusimd_type int8ptr = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 8, 1};
-const trusimd_type uint8ptr = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 8, 1};
-const trusimd_type int16ptr = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 16, 1};
-const trusimd_type uint16ptr = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 16, 1};
-const trusimd_type float16ptr = {TRUSIMD_SCALAR, TRUSIMD_FLOAT, 16, 1};
-const trusimd_type bfloat16ptr = {TRUSIMD_SCALAR, TRUSIMD_BFLOAT, 16, 1};
-const trusimd_type int32ptr = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 32, 1};
-const trusimd_type uint32ptr = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 32, 1};
-const trusimd_type float32ptr = {TRUSIMD_SCALAR, TRUSIMD_FLOAT, 32, 1};
-const trusimd_type int64ptr = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 64, 1};
-const trusimd_type uint64ptr = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 64, 1};
-const trusimd_type float64ptr = {TRUSIMD_SCALAR, TRUSIMD_FLOAT, 64, 1};
+const trusimd_type int8ptr = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 8, 1, 0};
+const trusimd_type uint8ptr = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 8, 1, 0};
+const trusimd_type int16ptr = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 16, 1, 0};
+const trusimd_type uint16ptr = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 16, 1, 0};
+const trusimd_type float16ptr = {TRUSIMD_SCALAR, TRUSIMD_FLOAT, 16, 1, 0};
+const trusimd_type bfloat16ptr = {TRUSIMD_SCALAR, TRUSIMD_BFLOAT, 16, 1, 0};
+const trusimd_type int32ptr = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 32, 1, 0};
+const trusimd_type uint32ptr = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 32, 1, 0};
+const trusimd_type float32ptr = {TRUSIMD_SCALAR, TRUSIMD_FLOAT, 32, 1, 0};
+const trusimd_type int64ptr = {TRUSIMD_SCALAR, TRUSIMD_SIGNED, 64, 1, 0};
+const trusimd_type uint64ptr = {TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 64, 1, 0};
+const trusimd_type float64ptr = {TRUSIMD_SCALAR, TRUSIMD_FLOAT, 64, 1, 0};
+
+// Pointer argument that aliases no other argument of the kernel
+inline trusimd_type noalias(trusimd_type const &t) {
+  return trusimd_noalias(t);
+}
+
+// Vector version of a type, variables assigned under a condition that
+// differs between lanes must have one
+inline trusimd_type vector(trusimd_type const &t) {
+  return trusimd_vector(t);
+}
 
 class var {
 private:
@@ -128,8 +140,25 @@ private:
     return res;
   }
 
+  var cmp(int op, var const &other) {
+    var res;
+    TRUSIMD_THROW_IF_ERROR_INT(
+        res.id = trusimd_cmp(current_kernel, op, (*this)(), other()));
+    return res;
+  }
+
   friend inline var arg(int);
   friend inline var get_global_index(void);
+  friend inline var fma(var const &, var const &, var const &);
+  friend inline var min(var const &, var const &);
+  friend inline var max(var const &, var const &);
+  friend inline var abs(var const &);
+  friend inline var sqrt(var const &);
+  friend inline void reduce(int, var const &, var const &);
+  friend inline var select(var const &, var const &, var const &);
+  friend inline var convert(var const &, trusimd_type, int);
+  friend inline void if_(var const &);
+  friend inline void for_(var &, var const &, var const &);
 
 public:
   var &operator=(var const &other) {
@@ -150,6 +179,14 @@ public:
     return res;
   }
 
+  // Comparisons give booleans to use with select
+  var operator==(var const &other) { return cmp(TRUSIMD_CMP_EQ, other); }
+  var operator!=(var const &other) { return cmp(TRUSIMD_CMP_NE, other); }
+  var operator<(var const &other) { return cmp(TRUSIMD_CMP_LT, other); }
+  var operator<=(var const &other) { return cmp(TRUSIMD_CMP_LE, other); }
+  var operator>(var const &other) { return cmp(TRUSIMD_CMP_GT, other); }
+  var operator>=(var const &other) { return cmp(TRUSIMD_CMP_GE, other); }
+
   var operator[](var const &index) {
     var res;
     res.id = (*this)();
@@ -166,11 +203,154 @@ public:
   }
 };
 
+// a * b + c with only one rounding
+inline var fma(var const &a, var const &b, var const &c) {
+  var res;
+  TRUSIMD_THROW_IF_ERROR_INT(res.id =
+                                 trusimd_fma(current_kernel, a(), b(), c()));
+  return res;
+}
+
+inline var min(var const &a, var const &b) {
+  var res;
+  TRUSIMD_THROW_IF_ERROR_INT(res.id = trusimd_min(current_kernel, a(), b()));
+  return res;
+}
+
+inline var max(var const &a, var const &b) {
+  var res;
+  TRUSIMD_THROW_IF_ERROR_INT(res.id = trusimd_max(current_kernel, a(), b()));
+  return res;
+}
+
+inline var abs(var const &a) {
+  var res;
+  TRUSIMD_THROW_IF_ERROR_INT(res.id = trusimd_abs(current_kernel, a()));
+  return res;
+}
+
+inline var sqrt(var const &a) {
+  var res;
+  TRUSIMD_THROW_IF_ERROR_INT(res.id = trusimd_sqrt(current_kernel, a()));
+  return res;
+}
+
+// mask ? a : b without branching, mask is a boolean given by a comparison
+inline var select(var const &mask, var const &a, var const &b) {
+  var res;
+  TRUSIMD_THROW_IF_ERROR_INT(
+      res.id = trusimd_select(current_kernel, mask(), a(), b()));
+  return res;
+}
+
+// Conversion to the kind and width of t, mode is TRUSIMD_CONVERT_TRUNC or
+// TRUSIMD_CONVERT_ROUND possibly or-ed with TRUSIMD_CONVERT_SAT
+inline var convert(var const &a, trusimd_type t,
+                   int mode = TRUSIMD_CONVERT_TRUNC) {
+  var res;
+  TRUSIMD_THROW_IF_ERROR_INT(
+      res.id = trusimd_convert(current_kernel, a(), t, mode));
+  return res;
+}
+
+// Structured control flow: if_(c); ... else_(); ... end_if(); and
+// for_(i, begin, end); ... end_for(); for i in [begin, end)
+inline void if_(var const &cond) {
+  TRUSIMD_THROW_IF_ERROR_INT(trusimd_if(current_kernel, cond()));
+}
+
+inline void else_() {
+  TRUSIMD_THROW_IF_ERROR_INT(trusimd_else(current_kernel));
+}
+
+inline void end_if() {
+  TRUSIMD_THROW_IF_ERROR_INT(trusimd_end_if(current_kernel));
+}
+
+inline void for_(var &i, var const &begin, var const &end) {
+  TRUSIMD_THROW_IF_ERROR_INT(
+      trusimd_for(current_kernel, i(), begin(), end()));
+}
+
+inline void end_for() {
+  TRUSIMD_THROW_IF_ERROR_INT(trusimd_end_for(current_kernel));
+}
+
+// ptr[0] = op(ptr[0], v) over all global indices, ptr is a kernel argument
+// and op is TRUSIMD_REDUCE_SUM, TRUSIMD_REDUCE_MIN or TRUSIMD_REDUCE_MAX
+inline void reduce(int op, var const &ptr, var const &v) {
+  TRUSIMD_THROW_IF_ERROR_INT(trusimd_reduce(current_kernel, op, ptr(), v()));
+}
+
 // ----------------------------------------------------------------------------
 // Hardware abstraction
 
 typedef trusimd_hardware hardware;
 
+inline void set_option(hardware &h, int option, long value) {
+  TRUSIMD_THROW_IF_ERROR_INT(trusimd_set_hardware_option(&h, option, value));
+}
+
+inline long get_option(hardware &h, int option) {
+  long res;
+  TRUSIMD_THROW_IF_ERROR_INT(res = trusimd_get_hardware_option(&h, option));
+  return res;
+}
+
+// Additional queue on the same device, use it in place of h
+class stream : public hardware {
+private:
+  stream(stream const &);
+  stream &operator=(stream const &);
+
+public:
+  stream(hardware &h, int flags = 0) {
+    TRUSIMD_THROW_IF_ERROR_INT(trusimd_create_stream(&h, this, flags));
+  }
+
+  ~stream() { trusimd_destroy_stream(this); }
+};
+
+// ----------------------------------------------------------------------------
+// Events of asynchronous copies and launches
+
+class event {
+private:
+  trusimd_event *e;
+  event(event const &);
+  event &operator=(event const &);
+
+public:
+  event() : e(NULL) {}
+
+  ~event() { trusimd_release_event(e); }
+
+  trusimd_event *get() const { return e; }
+
+  void set(trusimd_event *e_) {
+    trusimd_release_event(e);
+    e = e_;
+  }
+
+  void wait() {
+    if (e != NULL) {
+      TRUSIMD_THROW_IF_ERROR_INT(trusimd_wait(1, &e));
+    }
+  }
+};
+
+typedef std::vector<event *> wait_list;
+
+namespace detail {
+inline std::vector<trusimd_event *> events(wait_list const &after) {
+  std::vector<trusimd_event *> res;
+  for (size_t i = 0; i < after.size(); i++) {
+    res.push_back(after[i]->get());
+  }
+  return res;
+}
+} // namespace detail
+
 // ----------------------------------------------------------------------------
 // Memory buffer abstraction
 
@@ -179,12 +359,26 @@ private:
   void *host_ptr;
   void *dev_ptr;
   size_t n;
+  bool shared;
   trusimd_hardware h;
 
 public:
   buffer_pair(hardware const &h_, size_t n_) {
     h = h_;
     n = n_ * sizeof(T);
+
+    // When the host can access device memory there is only one buffer and
+    // copies are no-ops or hand the buffer over between the host and the
+    // device, so the host may only access it after copy_to_host and until
+    // the next copy_to_device or launch using it
+    dev_ptr = trusimd_device_malloc_shared(&h, n, &host_ptr);
+    shared = (dev_ptr != NULL);
+    if (shared) {
+      return;
+    } else if (trusimd_errno != TRUSIMD_EAVAIL) {
+      TRUSIMD_THROW(trusimd_errno);
+    }
+
     host_ptr = malloc(n);
     if (host_ptr == NULL) {
       TRUSIMD_THROW(TRUSIMD_ENOMEM);
@@ -193,7 +387,9 @@ public:
   }
 
   ~buffer_pair() {
-    free(host_ptr);
+    if (!shared) {
+      free(host_ptr);
+    }
     trusimd_device_free(&h, dev_ptr);
   }
 
@@ -217,6 +413,45 @@ public:
   void copy_to_host() {
     TRUSIMD_THROW_IF_ERROR_INT(trusimd_copy_to_host(&h, host_ptr, dev_ptr, n));
   }
+
+  // Copies on a given stream of the hardware of the buffer
+  void copy_to_device(hardware &on) {
+    TRUSIMD_THROW_IF_ERROR_INT(
+        trusimd_copy_to_device(&on, dev_ptr, host_ptr, n));
+  }
+
+  void copy_to_host(hardware &on) {
+    TRUSIMD_THROW_IF_ERROR_INT(trusimd_copy_to_host(&on, host_ptr, dev_ptr, n));
+  }
+
+  // Asynchronous copies, the host buffer must be left alone until done
+  void copy_to_device(hardware &on, event &done,
+                      wait_list const &after = wait_list()) {
+    std::vector<trusimd_event *> v(detail::events(after));
+    trusimd_event *e = NULL;
+    TRUSIMD_THROW_IF_ERROR_INT(trusimd_copy_to_device_async(
+        &on, dev_ptr, host_ptr, n, int(v.size()), v.empty() ? NULL : &v[0],
+        &e));
+    done.set(e);
+  }
+
+  void copy_to_device(event &done, wait_list const &after = wait_list()) {
+    copy_to_device(h, done, after);
+  }
+
+  void copy_to_host(hardware &on, event &done,
+                    wait_list const &after = wait_list()) {
+    std::vector<trusimd_event *> v(detail::events(after));
+    trusimd_event *e = NULL;
+    TRUSIMD_THROW_IF_ERROR_INT(trusimd_copy_to_host_async(
+        &on, host_ptr, dev_ptr, n, int(v.size()), v.empty() ? NULL : &v[0],
+        &e));
+    done.set(e);
+  }
+
+  void copy_to_host(event &done, wait_list const &after = wait_list()) {
+    copy_to_host(h, done, after);
+  }
 };
 
 // ----------------------------------------------------------------------------
@@ -276,6 +511,20 @@ public:
     }
     TRUSIMD_THROW_IF_ERROR_INT(trusimd_compile_run(&h, k, n, c(arg)...));
   }
+
+  template <typename... Arg>
+  void run_async(hardware &h, event &done, wait_list const &after, int n,
+                 Arg&... arg) {
+    if (!finished) {
+      trusimd_end_kernel(k);
+      finished = true;
+    }
+    std::vector<trusimd_event *> v(detail::events(after));
+    trusimd_event *e = NULL;
+    TRUSIMD_THROW_IF_ERROR_INT(trusimd_compile_run_async(
+        &h, k, int(v.size()), v.empty() ? NULL : &v[0], &e, n, c(arg)...));
+    done.set(e);
+  }
 #endif
 
   void operator()(hardware &h, int n, ...) {
@@ -290,6 +539,43 @@ public:
     TRUSIMD_THROW_IF_ERROR_INT(code);
   }
 
+  void run_async(hardware &h, event &done, wait_list const &after, int n,
+                 ...) {
+    if (!finished) {
+      trusimd_end_kernel(k);
+      finished = true;
+    }
+    std::vector<trusimd_event *> v(detail::events(after));
+    trusimd_event *e = NULL;
+    va_list ap;
+    va_start(ap, n);
+    int code = trusimd_compile_run_async_ap(
+        &h, k, int(v.size()), v.empty() ? NULL : &v[0], &e, n, ap);
+    va_end(ap);
+    TRUSIMD_THROW_IF_ERROR_INT(code);
+    done.set(e);
+  }
+
+  void evict(hardware &h) {
+    TRUSIMD_THROW_IF_ERROR_INT(trusimd_evict_kernel(&h, k));
+  }
+
+  // TRUSIMD_STRICT, TRUSIMD_CONTRACT or TRUSIMD_FAST
+  void set_precision(int precision) {
+    TRUSIMD_THROW_IF_ERROR_INT(trusimd_set_precision(k, precision));
+  }
+
+  int get_precision() { return trusimd_get_precision(k); }
+
+  // Start compiling the kernel for h in the background
+  void prepare(hardware &h) {
+    if (!finished) {
+      trusimd_end_kernel(k);
+      finished = true;
+    }
+    TRUSIMD_THROW_IF_ERROR_INT(trusimd_prepare_kernel(&h, k));
+  }
+
   ~kernel() {
     trusimd_clear_kernel(k);
     current_kernel = NULL;
@@ -316,6 +602,50 @@ std::ostream &operator<<(std::ostream &o, kernel &k) {
 
 // ----------------------------------------------------------------------------
 
+typedef trusimd_cache_stats cache_stats;
+
+inline cache_stats get_cache_stats(hardware &h) {
+  cache_stats res;
+  TRUSIMD_THROW_IF_ERROR_INT(trusimd_get_cache_stats(&h, &res));
+  return res;
+}
+
+typedef trusimd_profile profile;
+
+inline std::vector<profile> get_profiles(hardware &h) {
+  int n;
+  TRUSIMD_THROW_IF_ERROR_INT(n = trusimd_get_profiles(&h, NULL, 0));
+  std::vector<profile> res((size_t)n);
+  if (n > 0) {
+    int m;
+    TRUSIMD_THROW_IF_ERROR_INT(m = trusimd_get_profiles(&h, &res[0], n));
+    if (m < n) {
+      res.resize(size_t(m));
+    }
+  }
+  return res;
+}
+
+inline void reset_profiles(hardware &h) { trusimd_reset_profiles(&h); }
+
+typedef trusimd_pool_stats pool_stats;
+
+inline pool_stats get_pool_stats(hardware &h) {
+  pool_stats res;
+  TRUSIMD_THROW_IF_ERROR_INT(trusimd_get_pool_stats(&h, &res));
+  return res;
+}
+
+inline void trim_pool(hardware &h) {
+  TRUSIMD_THROW_IF_ERROR_INT(trusimd_trim_pool(&h));
+}
+
+inline void set_cache_dir(std::string const &dir) {
+  TRUSIMD_THROW_IF_ERROR_INT(trusimd_set_cache_dir(dir.c_str()));
+}
+
+// ----------------------------------------------------------------------------
+
 inline var arg(int i) {
   if (i < 0 || i >= trusimd_nb_kernel_args(current_kernel)) {
     TRUSIMD_THROW(TRUSIMD_EINDEX);
@@ -8,14 +8,19 @@ LIBC = C.CDLL('libc.so.6')
 # Set return types here
 LIBC.free.restype = None
 LIBC.malloc.restype = C.c_void_p
+LIB.trusimd_create_kernel.restype = C.c_void_p
 LIB.trusimd_device_malloc.restype = C.c_void_p
+LIB.trusimd_device_malloc_shared.restype = C.c_void_p
 LIB.trusimd_strerror.restype = C.c_char_p
 LIB.trusimd_get_cuda.restype = C.c_char_p
 LIB.trusimd_get_llvmir.restype = C.c_char_p
 LIB.trusimd_get_opencl.restype = C.c_char_p
+LIB.trusimd_get_hardware_option.restype = C.c_long
 
 current_kernel = C.c_void_p(0)
 
+TRUSIMD_EAVAIL = 7
+
 def raise_on_error(a):
     if (type(a) == int and a == -1) or \
        (type(a) == C.c_void_p and (a.value == 0 or a.value == None)):
@@ -65,11 +70,50 @@ int64ptr    = [TRUSIMD_SCALAR, TRUSIMD_SIGNED,   64, 1, C.c_void_p];
 uint64ptr   = [TRUSIMD_SCALAR, TRUSIMD_UNSIGNED, 64, 1, C.c_void_p];
 float64ptr  = [TRUSIMD_SCALAR, TRUSIMD_FLOAT,    64, 1, C.c_void_p];
 
+# Pointer argument that aliases no other argument of the kernel
+TRUSIMD_NOALIAS = 1
+
+def noalias(t):
+    return t[:5] + [TRUSIMD_NOALIAS]
+
+# Vector version of a type, variables assigned under a condition that
+# differs between lanes must have one
+def vector(t):
+    return [TRUSIMD_VECTOR] + t[1:]
+
+# Floating point precision policies of kernels
+TRUSIMD_STRICT = 0
+TRUSIMD_CONTRACT = 1
+TRUSIMD_FAST = 2
+
+# Reduction operators
+TRUSIMD_REDUCE_SUM = 0
+TRUSIMD_REDUCE_MIN = 1
+TRUSIMD_REDUCE_MAX = 2
+
+# Comparison operators
+TRUSIMD_CMP_EQ = 0
+TRUSIMD_CMP_NE = 1
+TRUSIMD_CMP_LT = 2
+TRUSIMD_CMP_LE = 3
+TRUSIMD_CMP_GT = 4
+TRUSIMD_CMP_GE = 5
+
+# Conversion modes, ROUND and SAT may be or-ed
+TRUSIMD_CONVERT_TRUNC = 0
+TRUSIMD_CONVERT_ROUND = 1
+TRUSIMD_CONVERT_SAT = 2
+
 # -----------------------------------------------------------------------------
 # Variable
 
 class var:
+    # A type declares a new variable of the kernel
     def __init__(self, var_id = -1):
+        if type(var_id) == list:
+            var_id = LIB.trusimd_var(current_kernel,
+                                     c_trusimd_type.from_param(var_id))
+            raise_on_error(var_id)
         self.var_id = var_id
 
     def __add__(self, other):
@@ -77,6 +121,35 @@ class var:
         raise_on_error(res.var_id)
         return res
 
+    def __abs__(self):
+        res = var(LIB.trusimd_abs(current_kernel, self.var_id))
+        raise_on_error(res.var_id)
+        return res
+
+    def cmp(self, op, other):
+        res = var(LIB.trusimd_cmp(current_kernel, op, self.var_id,
+                                  other.var_id))
+        raise_on_error(res.var_id)
+        return res
+
+    def __eq__(self, other):
+        return self.cmp(TRUSIMD_CMP_EQ, other)
+
+    def __ne__(self, other):
+        return self.cmp(TRUSIMD_CMP_NE, other)
+
+    def __lt__(self, other):
+        return self.cmp(TRUSIMD_CMP_LT, other)
+
+    def __le__(self, other):
+        return self.cmp(TRUSIMD_CMP_LE, other)
+
+    def __gt__(self, other):
+        return self.cmp(TRUSIMD_CMP_GT, other)
+
+    def __ge__(self, other):
+        return self.cmp(TRUSIMD_CMP_GE, other)
+
     def __getitem__(self, index):
         if type(index) == gid_class:
             i = LIB.trusimd_get_global_id(current_kernel)
@@ -108,6 +181,16 @@ TRUSIMD_LLVM   = 0
 TRUSIMD_CUDA   = 1
 TRUSIMD_OPENCL = 2
 
+TRUSIMD_NB_THREADS = 0
+TRUSIMD_CHUNK_SIZE = 1
+TRUSIMD_MASKED_TAIL = 2
+TRUSIMD_ALIGNMENT = 3
+TRUSIMD_POOL_SLAB_SIZE = 4
+TRUSIMD_SVM = 5
+TRUSIMD_PROFILING = 6
+TRUSIMD_OPENCL_VECTORIZE = 7
+TRUSIMD_OPENCL_SPIRV = 8
+
 class c_hardware(C.Structure):
     _fields_ = [('id', C.c_char * (2 * C.sizeof(C.c_void_p))),
                 ('param1', C.c_char * C.sizeof(C.c_void_p)),
@@ -115,6 +198,14 @@ class c_hardware(C.Structure):
                 ('accelerator', C.c_int),
                 ('description', C.c_char * 256)]
 
+class c_profile(C.Structure):
+    _fields_ = [('name', C.c_char * 64),
+                ('count', C.c_ulong),
+                ('queued_time', C.c_double),
+                ('submit_time', C.c_double),
+                ('run_time', C.c_double),
+                ('max_run_time', C.c_double)]
+
 class hardware:
     def __init__(self, ptr):
         self.ptr = ptr
@@ -128,6 +219,29 @@ class hardware:
     def __str__(self):
         return self.description
 
+    def set_option(self, option, value):
+        raise_on_error(LIB.trusimd_set_hardware_option(self.ptr, option,
+                                                       C.c_long(value)))
+
+    def get_option(self, option):
+        res = LIB.trusimd_get_hardware_option(self.ptr, option)
+        raise_on_error(res)
+        return res
+
+    def get_profiles(self):
+        n = LIB.trusimd_get_profiles(self.ptr, None, 0)
+        raise_on_error(n)
+        profiles = (c_profile * n)()
+        n = min(n, LIB.trusimd_get_profiles(self.ptr, profiles, n))
+        raise_on_error(n)
+        return [{'name': p.name.decode(), 'count': p.count,
+                 'queued_time': p.queued_time, 'submit_time': p.submit_time,
+                 'run_time': p.run_time, 'max_run_time': p.max_run_time}
+                for p in profiles[:n]]
+
+    def reset_profiles(self):
+        LIB.trusimd_reset_profiles(self.ptr)
+
 def poll_hardware():
     hs = C.POINTER(c_hardware)(c_hardware())
     n = LIB.trusimd_poll(C.byref(hs))
@@ -137,6 +251,9 @@ def poll_hardware():
         res.append(hardware(C.pointer(hs[i])))
     return res
 
+def set_cache_dir(d):
+    raise_on_error(LIB.trusimd_set_cache_dir(C.c_char_p(d.encode())))
+
 # -----------------------------------------------------------------------------
 # Memory buffer abstraction
 
@@ -148,6 +265,19 @@ class buffer_pair:
         self.t = t
         self.n = n * sizeof(t)
         self.h = h
+        self.shared = False
+        # When the host can access device memory there is only one buffer
+        # and copies are no-ops
+        host_ptr = C.c_void_p()
+        dev_ptr = LIB.trusimd_device_malloc_shared(
+            h.ptr, C.c_size_t(n * sizeof(t)), C.byref(host_ptr))
+        if dev_ptr is not None:
+            self.shared = True
+            self.dev_ptr = C.c_void_p(dev_ptr)
+            self.host_ptr = host_ptr
+            return
+        if C.c_int.in_dll(LIB, 'trusimd_errno').value != TRUSIMD_EAVAIL:
+            raise_on_error(C.c_void_p(dev_ptr))
         self.host_ptr = C.c_void_p(LIBC.malloc(C.c_size_t(n * sizeof(t))))
         raise_on_error(self.host_ptr)
         self.dev_ptr = C.c_void_p(
@@ -157,7 +287,7 @@ class buffer_pair:
             raise_on_error(self.dev_ptr)
 
     def __del__(self):
-        if 'host_ptr' in self.__dict__:
+        if 'host_ptr' in self.__dict__ and not self.shared:
             LIBC.free(self.host_ptr)
         if 'dev_ptr' in self.__dict__ and 'h' in self.__dict__:
             LIB.trusimd_device_free(self.h.ptr, self.dev_ptr)
@@ -184,7 +314,8 @@ class c_trusimd_type(C.Structure):
     _fields_ = [('scalar_vector', C.c_int),
                 ('kind', C.c_int),
                 ('width', C.c_int),
-                ('nb_times_ptr', C.c_int)]
+                ('nb_times_ptr', C.c_int),
+                ('flags', C.c_int)]
 
     def from_param(t):
         res = c_trusimd_type()
@@ -192,6 +323,7 @@ class c_trusimd_type(C.Structure):
         res.kind = t[1]
         res.width = t[2]
         res.nb_times_ptr = t[3]
+        res.flags = t[5] if len(t) > 5 else 0
         return res
 
 c_trusimd_notype = c_trusimd_type.from_param([0, 0, 0, 0])
@@ -256,6 +388,73 @@ class kernel:
         raise_on_error(LIB.trusimd_compile_run(
             h.ptr, current_kernel, n, *[val(v) for v in args]))
 
+    def prepare(self, h):
+        raise_on_error(LIB.trusimd_prepare_kernel(h.ptr, self.k))
+
+    def set_precision(self, precision):
+        raise_on_error(LIB.trusimd_set_precision(self.k, precision))
+
+    def get_precision(self):
+        return LIB.trusimd_get_precision(self.k)
+
+# -----------------------------------------------------------------------------
+# Elementwise operations, min and max are named after their numpy equivalent
+# to leave the builtins alone
+
+def fma(a, b, c):
+    res = var(LIB.trusimd_fma(current_kernel, a.var_id, b.var_id, c.var_id))
+    raise_on_error(res.var_id)
+    return res
+
+def minimum(a, b):
+    res = var(LIB.trusimd_min(current_kernel, a.var_id, b.var_id))
+    raise_on_error(res.var_id)
+    return res
+
+def maximum(a, b):
+    res = var(LIB.trusimd_max(current_kernel, a.var_id, b.var_id))
+    raise_on_error(res.var_id)
+    return res
+
+def sqrt(a):
+    res = var(LIB.trusimd_sqrt(current_kernel, a.var_id))
+    raise_on_error(res.var_id)
+    return res
+
+def select(mask, a, b):
+    res = var(LIB.trusimd_select(current_kernel, mask.var_id, a.var_id,
+                                 b.var_id))
+    raise_on_error(res.var_id)
+    return res
+
+def convert(v, t, mode = TRUSIMD_CONVERT_TRUNC):
+    res = var(LIB.trusimd_convert(current_kernel, v.var_id,
+                                  c_trusimd_type.from_param(t), mode))
+    raise_on_error(res.var_id)
+    return res
+
+# Structured control flow: if_(c) ... else_() ... end_if() and
+# for_(i, begin, end) ... end_for() for i in [begin, end)
+def if_(cond):
+    raise_on_error(LIB.trusimd_if(current_kernel, cond.var_id))
+
+def else_():
+    raise_on_error(LIB.trusimd_else(current_kernel))
+
+def end_if():
+    raise_on_error(LIB.trusimd_end_if(current_kernel))
+
+def for_(i, begin, end):
+    raise_on_error(LIB.trusimd_for(current_kernel, i.var_id, begin.var_id,
+                                   end.var_id))
+
+def end_for():
+    raise_on_error(LIB.trusimd_end_for(current_kernel))
+
+def reduce(op, ptr, v):
+    raise_on_error(LIB.trusimd_reduce(current_kernel, op, ptr.var_id,
+                                      v.var_id))
+
 # -----------------------------------------------------------------------------
 
 def arg(i):